@@ -0,0 +1,524 @@
+/************************************************************************************
+ *
+ * dpp-mysql - An asynchronous MySQL database wrapper for D++ bots
+ *
+ * Copyright 2020-2024 Craig Edwards <signing@dpp.dev>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ************************************************************************************/
+
+/**
+ * Benchmarks of the wrapper's query paths, run against the database of the
+ * `database` block of a config.json, see README.md. Each benchmark reports
+ * queries per second, the p50 and p99 latency of a query in microseconds, and
+ * the number of operator new calls per query, made by the wrapper, D++ and
+ * the benchmark itself. The client library allocates with malloc(), so its
+ * allocations aren't counted.
+ */
+
+#include <dpp/dpp.h>
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+#include "../database.h"
+#include "../config.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace {
+
+	/**
+	 * @brief Calls of operator new since the process started, by any thread
+	 */
+	std::atomic<uint64_t> allocations{0};
+
+	void* counted_allocate(std::size_t size, std::size_t alignment = 0) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		size = std::max<std::size_t>(size, 1);
+		void* p = alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size);
+		if (!p) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+}
+
+void* operator new(std::size_t size) {
+	return counted_allocate(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+namespace bench {
+
+	using clock = std::chrono::steady_clock;
+
+	/**
+	 * @brief Scratch table the row benchmarks read, created at startup and dropped at exit
+	 */
+	constexpr const char* table = "dpp_mysql_bench";
+
+	/**
+	 * @brief Rows in the scratch table, the largest result the row benchmarks fetch
+	 */
+	constexpr size_t table_rows = 100000;
+
+	/**
+	 * @brief Queries each producer thread keeps queued at once in the submission benchmarks
+	 */
+	constexpr size_t submission_window = 64;
+
+	/**
+	 * @brief Placeholders bound by each query of the binding benchmarks, so that
+	 * binding weighs more than the round trip
+	 */
+	constexpr size_t bound_parameters = 32;
+
+	/**
+	 * @brief Statement of the prepared statement and submission benchmarks
+	 */
+	const std::string select_one = "SELECT ?";
+
+	/**
+	 * @brief Latencies of one thread's queries. Queries finishing on worker threads
+	 * add to it concurrently, hence the mutex.
+	 */
+	class latency_samples {
+		std::mutex mutex;
+		std::vector<double> microseconds;
+	public:
+		/**
+		 * @param expected number of samples, reserved so that recording doesn't allocate
+		 */
+		explicit latency_samples(size_t expected) {
+			microseconds.reserve(expected);
+		}
+
+		void add(clock::duration latency) {
+			std::lock_guard<std::mutex> samples_lock(mutex);
+			microseconds.emplace_back(std::chrono::duration<double, std::micro>(latency).count());
+		}
+
+		/**
+		 * @brief Nearest-rank percentile of the samples
+		 *
+		 * @param p percentile, 0 to 100
+		 * @return latency in microseconds, 0 if there are no samples
+		 */
+		double percentile(double p) {
+			std::lock_guard<std::mutex> samples_lock(mutex);
+			if (microseconds.empty()) {
+				return 0;
+			}
+			size_t rank = std::min(microseconds.size() - 1, static_cast<size_t>(p / 100.0 * static_cast<double>(microseconds.size())));
+			std::nth_element(microseconds.begin(), microseconds.begin() + rank, microseconds.end());
+			return microseconds[rank];
+		}
+	};
+
+	/**
+	 * @brief Measurements of one thread of a benchmark, reported as its counters by finish()
+	 */
+	class measurement {
+		benchmark::State& state;
+		uint64_t allocations_at_start;
+	public:
+		latency_samples samples;
+
+		explicit measurement(benchmark::State& s) : state(s), allocations_at_start(allocations.load()), samples(s.max_iterations) {
+		}
+
+		/**
+		 * @brief Report queries per second, p50 and p99 latency and allocations per query.
+		 * Allocations are counted by the first thread across every thread of the benchmark.
+		 *
+		 * @param queries queries run by this thread
+		 */
+		void finish(int64_t queries) {
+			state.SetItemsProcessed(queries);
+			state.counters["p50_us"] = benchmark::Counter(samples.percentile(50), benchmark::Counter::kAvgThreads);
+			state.counters["p99_us"] = benchmark::Counter(samples.percentile(99), benchmark::Counter::kAvgThreads);
+			if (state.thread_index() == 0 && queries > 0) {
+				double total = static_cast<double>(queries) * state.threads();
+				state.counters["allocs/query"] = static_cast<double>(allocations.load() - allocations_at_start) / total;
+			}
+		}
+	};
+
+	/**
+	 * @brief Stop a benchmark if a query failed
+	 *
+	 * @return true if the query succeeded
+	 */
+	bool check(benchmark::State& state, const db::resultset& rs) {
+		if (!rs.ok()) {
+			state.SkipWithError(rs.error.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Run a synchronous query once per iteration, timing each
+	 */
+	template <typename F> void time_queries(benchmark::State& state, F&& run) {
+		measurement m(state);
+		for (auto _ : state) {
+			auto start = clock::now();
+			db::resultset rs = run();
+			m.samples.add(clock::now() - start);
+			if (!check(state, rs)) {
+				break;
+			}
+			benchmark::DoNotOptimize(rs);
+		}
+		m.finish(state.iterations());
+	}
+
+	/**
+	 * @brief A statement already prepared on every connection
+	 */
+	void prepared_hit(benchmark::State& state) {
+		time_queries(state, [] {
+			return db::query(select_one, { int64_t(1) });
+		});
+	}
+
+	/**
+	 * @brief A statement already prepared, by its interned handle, skipping the lookup of its text
+	 */
+	void prepared_hit_interned(benchmark::State& state) {
+		db::query_key key = db::intern(select_one);
+		time_queries(state, [&key] {
+			return db::query(key, { int64_t(1) });
+		});
+	}
+
+	/**
+	 * @brief A statement never seen before, which is interned and prepared before it
+	 * executes. Each one stays prepared, so the iterations are limited to stay well
+	 * below the server's max_prepared_stmt_count.
+	 */
+	void prepared_miss(benchmark::State& state) {
+		static uint64_t unique{0};
+		time_queries(state, [] {
+			return db::query(fmt::format("SELECT ? + {}", unique++), { int64_t(1) });
+		});
+	}
+
+	/**
+	 * @brief The same value bound to every placeholder of a statement
+	 *
+	 * @param value value to bind
+	 */
+	void bind(benchmark::State& state, db::parameter_type value) {
+		std::string sql = "SELECT ?";
+		for (size_t i = 1; i < bound_parameters; ++i) {
+			sql += ", ?";
+		}
+		db::paramlist parameters(bound_parameters, value);
+		db::query_key key = db::intern(sql);
+		time_queries(state, [&key, &parameters] {
+			return db::query(key, parameters);
+		});
+	}
+
+	/**
+	 * @brief Fetch and read every field of range(0) rows, as text when range(1) is 0
+	 * and as native values when it is 1
+	 */
+	void materialise(benchmark::State& state) {
+		db::query_key key = db::intern(fmt::format("SELECT id, label, score FROM {} ORDER BY id LIMIT ?", table));
+		db::query_options options;
+		options.fetch = state.range(1) ? db::fetch_typed : db::fetch_text;
+		uint64_t limit = state.range(0);
+		time_queries(state, [&] {
+			db::resultset rs = db::query(key, { limit }, options);
+			uint64_t ids{0};
+			size_t label_bytes{0};
+			double scores{0};
+			for (size_t i = 0; i < rs.size(); ++i) {
+				db::row_view row = rs[i];
+				ids += row.get<uint64_t>(0);
+				label_bytes += row.get<std::string_view>(1).size();
+				scores += row.get<double>(2);
+			}
+			benchmark::DoNotOptimize(ids);
+			benchmark::DoNotOptimize(label_bytes);
+			benchmark::DoNotOptimize(scores);
+			return rs;
+		});
+		state.counters["rows/s"] = benchmark::Counter(static_cast<double>(state.iterations() * limit), benchmark::Counter::kIsRate);
+	}
+
+	/**
+	 * @brief Queries in flight from one producer thread of a submission benchmark
+	 */
+	struct producer {
+		std::atomic<size_t> in_flight{0};
+		std::atomic<bool> failed{false};
+		measurement* m{nullptr};
+
+		void wait_below(size_t limit) {
+			while (in_flight.load() >= limit) {
+				std::this_thread::yield();
+			}
+		}
+
+		void done(const db::resultset& rs, clock::time_point submitted) {
+			m->samples.add(clock::now() - submitted);
+			if (!rs.ok()) {
+				failed = true;
+			}
+			--in_flight;
+		}
+	};
+
+	/**
+	 * @brief Queue queries with query_callback() from each of the benchmark's threads,
+	 * up to submission_window at a time. Latency is from submission to the callback.
+	 */
+	void submit_callback(benchmark::State& state) {
+		measurement m(state);
+		producer p;
+		p.m = &m;
+		for (auto _ : state) {
+			p.wait_below(submission_window);
+			++p.in_flight;
+			db::query_callback(select_one, { int64_t(1) }, [&p, submitted = clock::now()](const db::resultset& rs) {
+				p.done(rs, submitted);
+			});
+		}
+		p.wait_below(1);
+		if (p.failed) {
+			state.SkipWithError("query_callback failed");
+		}
+		m.finish(state.iterations());
+	}
+
+#ifdef DPP_CORO
+	/**
+	 * @brief Await one co_query() for a submission benchmark. Pointers rather than
+	 * references, as a dpp::job outlives the call which starts it.
+	 */
+	dpp::job await_query(producer* p) {
+		auto submitted = clock::now();
+		/* Built outside the co_await, as GCC 12 can't put a braced list's array in a coroutine frame */
+		db::paramlist parameters{ int64_t(1) };
+		db::resultset rs = co_await db::co_query(select_one, std::move(parameters));
+		p->done(rs, submitted);
+	}
+
+	/**
+	 * @brief Queue queries with co_query() from each of the benchmark's threads,
+	 * up to submission_window at a time. Latency is from submission to the awaiting
+	 * coroutine resuming.
+	 */
+	void submit_co_query(benchmark::State& state) {
+		measurement m(state);
+		producer p;
+		p.m = &m;
+		for (auto _ : state) {
+			p.wait_below(submission_window);
+			++p.in_flight;
+			await_query(&p);
+		}
+		p.wait_below(1);
+		if (p.failed) {
+			state.SkipWithError("co_query failed");
+		}
+		m.finish(state.iterations());
+	}
+#endif
+
+	/**
+	 * @brief A read answered from the result cache, shared without a copy
+	 */
+	void result_cache_hit(benchmark::State& state) {
+		std::string sql = fmt::format("SELECT id, label, score FROM {} WHERE id = ?", table);
+		db::query_cached(sql, { uint64_t(1) }, 3600);
+		measurement m(state);
+		for (auto _ : state) {
+			auto start = clock::now();
+			std::shared_ptr<const db::resultset> rs = db::query_cached(sql, { uint64_t(1) }, 3600);
+			m.samples.add(clock::now() - start);
+			if (!check(state, *rs)) {
+				break;
+			}
+			benchmark::DoNotOptimize(rs);
+		}
+		m.finish(state.iterations());
+	}
+
+	/**
+	 * @brief A read answered from the result cache, copied into a resultset
+	 */
+	void result_cache_hit_copy(benchmark::State& state) {
+		std::string sql = fmt::format("SELECT id, label, score FROM {} WHERE id = ?", table);
+		time_queries(state, [&sql] {
+			return db::query(sql, { uint64_t(1) }, 3600.0);
+		});
+	}
+
+	/**
+	 * @brief Time from queueing a transaction until its closure starts running on a
+	 * worker, which is what p50 and p99 report. The iteration time includes the
+	 * closure's update and the commit.
+	 */
+	void transaction_gate(benchmark::State& state) {
+		std::string sql = fmt::format("UPDATE {} SET score = score + 1 WHERE id = ?", table);
+		measurement m(state);
+		for (auto _ : state) {
+			std::atomic<bool> done{false};
+			std::string error;
+			clock::time_point submitted = clock::now();
+			clock::time_point entered = submitted;
+			db::transaction([&] {
+				entered = clock::now();
+				return db::query(sql, { uint64_t(1) }).ok();
+			}, [&](const db::resultset& rs) {
+				error = rs.error;
+				done = true;
+				done.notify_one();
+			});
+			done.wait(false);
+			m.samples.add(entered - submitted);
+			if (!error.empty()) {
+				state.SkipWithError(error.c_str());
+				break;
+			}
+		}
+		m.finish(state.iterations());
+	}
+
+	/**
+	 * @brief Create and fill the scratch table
+	 *
+	 * @return true if it is ready
+	 */
+	bool create_table() {
+		db::query(fmt::format("DROP TABLE IF EXISTS {}", table));
+		db::resultset rs = db::query(fmt::format("CREATE TABLE {} (id BIGINT UNSIGNED NOT NULL PRIMARY KEY, label VARCHAR(64) NOT NULL, score DOUBLE NOT NULL)", table));
+		if (!rs.ok()) {
+			std::cerr << "Can't create " << table << ": " << rs.error << "\n";
+			return false;
+		}
+		std::vector<db::paramlist> rows;
+		rows.reserve(table_rows);
+		for (uint64_t id = 1; id <= table_rows; ++id) {
+			rows.push_back({ id, fmt::format("row {}", id), static_cast<double>(id) / 3.0 });
+		}
+		rs = db::query_batch(fmt::format("INSERT INTO {} (id, label, score) VALUES (?, ?, ?)", table), rows);
+		if (!rs.ok()) {
+			std::cerr << "Can't fill " << table << ": " << rs.error << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Producer thread counts of the submission benchmarks
+	 */
+	void producers(benchmark::internal::Benchmark* b) {
+		for (int threads : { 1, 2, 4, 8, 16 }) {
+			b->Threads(threads);
+		}
+		b->UseRealTime();
+	}
+
+	const std::string short_text(16, 'x');
+	const std::string long_text(4096, 'x');
+
+	/* Real time throughout, as a query mostly waits on the server and the worker threads */
+	BENCHMARK(prepared_hit)->UseRealTime();
+	BENCHMARK(prepared_hit_interned)->UseRealTime();
+	BENCHMARK(prepared_miss)->Iterations(1000)->UseRealTime();
+
+	BENCHMARK_CAPTURE(bind, int32, db::parameter_type(int32_t(-42)))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, uint32, db::parameter_type(uint32_t(42)))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, int64, db::parameter_type(int64_t(-42)))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, uint64, db::parameter_type(uint64_t(42)))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, bool, db::parameter_type(true))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, float, db::parameter_type(1.5f))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, double, db::parameter_type(1.5))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, null, db::parameter_type(nullptr))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, string_16, db::parameter_type(short_text))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, string_4k, db::parameter_type(long_text))->UseRealTime();
+	BENCHMARK_CAPTURE(bind, borrow_4k, db::parameter_type(db::borrow(long_text)))->UseRealTime();
+
+	BENCHMARK(materialise)->ArgNames({ "rows", "typed" })->ArgsProduct({ { 1, 1000, int64_t(table_rows) }, { 0, 1 } })->Unit(benchmark::kMicrosecond)->UseRealTime();
+
+	BENCHMARK(submit_callback)->Apply(producers);
+#ifdef DPP_CORO
+	BENCHMARK(submit_co_query)->Apply(producers);
+#endif
+
+	BENCHMARK(result_cache_hit)->UseRealTime();
+	BENCHMARK(result_cache_hit_copy)->UseRealTime();
+
+	BENCHMARK(transaction_gate)->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+	const char* config_file = std::getenv("DPP_MYSQL_BENCH_CONFIG");
+	config::init(config_file ? config_file : "config.json");
+
+	/* No token is needed, the cluster only provides logging, timers and the thread pool */
+	dpp::cluster bot("");
+	bot.on_log([](const dpp::log_t& event) {
+		if (event.severity >= dpp::ll_warning) {
+			std::cerr << dpp::utility::loglevel(event.severity) << ": " << event.message << "\n";
+		}
+	});
+	db::init(bot);
+	if (!bench::create_table()) {
+		return 1;
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+
+	db::query(fmt::format("DROP TABLE IF EXISTS {}", bench::table));
+	db::close();
+	benchmark::Shutdown();
+	return 0;
+}
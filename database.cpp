@@ -21,604 +21,5525 @@
 #include "database.h"
 #include "config.h"
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include <fmt/format.h>
 #include <unordered_map>
+#include <shared_mutex>
+#include <deque>
+#include <list>
+#include <set>
+#include <fstream>
 #include <mutex>
 #include <chrono>
 #include <atomic>
+#include <bit>
+#include <cmath>
 
+/**
+ * Session variable limiting how long a statement may run. MariaDB counts it in
+ * seconds, and applies it to every statement; MySQL counts it in milliseconds,
+ * and applies it to SELECT only. Zero is no limit on both.
+ */
 #ifdef MARIADB_VERSION_ID
-	#define CONNECT_STRING "SET @@SESSION.max_statement_time=3000"
+	#define STATEMENT_TIME_VARIABLE "max_statement_time"
+	#define STATEMENT_TIME_SCALE 0.001
 #else
-	#define CONNECT_STRING "SET @@SESSION.max_execution_time=3000"
+	#define STATEMENT_TIME_VARIABLE "max_execution_time"
+	#define STATEMENT_TIME_SCALE 1
+#endif
+
+/**
+ * The non-blocking engine needs the MariaDB non-blocking API, and the socket engine of D++ 10.1
+ */
+#if defined(MYSQL_WAIT_READ) && defined(DPP_VERSION_LONG) && DPP_VERSION_LONG >= 0x00100100
+	#define DB_ASYNC_ENGINE 1
+	#include <coroutine>
+	#include <utility>
+	#include <unistd.h>
+	#include <fcntl.h>
 #endif
 
 namespace db {
 
 	using namespace std::literals::chrono_literals;
 
+	column_list::column_list(std::vector<std::string> column_names, std::vector<column_type> column_types) : names(std::move(column_names)), types(std::move(column_types)) {
+		types.resize(names.size(), ct_text);
+		for (size_t i = 0; i < names.size(); ++i) {
+			/* Later duplicate column names take precedence, as they did for std::map rows */
+			index[names[i]] = i;
+		}
+	}
+
+	row_view::operator row() const {
+		row r;
+		for (size_t c = 0; c < set->column_count(); ++c) {
+			r[set->columns()->names[c]] = get<std::string>(c);
+		}
+		return r;
+	}
+
+	void rowset::append(std::string_view v, bool null) {
+		size_t column_total = column_count();
+		if (column_total == 0) {
+			return;
+		}
+		values.append(v);
+		offsets.push_back(values.size());
+		nulls.push_back(null);
+		if ((offsets.size() - 1) % column_total == 0) {
+			row_count = (offsets.size() - 1) / column_total;
+		}
+	}
+
+	void rowset::reserve(size_t rows, size_t bytes) {
+		offsets.reserve(rows * column_count() + 1);
+		nulls.reserve(rows * column_count());
+		values.reserve(bytes);
+	}
+
+	void rowset::push_back(const row& r) {
+		/* Add any columns this rowset does not have yet */
+		std::vector<std::string> names = column_names ? column_names->names : std::vector<std::string>{};
+		size_t old_column_total = names.size();
+		for (const auto& value : r) {
+			if (!column_names || column_names->find(value.first) == std::string_view::npos) {
+				names.emplace_back(value.first);
+			}
+		}
+		if (names.size() != old_column_total) {
+			/* Lay out existing rows again, with empty values for the new columns */
+			decltype(offsets) new_offsets(1, 0, resource());
+			decltype(nulls) new_nulls(resource());
+			new_offsets.reserve(row_count * names.size() + 1);
+			new_nulls.reserve(row_count * names.size());
+			for (size_t i = 0; i < row_count; ++i) {
+				for (size_t c = 0; c < old_column_total; ++c) {
+					new_offsets.push_back(offsets[i * old_column_total + c + 1]);
+					new_nulls.push_back(nulls[i * old_column_total + c]);
+				}
+				for (size_t c = old_column_total; c < names.size(); ++c) {
+					new_offsets.push_back(new_offsets.back());
+					new_nulls.push_back(false);
+				}
+			}
+			offsets = std::move(new_offsets);
+			nulls = std::move(new_nulls);
+			/* Standalone rows are text, new columns keep the types of existing ones */
+			std::vector<column_type> types = column_names ? column_names->types : std::vector<column_type>{};
+			column_names = std::make_shared<const column_list>(std::move(names), std::move(types));
+		}
+		if (column_count() == 0) {
+			++row_count;
+			return;
+		}
+		for (size_t c = 0; c < column_count(); ++c) {
+			auto value = r.find(column_names->names[c]);
+			std::string_view text = value == r.end() ? std::string_view() : std::string_view(value->second);
+			if (native && column_names->types[c] >= ct_int) {
+				/* Numeric columns of a typed rowset hold native values, not text */
+				char bytes[8]{};
+				if (column_names->types[c] == ct_int) {
+					int64_t n{};
+					std::from_chars(text.data(), text.data() + text.size(), n);
+					std::memcpy(bytes, &n, sizeof(n));
+				} else if (column_names->types[c] == ct_uint) {
+					uint64_t n{};
+					std::from_chars(text.data(), text.data() + text.size(), n);
+					std::memcpy(bytes, &n, sizeof(n));
+				} else {
+					double n{};
+					std::from_chars(text.data(), text.data() + text.size(), n);
+					std::memcpy(bytes, &n, sizeof(n));
+				}
+				append(std::string_view(bytes, sizeof(bytes)));
+			} else {
+				append(text);
+			}
+		}
+	}
+
+	void rowset::clear() {
+		values.clear();
+		offsets.assign(1, 0);
+		nulls.clear();
+		row_count = 0;
+	}
+
 	/**
-	 * @brief Represents a cached prepared statement.
-	 * We need to store the MYSQL_STMT*, the bound variable pointers,
-	 * and the lengths, plus buffers for char* bound variables.
+	 * @brief Output buffers of a result-returning prepared statement. These are
+	 * kept with the cached statement and reused by every execution. Each variable
+	 * length column starts with a small buffer, which grows to the real length of
+	 * the data the first time a value is truncated.
 	 */
-	struct cached_query {
+	struct result_buffers {
 		/**
-		 * @brief If true, this query expects results, e.g. SELECT, EXPLAIN
+		 * @brief Output bindings, one per column
 		 */
-		bool expects_results{false};
+		std::vector<MYSQL_BIND> bindings;
 
 		/**
-		 * @brief The mysql statement handle
+		 * @brief Output buffers, one per column
+		 */
+		std::vector<std::vector<char>> buffers;
+
+		/**
+		 * @brief Length of each fetched value
+		 */
+		std::vector<unsigned long> lengths;
+
+		/**
+		 * @brief NULL indicator of each fetched value
 		 */
-		MYSQL_STMT* st{nullptr};
+		std::unique_ptr<bool[]> is_null;
 
 		/**
-		 * @brief C pointers to bound variables
+		 * @brief Truncation indicator of each fetched value
 		 */
-		MYSQL_BIND* bindings{nullptr};
+		std::unique_ptr<bool[]> truncated;
 
 		/**
-		 * @brief C pointers to bound variable lengths
+		 * @brief Column layout the bindings were built for
 		 */
-		unsigned long* lengths{nullptr};
+		std::shared_ptr<const column_list> columns;
 
 		/**
-		 * @brief Used to represent a set of C string buffers
+		 * @brief Fetch mode the bindings were built for
 		 */
-		std::vector<std::string> bufs;
+		fetch_mode fetch{fetch_text};
 	};
 
 	/**
-	 * @brief MySQL database connection
+	 * @brief Initial size of the output buffer of a variable length column
 	 */
-	MYSQL connection;
+	constexpr size_t initial_result_buffer = 256;
 
 	/**
-	 * @brief Database mutex
-	 * one connection may only be accessed by one thread at a time!
+	 * @brief Output buffers which grew larger than this to fetch a big value are
+	 * shrunk back once the query completes, rather than being kept in the cache
 	 */
-	std::mutex db_mutex;
+	constexpr size_t retained_result_buffer = 1024 * 1024;
 
 	/**
-	 * @brief Last error string from MySQL
+	 * @brief Size of the first block of a new result arena
 	 */
-	std::string last_error;
+	constexpr size_t initial_arena_block = 16 * 1024;
 
 	/**
-	 * @brief Total number of queries since connection
+	 * @brief Largest first block a recycled result arena grows to. Rows beyond it are
+	 * allocated in further blocks, which are freed when the arena is recycled.
 	 */
-	size_t query_total{0};
+	constexpr size_t retained_arena_block = 1024 * 1024;
 
 	/**
-	 * @brief Number of affected rows from last INSERT, UPDATE or DELETE
+	 * @brief Number of spare result arenas kept by each thread which fetches rows,
+	 * from the "result_arenas" setting. 0 frees every arena with its rows.
 	 */
-	size_t rows_affected{0};
+	std::atomic<size_t> spare_arenas{4};
 
 	/**
-	 * @brief Creating D++ cluster, used for logging
+	 * @brief Bump allocator holding the rows of one result set. Allocating is a pointer
+	 * bump within its first block, or in further blocks from the heap once the first is
+	 * full, and nothing is freed until the whole arena is released.
 	 */
-	dpp::cluster* creator{nullptr};
-
-	std::atomic<bool> transaction_in_progress = false;
-	std::function<void()> transaction_function = {};
-	thread_local bool holds_transaction_lock = false;
+	class result_arena : public std::pmr::memory_resource {
+		/**
+		 * @brief First block, kept when the arena is recycled
+		 */
+		std::unique_ptr<std::byte[]> block;
 
-	/**
-	 * @brief Query cache, a map of cached_query
-	 */
-	std::map<std::string, cached_query> cached_queries;
+		/**
+		 * @brief Size of the first block
+		 */
+		size_t block_size;
 
-	std::condition_variable sql_worker_cv;
+		/**
+		 * @brief Bytes allocated since the arena was last reset
+		 */
+		size_t used{0};
 
-	/**
-	 * @brief Cached query result parameters
-	 */
-	struct cached_query_results {
-		std::string format;
-		paramlist parameters;
-		sql_query_callback callback;
-	};
+		/**
+		 * @brief Allocator bumping through the first block, then further blocks from the heap
+		 */
+		std::optional<std::pmr::monotonic_buffer_resource> bump;
 
-	/**
-	 * @brief Cached query result records with expiry
-	 */
-	struct cached_query_result_set {
-		const resultset results;
-		const double expiry;
-	};
+		void* do_allocate(size_t bytes, size_t alignment) override {
+			used += bytes;
+			return bump->allocate(bytes, alignment);
+		}
 
-	std::queue<cached_query_results> sql_query_queue;
-	std::mutex query_queue_mtx;
+		void do_deallocate(void*, size_t, size_t) override {
+		}
 
-	template<class> inline constexpr bool always_false_v = false;
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+			return this == &other;
+		}
 
-	struct cached_query_hash {
-		std::size_t operator()(const cached_query_results& k) const {
-			size_t x = std::hash<std::string>()(k.format);
-			for (const auto& param : k.parameters) {
-				std::visit([&x](auto &&p) {
-					using T = std::decay_t<decltype(p)>;
-					// float, std::string, uint64_t, int64_t, bool, int32_t, uint32_t, double
-					if constexpr (std::is_same_v<T, float>) {
-						x ^= std::hash<float>()(p);
-					} else if constexpr (std::is_same_v<T, std::string>) {
-						x ^= std::hash<std::string>()(p);
-					} else if constexpr (std::is_same_v<T, uint64_t>) {
-						x ^= std::hash<uint64_t>()(p);
-					} else if constexpr (std::is_same_v<T, int64_t>) {
-						x ^= std::hash<int64_t>()(p);
-					} else if constexpr (std::is_same_v<T, bool>) {
-						x ^= std::hash<bool>()(p);
-					} else if constexpr (std::is_same_v<T, int32_t>) {
-						x ^= std::hash<int32_t>()(p);
-					} else if constexpr (std::is_same_v<T, uint32_t>) {
-						x ^= std::hash<uint32_t>()(p);
-					} else if constexpr (std::is_same_v<T, double>) {
-						x ^= std::hash<double>()(p);
-					} else {
-						static_assert(always_false_v<T>, "non-exhaustive visitor!");
-					}
-				}, param);
-			}
-			return x;
+	public:
+		/**
+		 * @brief Create an arena
+		 * @param size size of the first block
+		 */
+		explicit result_arena(size_t size) : block(std::make_unique_for_overwrite<std::byte[]>(size)), block_size(size) {
+			bump.emplace(block.get(), block_size);
 		}
-	};
-	
-	struct cached_query_equal {
-		bool operator()(const cached_query_results& lhs, const cached_query_results& rhs) const {
-			if (lhs.format != rhs.format || lhs.parameters.size() != rhs.parameters.size()) {
-				return false;
+
+		/**
+		 * @brief Release everything allocated, for reuse by another result set. If the
+		 * rows outgrew the first block, it is replaced by one large enough to hold
+		 * them, up to retained_arena_block, so the next result set fits in one block.
+		 */
+		void reset() {
+			bump.reset();
+			if (used > block_size && block_size < retained_arena_block) {
+				block_size = std::min(std::bit_ceil(used), retained_arena_block);
+				block = std::make_unique_for_overwrite<std::byte[]>(block_size);
 			}
-			return lhs.parameters == rhs.parameters;
+			used = 0;
+			bump.emplace(block.get(), block_size);
 		}
 	};
 
 	/**
-	 * @brief A map of cached, executed queries with results and expiries
+	 * @brief Spare result arenas of one thread. Arenas are returned to it by whichever
+	 * thread destroys the last rowset using them, hence the mutex.
 	 */
-	std::unordered_map<cached_query_results, cached_query_result_set, cached_query_hash, cached_query_equal> cached_query_res;
-
-	size_t cache_size() {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return cached_queries.size();
-	}
-	
-	size_t query_count() {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return query_total;
-	}
+	struct arena_pool {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<result_arena>> spare;
+	};
 
 	/**
-	 * @brief This is an internal connect function which has no locking, there is no public interface for this
-	 * 
-	 * @param host hostname
-	 * @param user username
-	 * @param pass password
-	 * @param db database
-	 * @param port port
-	 * @param socket unix socket
-	 */
-	bool unsafe_connect(const std::string &host, const std::string &user, const std::string &pass, const std::string &db, int port, const std::string &socket) {
-		if (mysql_init(&connection) != nullptr) {
-			mysql_options(&connection, MYSQL_INIT_COMMAND, CONNECT_STRING);
-			int opts = CLIENT_MULTI_RESULTS | CLIENT_MULTI_STATEMENTS | CLIENT_REMEMBER_OPTIONS | CLIENT_IGNORE_SIGPIPE;
-			bool result = mysql_real_connect(&connection, host.c_str(), user.c_str(), pass.c_str(), db.c_str(), port, socket.empty() ? nullptr : socket.c_str(), opts);
-			signal(SIGPIPE, SIG_IGN);
-			return result;
-		} else {
-			last_error = "mysql_init() failed";
-			return false;
-		}
-	}
-
-	bool connect(const std::string &host, const std::string &user, const std::string &pass, const std::string &db, int port, const std::string &socket) {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return unsafe_connect(host, user, pass, db, port, socket);
-	}
-
-	void query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb) {
+	 * @brief Get an arena for the rows of a new result set, from the calling thread's
+	 * spare arenas if it has one
+	 *
+	 * @param size size of the first block, if a new arena is needed
+	 * @return arena, which goes back to this thread's spares once its rows are destroyed
+	 */
+	std::shared_ptr<std::pmr::memory_resource> acquire_arena(size_t size) {
+		thread_local std::shared_ptr<arena_pool> spares = std::make_shared<arena_pool>();
+		std::shared_ptr<arena_pool> pool = spares;
+		std::unique_ptr<result_arena> arena;
 		{
-			std::unique_lock<std::mutex> queue_lock(query_queue_mtx);
-			sql_query_queue.emplace(std::move(cached_query_results{.format = format, .parameters = parameters, .callback = cb}));
+			std::lock_guard<std::mutex> arena_lock(pool->mutex);
+			if (!pool->spare.empty()) {
+				arena = std::move(pool->spare.back());
+				pool->spare.pop_back();
+			}
 		}
-		sql_worker_cv.notify_one();
-	}
-
-#ifdef DPP_CORO
-	dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters) {
-		return dpp::async<resultset>{ [format, parameters] <typename C> (C &&cc) { return query_callback(format, parameters, std::forward<C>(cc)); }};
-	}
-#endif
-
-	void init (dpp::cluster& bot) {
-		creator = &bot;
-		const json& dbconf = config::get("database");
-		if (!db::connect(dbconf["host"], dbconf["username"], dbconf["password"], dbconf["database"], dbconf["port"], dbconf.contains("socket") ? dbconf["socket"] : "")) {
-			creator->log(dpp::ll_critical, fmt::format("Database connection error connecting to {}: {}", dbconf["database"], mysql_error(&connection)));
-			exit(2);
+		if (!arena) {
+			arena = std::make_unique<result_arena>(std::clamp(size, initial_arena_block, retained_arena_block));
 		}
-		std::thread([&]() {
-			dpp::utility::set_thread_name("sql/coro");
-			while (true) {
-				cached_query_results qr;
-				{
-					std::unique_lock<std::mutex> queue_lock(query_queue_mtx);
-					sql_worker_cv.wait(queue_lock, [] {
-						return !sql_query_queue.empty();
-					});
-					if (sql_query_queue.empty()) {
-						continue;
-					}
-					qr = std::move(sql_query_queue.front());
-					sql_query_queue.pop();
-				}
-				/**
-				 * If a transaction is waiting to be executed, fit it atomically into
-				 * the queue here. The holds_transaction_lock is a thread_local variable
-				 * which can only EVER be true on this thread at this time. Only threads
-				 * where this is set to true may issue db::query() calls whilst the
-				 * transaction_in_progress atomic bool is true. This prevents other threads
-				 * running queries that end up inside the transaction.
-				 */
-				if (transaction_in_progress && transaction_function) {
-					holds_transaction_lock = true;
-					transaction_function();
-					holds_transaction_lock = false;
-					transaction_function = {};
-				}
-				resultset results{};
-				if (!qr.format.empty()) {
-					results = query(qr.format, qr.parameters);
-				}
-				if (qr.callback) {
-					qr.callback(results);
-				}
+		/* Result sets often die on another thread, such as a D++ event thread, so the pool is shared with the deleter */
+		return std::shared_ptr<std::pmr::memory_resource>(arena.release(), [pool](std::pmr::memory_resource* r) {
+			std::unique_ptr<result_arena> arena(static_cast<result_arena*>(r));
+			arena->reset();
+			std::lock_guard<std::mutex> arena_lock(pool->mutex);
+			if (pool->spare.size() < spare_arenas) {
+				pool->spare.emplace_back(std::move(arena));
 			}
-		}).detach();
-		creator->log(dpp::ll_info, fmt::format("Connected to database: {}", dbconf["database"]));
+		});
 	}
 
 	/**
-	 * @brief Certain types of query are not supported in the binary protocol
-	 * used for prepared statements. As such they must be executed 'raw', and
-	 * unprepared. This is not exposed to the interface as we don't want users
-	 * directly calling raw_query() and summoning Little Bobby Tables. Only
-	 * queries which return no result set are supported.
-	 * 
-	 * @return true query executed
+	 * @brief Closes a mysql statement handle when its owner is destroyed
 	 */
-	bool raw_query(const std::string& query) {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return mysql_real_query(&connection, query.c_str(), query.length()) == 0;
-	}
+	struct statement_closer {
+		void operator()(MYSQL_STMT* st) const {
+			mysql_stmt_close(st);
+		}
+	};
 
-	bool start_transaction() {
-		return raw_query("START TRANSACTION");
-	}
+	/**
+	 * @brief Owning mysql statement handle
+	 */
+	using statement_ptr = std::unique_ptr<MYSQL_STMT, statement_closer>;
 
-	bool commit() {
-		return raw_query("COMMIT");
-	}
+	/**
+	 * @brief Represents a cached prepared statement.
+	 * We need to store the MYSQL_STMT*, the bound variable pointers,
+	 * and the lengths of bound string variables. It owns all of these, and
+	 * is used in place by reference, never copied.
+	 */
+	struct cached_query {
+		/**
+		 * @brief If true, this query expects results, e.g. SELECT, EXPLAIN
+		 */
+		bool expects_results{false};
 
-	bool rollback() {
-		return raw_query("ROLLBACK");
-	}
+		/**
+		 * @brief The mysql statement handle
+		 */
+		statement_ptr st;
 
-	void transaction(std::function<bool()> closure, sql_query_callback callback) {
+		/**
+		 * @brief Bound parameters, one per placeholder
+		 */
+		std::vector<MYSQL_BIND> bindings;
 
-		if (transaction_in_progress) {
-			throw std::runtime_error("Transaction already in progress");
-		}
+		/**
+		 * @brief Bound parameter lengths, one per placeholder
+		 */
+		std::vector<unsigned long> lengths;
 
 		/**
-		 * Set up transaction function, this is called when the queue is empty
-		 * and the atomic bool transaction_in_progress is set.
+		 * @brief Column names of the statement's results, shared by every
+		 * resultset it returns. Built on first execution.
 		 */
-		transaction_function = [closure](){
-			try {
-				start_transaction();
-				bool should_commit{false};
-				if (closure) {
-					should_commit = closure();
-				}
-				if (should_commit) {
-					commit();
-				} else {
-					rollback();
-				}
-			}
-			catch (...) {
-				rollback();
-			}
-			/**
-			 * Re-enable the SQL queue so that queries can happen again
-			 */
-			transaction_in_progress = false;
-		};
+		std::shared_ptr<const column_list> columns;
 
 		/**
-		 * Set the atomic bool that indicates a transaction should be executed.
-		 * The transaction is inserted into the stream of SQL queries inside the
-		 * SQL thread as one atomic operation. We also have to send a blank callback
-		 * query to signal the condition variable and make the SQL queue advance.
+		 * @brief Reusable output buffers, for queries which expect results
 		 */
-		transaction_in_progress = true;
-		query_callback("", {}, callback);
-	}
+		result_buffers output;
 
-#ifdef DPP_CORO
-	dpp::async<resultset> co_transaction(std::function<bool()> closure) {
-		return dpp::async<resultset>{ [closure] <typename C> (C &&cc) { return transaction(closure, std::forward<C>(cc)); }};
-	}
-#endif
+		/**
+		 * @brief True if the statement is currently set to open a server side cursor
+		 */
+		bool cursor{false};
 
-	bool close() {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		mysql_close(&connection);
-		for (const auto& cc : cached_queries) {
-			mysql_stmt_close(cc.second.st);
-			delete[] cc.second.bindings;
-			delete[] cc.second.lengths;
-		}
-		cached_queries = {};
-		mysql_library_end();
-		return true;
-	}
+		/**
+		 * @brief Rows and bytes of its last result set, reserved up front for the next
+		 */
+		size_t last_rows{0};
+		size_t last_bytes{0};
+	};
 
-	const std::string& error() {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return last_error;
-	}
+	/**
+	 * @brief Interned statement text. The deque never moves its strings, so
+	 * query_key and the lookup map can refer to them directly.
+	 */
+	std::deque<std::string> interned_text;
 
-	void log_error(const std::string& format, const std::string& error) {
-		if (!format.empty()) {
-			last_error = fmt::format("{} (query: {})", error, format);
-			if (error == "Lost connection to MySQL server during query") {
-				db::close();
-				db::init(*creator);
-			}
-		} else {
-			last_error = error;
-		}
-		creator->log(dpp::ll_error, last_error);
-	}
+	/**
+	 * @brief Statement text to interned index
+	 */
+	std::unordered_map<std::string_view, size_t> interned;
 
-	size_t affected_rows() {
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		return rows_affected;
-	}
+	/**
+	 * @brief True for each interned statement which returns rows, by index
+	 */
+	std::deque<bool> interned_reads;
 
-	resultset query(const std::string &format, const paramlist &parameters, double lifetime) {
-		double now = dpp::utility::time_f();
-		cached_query_results r{ .format = format, .parameters = parameters, .callback = nullptr };
-		auto f = cached_query_res.find(r);
-		if (f != cached_query_res.end()) {
-			if (now < f->second.expiry) {
-				return f->second.results;
-			}
-			cached_query_res.erase(f);
-		}
-		cached_query_result_set rs{ .results = query(format, parameters), .expiry = now + lifetime };
-		cached_query_res.emplace(r, rs);
-		return rs.results;
-	}
+	/**
+	 * @brief Result cache tags of the tables each interned statement names, by index
+	 */
+	std::deque<std::vector<uint16_t>> interned_tags;
 
-	resultset query(const std::string &format, const paramlist &parameters) {
+	/**
+	 * @brief Protects interned_text, interned, interned_reads and interned_tags. Lookups of
+	 * existing statements only need a shared lock.
+	 */
+	std::shared_mutex intern_mutex;
 
+	/**
+	 * @brief Lifecycle of a pooled connection's MYSQL handle
+	 */
+	enum connection_state : uint8_t {
 		/**
-		 * If any thread except the queue thread attempts to run a synchronous query whilst
-		 * a transaction is running, it must wait until the transaction completes.
+		 * @brief Handle is open and was working when last used
 		 */
-		while (transaction_in_progress && !holds_transaction_lock) {
-			std::this_thread::sleep_for(1ms);
-		}
-
+		cs_connected,
 		/**
-		 * One DB handle can't query the database from multiple threads at the same time.
-		 * To prevent corruption of results, put a lock guard on queries.
+		 * @brief Handle is open, but the server went away. It must be closed
+		 * and reconnected before it is used again.
 		 */
-		std::lock_guard<std::mutex> db_lock(db_mutex);
-		resultset rv;
-
-		if (mysql_ping(&connection)) {
-			creator->log(dpp::ll_error, "SQL: Connection has died, reconnecting...");
-			for (const auto& cc : cached_queries) {
-				mysql_stmt_close(cc.second.st);
-				delete[] cc.second.bindings;
-				delete[] cc.second.lengths;
-			}
-			cached_queries = {};
-			const json& dbconf = config::get("database");
-			if (!db::unsafe_connect(dbconf["host"], dbconf["username"], dbconf["password"], dbconf["database"], dbconf["port"], dbconf.contains("socket") ? dbconf["socket"] : "")) {
-				creator->log(dpp::ll_critical, fmt::format("Database connection error connecting to {}: {}", dbconf["database"], mysql_error(&connection)));
-				return rv;
-			}
-		}
+		cs_lost,
+		/**
+		 * @brief Handle is closed because reconnecting failed
+		 */
+		cs_disconnected,
+	};
 
+	/**
+	 * @brief Credentials used to (re)connect pooled connections
+	 */
+	struct connection_info {
+		std::string host;
+		std::string user;
+		std::string pass;
+		std::string db;
+		int port{3306};
+		std::string socket;
 		/**
-		 * Clear error status
+		 * @brief Session statement time limit in milliseconds, 0 for none
 		 */
-		last_error.clear();
+		uint64_t statement_timeout{3000};
 		/**
-		 * Clear number of affected rows
+		 * @brief Seconds to wait for the server to answer before the connection
+		 * is treated as lost, 0 for the client library's default
 		 */
-		rows_affected = 0;
+		unsigned int read_timeout{0};
+	};
 
-		++query_total;
+	/**
+	 * @brief A single pooled database connection.
+	 * Prepared statement handles belong to the connection which prepared them,
+	 * so each connection carries its own prepared statement cache.
+	 */
+	struct sql_connection {
+		/**
+		 * @brief MySQL database connection
+		 */
+		MYSQL handle{};
 
 		/**
-		 * Check for a cached query in the query cache, if one is found, we can use it,
-		 * and we don't need to call mysql_stmt_init() and mysql_stmt_prepare().
+		 * @brief Query cache, indexed by query_key::id(). A null entry
+		 * has not been prepared on this connection yet.
 		 */
-		cached_query cc;
-		auto f = cached_queries.find(format);
-		if (f != cached_queries.end()) {
-			/* Query already exists in prepared statement cache */
-			cc = f->second;
-		} else {
+		std::vector<std::unique_ptr<cached_query>> cached_queries;
 
-			/* Query doesn't exist yet, initialise a prepared statement and allocate char buffers */
-			cc.st = mysql_stmt_init(&connection);
-			if (mysql_stmt_prepare(cc.st, format.c_str(), format.length())) {
-				log_error(format, mysql_stmt_error(cc.st));
-				rv.error = mysql_stmt_error(cc.st);
-				mysql_stmt_close(cc.st);
-				return rv;
-			}
+		/**
+		 * @brief True whilst a thread holds this connection.
+		 * one connection may only be accessed by one thread at a time!
+		 * Protected by pool_mutex.
+		 */
+		bool busy{false};
 
-			/* Check the parameter count provided matches that which MySQL expects */
-			size_t expected_param_count = mysql_stmt_param_count(cc.st);
-			if (parameters.size() != expected_param_count) {
-				rv.error = "Incorrect number of parameters: " + format + " (" + std::to_string(parameters.size()) + " vs " + std::to_string(expected_param_count) + ")";
-				log_error(format, rv.error);
-				mysql_stmt_close(cc.st);
-				return rv;
-			}
+		/**
+		 * @brief Connection state, only changed by the thread holding the connection
+		 */
+		connection_state state{cs_connected};
 
-			/* Allocate memory for awful C stuff 🐉 */
-			cc.bindings = nullptr;
-			cc.lengths = nullptr;
-			if (expected_param_count) {
-				cc.bindings = new MYSQL_BIND[expected_param_count];
-				cc.lengths = new unsigned long[expected_param_count];
-				memset(cc.lengths, 0, sizeof(unsigned long) * expected_param_count);
-			}
+		/**
+		 * @brief When the connection last talked to the server, used by the keepalive
+		 */
+		std::chrono::steady_clock::time_point last_used{std::chrono::steady_clock::now()};
 
-			/* Determine if this query expects results by the first keyword */
-			std::vector<std::string> q = (dpp::utility::tokenize(dpp::trim(dpp::lowercase(format)), " "));
-			cc.expects_results = (q.size() > 0 && (q[0] == "select" || q[0] == "show" || q[0] == "describe" || q[0] == "explain"));
+		/**
+		 * @brief Earliest time another reconnect may be attempted after a failed one
+		 */
+		std::chrono::steady_clock::time_point retry_after{};
 
-			/* Store to cache */
-			cached_queries.emplace(format, cc);
-			creator->log(dpp::ll_debug, "SQL: New cached prepared statement: " + format);
+		/**
+		 * @brief Current reconnect backoff, doubled on each failed reconnect
+		 */
+		std::chrono::seconds backoff{0};
+
+		/**
+		 * @brief Credentials the connection reconnects with, those of the primary or of a replica
+		 */
+		const connection_info* info{nullptr};
+
+		/**
+		 * @brief Statement time limit the session currently has, in milliseconds.
+		 * Set from info->statement_timeout when connecting, and changed only when
+		 * a query needs a different limit.
+		 */
+		uint64_t statement_limit{0};
+	};
+
+	/**
+	 * @brief A read replica, and its own pool of connections
+	 */
+	struct replica_pool {
+		connection_info credentials;
+		std::vector<std::unique_ptr<sql_connection>> connections;
+		/**
+		 * @brief Number of its connections currently leased, protected by pool_mutex
+		 */
+		size_t leased{0};
+	};
+
+	/**
+	 * @brief How a read chooses between healthy replicas
+	 */
+	enum replica_policy : uint8_t {
+		/**
+		 * @brief Each read goes to the next replica in turn
+		 */
+		rp_round_robin,
+		/**
+		 * @brief Each read goes to the replica with the fewest connections leased
+		 */
+		rp_least_loaded,
+	};
+
+	/**
+	 * @brief Protects last_error and rows_affected
+	 */
+	std::mutex status_mutex;
+
+	/**
+	 * @brief Last error string from MySQL
+	 */
+	std::string last_error;
+
+	/**
+	 * @brief Total number of queries since connection
+	 */
+	std::atomic<size_t> query_total{0};
+
+	/**
+	 * @brief Total number of prepared statements cached across all connections
+	 */
+	std::atomic<size_t> statements_cached{0};
+
+	/**
+	 * @brief Number of affected rows from last INSERT, UPDATE or DELETE
+	 */
+	size_t rows_affected{0};
+
+	/**
+	 * @brief Creating D++ cluster, used for logging
+	 */
+	dpp::cluster* creator{nullptr};
+
+	/**
+	 * @brief The connection a transaction is running on, if this thread is
+	 * running one. All queries inside the transaction must use this connection.
+	 */
+	thread_local sql_connection* pinned_connection = nullptr;
+
+	/**
+	 * @brief Result cache tags written to by the transaction this thread is running,
+	 * invalidated again when it commits
+	 */
+	thread_local std::vector<uint16_t> transaction_tags;
+
+	/**
+	 * @brief Cached query result parameters
+	 */
+	struct cached_query_results {
+		query_key key;
+		paramlist parameters;
+		sql_query_callback callback;
+		query_options options;
+		/**
+		 * @brief If set, the job is a transaction and this runs it in place of a query
+		 */
+		std::function<void()> transaction;
+		/**
+		 * @brief If set, this runs in place of a query and provides the job's results, e.g. a batch
+		 */
+		std::function<resultset()> work;
+		/**
+		 * @brief When the job was queued
+		 */
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	/**
+	 * @brief A node of the submission queue. Nodes are recycled through
+	 * job_node_pool rather than freed.
+	 */
+	struct job_node {
+		cached_query_results job;
+		std::atomic<job_node*> next{nullptr};
+	};
+
+	/**
+	 * @brief Number of nodes moved between a thread's own cache and the shared pool at once
+	 */
+	constexpr size_t job_node_batch = 64;
+
+	/**
+	 * @brief Recycled nodes shared between threads. Each thread keeps its own cache
+	 * of nodes, and only touches this, under its mutex, once per job_node_batch nodes.
+	 */
+	struct job_node_pool {
+		std::mutex mutex;
+		std::vector<job_node*> spare;
+
+		/**
+		 * @brief Refill a thread's cache, allocating a new batch if no nodes are spare
+		 * @param cache cache to refill
+		 */
+		void refill(std::vector<job_node*>& cache) {
+			{
+				std::lock_guard<std::mutex> pool_lock(mutex);
+				size_t n = std::min(spare.size(), job_node_batch);
+				cache.insert(cache.end(), spare.end() - n, spare.end());
+				spare.resize(spare.size() - n);
+			}
+			while (cache.size() < job_node_batch) {
+				cache.emplace_back(new job_node());
+			}
+		}
+
+		/**
+		 * @brief Return a batch of released nodes for any thread to reuse
+		 * @param released nodes to return, emptied
+		 */
+		void give_back(std::vector<job_node*>& released) {
+			std::lock_guard<std::mutex> pool_lock(mutex);
+			spare.insert(spare.end(), released.begin(), released.end());
+			released.clear();
+		}
+	} job_nodes;
+
+	/**
+	 * @brief A thread's own cache of nodes, handed back to the shared pool when the thread exits
+	 */
+	struct job_node_cache {
+		std::vector<job_node*> nodes;
+		~job_node_cache() {
+			job_nodes.give_back(nodes);
+		}
+	};
+
+	/**
+	 * @brief Intrusive multi-producer queue of jobs for the worker threads.
+	 * Producers never lock: a submission is one atomic exchange and one store.
+	 * Workers take turns to pop, under the scheduler's consumer_mutex, which
+	 * submitters never touch.
+	 */
+	struct submission_queue {
+		/**
+		 * @brief Placeholder node, so that the queue is never truly empty
+		 */
+		job_node stub;
+		/**
+		 * @brief Most recently pushed node, swapped by producers
+		 */
+		std::atomic<job_node*> head{&stub};
+		/**
+		 * @brief Oldest node, only used by the worker holding consumer_mutex
+		 */
+		job_node* tail{&stub};
+
+		void push(job_node* n) {
+			n->next.store(nullptr, std::memory_order_relaxed);
+			job_node* prev = head.exchange(n, std::memory_order_acq_rel);
+			prev->next.store(n, std::memory_order_release);
+		}
+
+		/**
+		 * @brief Pop the oldest job, the caller must hold consumer_mutex
+		 * @return node, or nullptr if the queue is empty, or a push is still completing
+		 */
+		job_node* unsafe_pop() {
+			job_node* t = tail;
+			job_node* next = t->next.load(std::memory_order_acquire);
+			if (t == &stub) {
+				if (!next) {
+					return nullptr;
+				}
+				tail = t = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next) {
+				tail = next;
+				return t;
+			}
+			if (t != head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			push(&stub);
+			next = t->next.load(std::memory_order_acquire);
+			if (next) {
+				tail = next;
+				return t;
+			}
+			return nullptr;
+		}
+	};
+
+	/**
+	 * @brief Lane names, as used by the "lanes" configuration
+	 */
+	constexpr std::array<const char*, lane_count> lane_names{ "interactive", "background", "bulk" };
+
+	/**
+	 * @brief How workers choose the lane to serve next
+	 */
+	enum lane_policy : uint8_t {
+		/**
+		 * @brief Serve the most urgent lane with work, unless a less urgent lane with
+		 * work has been passed over starvation_limit times in a row
+		 */
+		lp_strict,
+		/**
+		 * @brief Serve lanes with work in proportion to their weights, by smooth weighted round robin
+		 */
+		lp_weighted,
+	};
+
+	/**
+	 * @brief One submission queue per lane, and the state of the policy choosing between them
+	 */
+	struct lane_scheduler {
+		std::array<submission_queue, lane_count> lanes;
+		/**
+		 * @brief Number of jobs queued in each lane
+		 */
+		std::array<std::atomic<size_t>, lane_count> depth{};
+		/**
+		 * @brief Depth at which a lane rejects new jobs, 0 for no limit
+		 */
+		std::array<std::atomic<size_t>, lane_count> limit{};
+		/**
+		 * @brief Serialises workers popping jobs, and protects the policy state below
+		 */
+		std::mutex consumer_mutex;
+		lane_policy policy{lp_strict};
+		size_t starvation_limit{32};
+		std::array<int64_t, lane_count> weights{ 8, 2, 1 };
+		/**
+		 * @brief Smooth weighted round robin credit of each lane
+		 */
+		std::array<int64_t, lane_count> credit{};
+		/**
+		 * @brief Times each lane had work but was passed over, for lp_strict
+		 */
+		std::array<size_t, lane_count> skipped{};
+		/**
+		 * @brief Bumped after every push, workers wait on it when they find every lane empty
+		 */
+		std::atomic<uint32_t> signal{0};
+		/**
+		 * @brief Number of workers waiting on signal, so submitters can skip the wake-up
+		 */
+		std::atomic<uint32_t> sleeping{0};
+
+		/**
+		 * @brief Pop a job from one lane, consumer_mutex must be held
+		 * @param lane lane to pop from
+		 * @return node or nullptr
+		 */
+		job_node* unsafe_pop(size_t lane) {
+			job_node* n = lanes[lane].unsafe_pop();
+			if (n) {
+				--depth[lane];
+				skipped[lane] = 0;
+				for (size_t other = lane + 1; other < lane_count; ++other) {
+					if (depth[other] > 0) {
+						++skipped[other];
+					}
+				}
+			}
+			return n;
+		}
+
+		/**
+		 * @brief Pop the next job according to the policy, consumer_mutex must be held
+		 * @return node, or nullptr if every lane is empty
+		 */
+		job_node* unsafe_next() {
+			if (policy == lp_weighted) {
+				int64_t total{0};
+				size_t best{lane_count};
+				for (size_t lane = 0; lane < lane_count; ++lane) {
+					if (depth[lane] > 0) {
+						credit[lane] += weights[lane];
+						total += weights[lane];
+						if (best == lane_count || credit[lane] > credit[best]) {
+							best = lane;
+						}
+					}
+				}
+				if (best != lane_count) {
+					if (job_node* n = unsafe_pop(best)) {
+						credit[best] -= total;
+						return n;
+					}
+				}
+			} else {
+				for (size_t lane = 0; lane < lane_count; ++lane) {
+					if (skipped[lane] >= starvation_limit) {
+						if (job_node* n = unsafe_pop(lane)) {
+							return n;
+						}
+					}
+				}
+			}
+			/* Most urgent lane first, also covering a lane whose latest push is still completing */
+			for (size_t lane = 0; lane < lane_count; ++lane) {
+				if (job_node* n = unsafe_pop(lane)) {
+					return n;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+#ifdef DB_ASYNC_ENGINE
+	/**
+	 * @brief Coroutine running one query of the non-blocking engine. It starts
+	 * immediately, and its frame is freed when it finishes.
+	 */
+	struct async_engine;
+
+	struct async_query_task {
+		struct promise_type {
+			async_query_task get_return_object() {
+				return {};
+			}
+			std::suspend_never initial_suspend() noexcept {
+				return {};
+			}
+			std::suspend_never final_suspend() noexcept {
+				return {};
+			}
+			void return_void() {
+			}
+			void unhandled_exception() {
+				std::terminate();
+			}
+		};
+	};
+
+	/**
+	 * @brief A connection driven by the non-blocking engine rather than by a
+	 * worker thread. It runs one query at a time.
+	 */
+	struct async_connection {
+		sql_connection conn;
+		/**
+		 * @brief Engine the connection belongs to
+		 */
+		async_engine* engine{nullptr};
+		/**
+		 * @brief Socket registered with the D++ socket engine, or -1
+		 */
+		int fd{-1};
+		/**
+		 * @brief dpp::socket_event_flags the socket is registered with
+		 */
+		uint8_t flags{0};
+		/**
+		 * @brief True whilst a query is running on the connection
+		 */
+		bool busy{false};
+		/**
+		 * @brief Query suspended until the socket is ready
+		 */
+		std::coroutine_handle<> waiting;
+		/**
+		 * @brief Continues the MariaDB call the query is suspended in, given the
+		 * MYSQL_WAIT_* events which are ready. Returns the events it still waits for, or 0.
+		 */
+		std::function<int(int)> cont;
+		/**
+		 * @brief D++ timer of a call which waits with a timeout
+		 */
+		std::optional<dpp::timer> timeout;
+	};
+
+	/**
+	 * @brief Non-blocking query engine. Plain queued queries run on the engine's own
+	 * connections through the MariaDB non-blocking API, driven by the callbacks of
+	 * the D++ socket engine, so that many connections are served without a thread each.
+	 * Transactions, batches and streams still run on the worker threads.
+	 */
+	struct async_engine {
+		/**
+		 * @brief Queries waiting for a free connection of the engine
+		 */
+		lane_scheduler queue;
+		/**
+		 * @brief Protects everything below. Held whilst queries make progress, but
+		 * never whilst their callbacks are called or their deadline watches removed.
+		 */
+		std::mutex mutex;
+		/**
+		 * @brief Signalled when a query finishes, for stop()
+		 */
+		std::condition_variable idle;
+		/**
+		 * @brief The engine's connections, separate from the worker threads' pool
+		 */
+		std::vector<std::unique_ptr<async_connection>> connections;
+		/**
+		 * @brief Callbacks of finished queries, with their results, to be called once mutex is released
+		 */
+		std::vector<std::pair<sql_query_callback, resultset>> finished;
+		/**
+		 * @brief Pipe registered with the socket engine, written to when a query is queued
+		 */
+		std::array<int, 2> wakeup{-1, -1};
+		/**
+		 * @brief True whilst a wake-up is written but not yet read, so that a burst
+		 * of queries only writes to the pipe once
+		 */
+		std::atomic<bool> wakeup_pending{false};
+		/**
+		 * @brief Held shared by enqueue() whilst it queues a query for the engine,
+		 * and exclusively whilst enabled changes, so that no query is queued after stop() drains the queue
+		 */
+		std::shared_mutex submit_mutex;
+		/**
+		 * @brief True whilst plain queries are routed to the engine
+		 */
+		std::atomic<bool> enabled{false};
+		/**
+		 * @brief Database the engine belongs to, whose cached results its writes invalidate
+		 */
+		pool_state* pool{nullptr};
+
+		/**
+		 * @brief Wake the engine after queueing a query for it
+		 */
+		void notify() {
+			if (!wakeup_pending.exchange(true)) {
+				[[maybe_unused]] auto written = write(wakeup[1], "", 1);
+			}
+		}
+
+		bool start(size_t count, const connection_info& info);
+		void stop();
+		void unsafe_pump();
+		void unsafe_wait(async_connection& ac, int status);
+		void unsafe_continue(async_connection& ac, int events);
+		void unsafe_forget_socket(async_connection& ac);
+		void ready(async_connection& ac, int events);
+		void socket_error(async_connection& ac);
+		void timed_out(async_connection& ac, dpp::timer t);
+		void woken();
+		void finish();
+		async_query_task run(async_connection& ac, cached_query_results job);
+	};
+
+	/**
+	 * @brief Awaitable MariaDB non-blocking call. start() begins the call, cont()
+	 * continues it when the connection's socket is ready. Both return the MYSQL_WAIT_*
+	 * events the call still waits for, or 0 once it has finished.
+	 */
+	struct nonblocking_call {
+		async_connection& ac;
+		std::function<int()> start;
+		std::function<int(int)> cont;
+		int status{0};
+
+		nonblocking_call(async_connection& c, std::function<int()> s, std::function<int(int)> n) : ac(c), start(std::move(s)), cont(std::move(n)) {
+		}
+
+		bool await_ready() {
+			status = start();
+			return status == 0;
+		}
+
+		void await_suspend(std::coroutine_handle<> h) {
+			ac.waiting = h;
+			ac.cont = std::move(cont);
+			ac.engine->unsafe_wait(ac, status);
+		}
+
+		void await_resume() const {
+		}
+	};
+#endif
+
+	template<class> inline constexpr bool always_false_v = false;
+
+	static_assert(sizeof(bool) == 1, "bool parameters are bound directly as MYSQL_TYPE_TINY");
+
+	/**
+	 * @brief Derive the native type of a result column from its metadata
+	 *
+	 * @param field column metadata
+	 * @return column type
+	 */
+	column_type column_type_of(const MYSQL_FIELD& field) {
+		switch (field.type) {
+			case MYSQL_TYPE_TINY:
+			case MYSQL_TYPE_SHORT:
+			case MYSQL_TYPE_INT24:
+			case MYSQL_TYPE_LONG:
+			case MYSQL_TYPE_LONGLONG:
+			case MYSQL_TYPE_YEAR:
+				return (field.flags & UNSIGNED_FLAG) ? ct_uint : ct_int;
+			case MYSQL_TYPE_FLOAT:
+			case MYSQL_TYPE_DOUBLE:
+				return ct_real;
+			case MYSQL_TYPE_TINY_BLOB:
+			case MYSQL_TYPE_MEDIUM_BLOB:
+			case MYSQL_TYPE_LONG_BLOB:
+			case MYSQL_TYPE_BLOB:
+			case MYSQL_TYPE_STRING:
+			case MYSQL_TYPE_VAR_STRING:
+			case MYSQL_TYPE_VARCHAR:
+				/* Character set 63 is 'binary', used by BLOB, BINARY and VARBINARY */
+				return field.charsetnr == 63 ? ct_blob : ct_text;
+			default:
+				return ct_text;
+		}
+	}
+
+	/**
+	 * @brief MySQL buffer type used to bind a numeric parameter type natively
+	 *
+	 * @tparam T parameter type
+	 * @return MySQL field type
+	 */
+	template<class T> constexpr enum_field_types native_field_type() {
+		if constexpr (std::is_same_v<T, float>) {
+			return MYSQL_TYPE_FLOAT;
+		} else if constexpr (std::is_same_v<T, double>) {
+			return MYSQL_TYPE_DOUBLE;
+		} else if constexpr (std::is_same_v<T, bool>) {
+			return MYSQL_TYPE_TINY;
+		} else if constexpr (std::is_same_v<T, int32_t> || std::is_same_v<T, uint32_t>) {
+			return MYSQL_TYPE_LONG;
+		} else if constexpr (std::is_same_v<T, int64_t> || std::is_same_v<T, uint64_t>) {
+			return MYSQL_TYPE_LONGLONG;
+		} else {
+			static_assert(always_false_v<T>, "no native MySQL type for parameter type");
+		}
+	}
+
+	/**
+	 * @brief Key of a cached result set: the query and its exact parameters
+	 */
+	struct result_cache_key {
+		query_key key;
+		paramlist parameters;
+	};
+
+	/**
+	 * @brief Hashes a result cache key. Parameters are combined in order, and each
+	 * parameter's hash includes its type, so {1, 2} and {2, 1} differ.
+	 */
+	struct result_cache_hash {
+		std::size_t operator()(const result_cache_key* k) const {
+			size_t x = std::hash<size_t>()(k->key.id());
+			for (const auto& param : k->parameters) {
+				size_t h = std::visit([](const auto& v) {
+					using T = std::decay_t<decltype(v)>;
+					if constexpr (std::is_same_v<T, buffer_parameter>) {
+						return std::hash<std::string_view>()(std::string_view(v.data, v.length));
+					} else {
+						return std::hash<T>()(v);
+					}
+				}, param);
+				x ^= h + param.index() + 0x9e3779b97f4a7c15ULL + (x << 6) + (x >> 2);
+			}
+			return x;
+		}
+	};
+
+	/**
+	 * @brief Copy parameters for a result cache key, which outlives the query. Borrowed
+	 * buffers become strings, as their storage may not last as long as the key.
+	 *
+	 * @param parameters query parameters
+	 * @return parameters safe to keep
+	 */
+	paramlist owned_parameters(const paramlist& parameters) {
+		paramlist owned = parameters;
+		for (auto& param : owned) {
+			const buffer_parameter* b = std::get_if<buffer_parameter>(&param);
+			if (b && !b->owner && !b->source) {
+				param = std::string(b->data, b->length);
+			}
+		}
+		return owned;
+	}
+
+	/**
+	 * @brief Check if any of a query's parameters are streamed
+	 *
+	 * @param parameters parameters
+	 * @return true if a parameter is sent with mysql_stmt_send_long_data()
+	 */
+	bool streams_parameters(const paramlist& parameters) {
+		return std::any_of(parameters.begin(), parameters.end(), [](const parameter_type& param) {
+			const buffer_parameter* p = std::get_if<buffer_parameter>(&param);
+			return p && p->streamed();
+		});
+	}
+
+	struct result_cache_equal {
+		bool operator()(const result_cache_key* lhs, const result_cache_key* rhs) const {
+			return lhs->key.id() == rhs->key.id() && lhs->parameters == rhs->parameters;
+		}
+	};
+
+	/**
+	 * @brief A cached result set with its expiry
+	 */
+	struct result_cache_entry {
+		result_cache_key key;
+		std::shared_ptr<const resultset> results;
+		std::chrono::steady_clock::time_point expiry;
+		/**
+		 * @brief Tag slots of the tables the results were read from
+		 */
+		std::vector<uint16_t> tags;
+		/**
+		 * @brief Sum of the generations of its tags when the query was started. Writes only
+		 * ever increase generations, so any write to its tables since makes the sum differ.
+		 */
+		uint64_t generation{0};
+		/**
+		 * @brief Approximate memory held by the result set
+		 */
+		size_t bytes{0};
+	};
+
+	/**
+	 * @brief A cache miss which is being queried asynchronously. Later misses for
+	 * the same key wait for its result instead of queueing the same query again.
+	 */
+	struct pending_result {
+		result_cache_key key;
+		std::vector<sql_shared_query_callback> waiters;
+	};
+
+	/**
+	 * @brief One shard of the result cache. Entries are kept in least recently used
+	 * order, and indexed by a pointer to the key held within each list node.
+	 */
+	struct result_cache_shard {
+		std::mutex mutex;
+		/**
+		 * @brief Most recently used entry first
+		 */
+		std::list<result_cache_entry> lru;
+		std::unordered_map<const result_cache_key*, std::list<result_cache_entry>::iterator, result_cache_hash, result_cache_equal> index;
+		/**
+		 * @brief Asynchronous misses in flight, indexed by a pointer to their own key
+		 */
+		std::unordered_map<const result_cache_key*, std::unique_ptr<pending_result>, result_cache_hash, result_cache_equal> pending;
+		size_t bytes{0};
+
+		/**
+		 * @brief Remove an entry, the shard's mutex must be held
+		 * @param entry entry to remove
+		 */
+		void erase(std::list<result_cache_entry>::iterator entry) {
+			bytes -= entry->bytes;
+			index.erase(&entry->key);
+			lru.erase(entry);
+		}
+	};
+
+	/**
+	 * @brief Number of independently locked result cache shards
+	 */
+	constexpr size_t result_cache_shards = 16;
+
+	/**
+	 * @brief Number of result cache tag slots per database. Table names are hashed to
+	 * a slot, and a collision only costs a needless invalidation.
+	 */
+	constexpr size_t tag_slots = 4096;
+
+	/**
+	 * @brief Sum of the deltas accumulated for one key since the last flush
+	 */
+	struct accumulated_delta {
+		int64_t whole{0};
+		double real{0};
+		bool is_real{false};
+	};
+
+	/**
+	 * @brief Hashes a key of the write-behind buffer, the same way as a result cache key
+	 */
+	struct accumulator_hash {
+		std::size_t operator()(const result_cache_key& k) const {
+			return result_cache_hash()(&k);
+		}
+	};
+
+	struct accumulator_equal {
+		bool operator()(const result_cache_key& lhs, const result_cache_key& rhs) const {
+			return result_cache_equal()(&lhs, &rhs);
+		}
+	};
+
+	/**
+	 * @brief One shard of the write-behind buffer of db::accumulate(), holding the
+	 * deltas of each statement and key. A flush swaps the map out, so adding to a
+	 * key only ever waits for another add to the same shard.
+	 */
+	struct accumulator_shard {
+		std::mutex mutex;
+		std::unordered_map<result_cache_key, accumulated_delta, accumulator_hash, accumulator_equal> deltas;
+	};
+
+	/**
+	 * @brief Number of independently locked write-behind buffer shards
+	 */
+	constexpr size_t accumulator_shards = 16;
+
+	/**
+	 * @brief Everything belonging to one database: its connection pool, replicas,
+	 * queues, worker threads and result cache. The free functions use the default
+	 * database, unless a db::database call or one of its workers made another active.
+	 */
+	struct pool_state {
+		/**
+		 * @brief Connection pool. Each connection is heap allocated so that its
+		 * MYSQL handle never moves once it has been initialised.
+		 */
+		std::vector<std::unique_ptr<sql_connection>> connections;
+
+		/**
+		 * @brief Credentials of the pool, used when reconnecting
+		 */
+		connection_info credentials;
+
+		/**
+		 * @brief Times connect() retries opening each connection, from the "connect_retries" setting
+		 */
+		size_t connect_retries{3};
+
+		/**
+		 * @brief Read replicas, protected by pool_mutex. Heap allocated so that the
+		 * credentials their connections point to never move.
+		 */
+		std::vector<std::unique_ptr<replica_pool>> replicas;
+
+		/**
+		 * @brief Number of replicas, readable without pool_mutex to decide whether a read should look for one
+		 */
+		std::atomic<size_t> replica_count{0};
+
+		/**
+		 * @brief Replica selection policy, protected by pool_mutex
+		 */
+		replica_policy replica_selection{rp_round_robin};
+
+		/**
+		 * @brief Next replica to try for rp_round_robin, protected by pool_mutex
+		 */
+		size_t replica_next{0};
+
+		/**
+		 * @brief Pool mutex, protects the connections vector, the replicas and the busy flags
+		 */
+		std::mutex pool_mutex;
+
+		/**
+		 * @brief Signalled whenever a connection is returned to the pool
+		 */
+		std::condition_variable pool_cv;
+
+		/**
+		 * @brief Queries waiting for the worker threads
+		 */
+		lane_scheduler sql_query_queue;
+
+#ifdef DB_ASYNC_ENGINE
+		async_engine nonblocking_engine;
+#endif
+
+		/**
+		 * @brief Number of queue worker threads started by init(). Workers outlive
+		 * close() and connect(), so calling init() again only adds missing workers.
+		 */
+		size_t workers_started{0};
+
+		/**
+		 * @brief Number of workers which haven't exited, for stopping a db::database
+		 */
+		std::atomic<size_t> workers_running{0};
+
+		/**
+		 * @brief Set to make the workers exit once the queue is empty
+		 */
+		std::atomic<bool> stopping{false};
+
+		/**
+		 * @brief D++ timer pinging idle connections, if a keepalive is configured
+		 */
+		std::optional<dpp::timer> keepalive_timer;
+
+		/**
+		 * @brief The result cache of query(format, parameters, lifetime)
+		 */
+		std::array<result_cache_shard, result_cache_shards> result_cache;
+
+		/**
+		 * @brief Maximum number of cached result sets, from the "cache_entries" setting
+		 */
+		std::atomic<size_t> result_cache_max_entries{10000};
+
+		/**
+		 * @brief Maximum approximate memory used by cached result sets, from the "cache_memory" setting
+		 */
+		std::atomic<size_t> result_cache_max_bytes{64 * 1024 * 1024};
+
+		/**
+		 * @brief D++ timer which removes expired result sets
+		 */
+		std::optional<dpp::timer> result_cache_timer;
+
+		/**
+		 * @brief Generation of each result cache tag slot, increased by every write to a
+		 * table of the slot. Cached results of an older generation are stale.
+		 */
+		std::array<std::atomic<uint64_t>, tag_slots> tag_generations{};
+
+		/**
+		 * @brief Deltas of db::accumulate() waiting to be written
+		 */
+		std::array<accumulator_shard, accumulator_shards> accumulators;
+
+		/**
+		 * @brief Number of distinct keys waiting in the accumulators
+		 */
+		std::atomic<size_t> accumulated_keys{0};
+
+		/**
+		 * @brief Number of waiting keys which queues a flush, from the "accumulate_keys" setting
+		 */
+		std::atomic<size_t> accumulate_max_keys{10000};
+
+		/**
+		 * @brief Set while a flush of the accumulators is queued, so only one is
+		 */
+		std::atomic<bool> accumulate_flush_queued{false};
+
+		/**
+		 * @brief D++ timer which queues a flush of the accumulators
+		 */
+		std::optional<dpp::timer> accumulate_timer;
+	};
+
+	/**
+	 * @brief The database used by the free functions, configured by db::init()
+	 */
+	pool_state default_pool;
+
+	/**
+	 * @brief Database made active on this thread, nullptr for the default
+	 */
+	thread_local pool_state* active_pool{nullptr};
+
+	/**
+	 * @brief Get the database the calling thread is using
+	 * @return the active database, or the default
+	 */
+	pool_state& current_pool() {
+		return active_pool ? *active_pool : default_pool;
+	}
+
+	/**
+	 * @brief RAII scope within which the free functions use a given database. Moving to
+	 * a different database hides the thread's transaction, which belongs to the other one.
+	 */
+	class pool_scope {
+		pool_state* previous;
+		sql_connection* previous_pinned;
+
+	public:
+		explicit pool_scope(pool_state& pool) : previous(active_pool), previous_pinned(pinned_connection) {
+			if (&current_pool() != &pool) {
+				pinned_connection = nullptr;
+			}
+			active_pool = &pool;
+		}
+
+		~pool_scope() {
+			active_pool = previous;
+			pinned_connection = previous_pinned;
+		}
+
+		pool_scope(const pool_scope&) = delete;
+		pool_scope& operator=(const pool_scope&) = delete;
+	};
+
+	/**
+	 * @brief Sum the current generations of a set of tags
+	 *
+	 * @param pool database
+	 * @param tags tag slots
+	 * @return sum of their generations
+	 */
+	uint64_t tag_generation(const pool_state& pool, const std::vector<uint16_t>& tags) {
+		uint64_t sum{0};
+		for (uint16_t tag : tags) {
+			sum += pool.tag_generations[tag].load(std::memory_order_acquire);
+		}
+		return sum;
+	}
+
+	/**
+	 * @brief Mark tags as written, making every result cached from them stale
+	 *
+	 * @param pool database
+	 * @param tags tag slots
+	 */
+	void invalidate_tags(pool_state& pool, const std::vector<uint16_t>& tags) {
+		for (uint16_t tag : tags) {
+			pool.tag_generations[tag].fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	/**
+	 * @brief Remove expired entries from every shard of a database's result cache
+	 *
+	 * @param pool database
+	 */
+	void expire_result_cache(pool_state& pool) {
+		auto now = std::chrono::steady_clock::now();
+		for (auto& shard : pool.result_cache) {
+			std::lock_guard<std::mutex> cache_lock(shard.mutex);
+			for (auto entry = shard.lru.begin(); entry != shard.lru.end();) {
+				auto next = std::next(entry);
+				if (entry->expiry <= now) {
+					shard.erase(entry);
+				}
+				entry = next;
+			}
+		}
+	}
+
+	/**
+	 * @brief Find a free connection among a pool's connections, preferring one which
+	 * is working over one which has to reconnect first. pool_mutex must be held.
+	 *
+	 * @param pool connections to search
+	 * @param skip_backoff true to skip connections waiting out a reconnect backoff
+	 * @return free connection, or nullptr
+	 */
+	sql_connection* unsafe_free_connection(const std::vector<std::unique_ptr<sql_connection>>& pool, bool skip_backoff) {
+		sql_connection* found{nullptr};
+		auto now = std::chrono::steady_clock::now();
+		for (auto& c : pool) {
+			if (!c->busy) {
+				if (c->state == cs_connected) {
+					return c.get();
+				}
+				if (!skip_backoff || c->state != cs_disconnected || now >= c->retry_after) {
+					found = found ? found : c.get();
+				}
+			}
+		}
+		return found;
+	}
+
+	/**
+	 * @brief Check if a replica is worth sending reads to: it has a connection which
+	 * is working, or which may try to reconnect. pool_mutex must be held.
+	 *
+	 * @param replica replica to check
+	 * @return true if healthy
+	 */
+	bool unsafe_replica_healthy(const replica_pool& replica) {
+		auto now = std::chrono::steady_clock::now();
+		return std::any_of(replica.connections.begin(), replica.connections.end(), [now](const auto& c) {
+			return c->state != cs_disconnected || now >= c->retry_after;
+		});
+	}
+
+	/**
+	 * @brief RAII lease of a free connection from the pool. Blocks until a
+	 * connection is free. Evaluates to false if the pool is not connected.
+	 */
+	class connection_lease {
+		pool_state& pool;
+		sql_connection* conn{nullptr};
+		replica_pool* owner{nullptr};
+
+		/**
+		 * @brief Lease a connection of a healthy replica, chosen by the replica policy
+		 * @param healthy set to true if any replica is healthy, even if none has a free connection
+		 * @return true if a connection was leased
+		 */
+		bool unsafe_lease_replica(bool& healthy) {
+			replica_pool* best{nullptr};
+			sql_connection* best_conn{nullptr};
+			for (size_t i = 0; i < pool.replicas.size(); ++i) {
+				replica_pool& replica = *pool.replicas[(pool.replica_next + i) % pool.replicas.size()];
+				if (!unsafe_replica_healthy(replica)) {
+					continue;
+				}
+				healthy = true;
+				sql_connection* c = unsafe_free_connection(replica.connections, true);
+				if (c && (!best || replica.leased < best->leased)) {
+					best = &replica;
+					best_conn = c;
+					if (pool.replica_selection == rp_round_robin) {
+						break;
+					}
+				}
+			}
+			if (!best) {
+				return false;
+			}
+			pool.replica_next = (std::find_if(pool.replicas.begin(), pool.replicas.end(), [best](const auto& r) { return r.get() == best; }) - pool.replicas.begin()) + 1;
+			owner = best;
+			conn = best_conn;
+			++owner->leased;
+			return true;
+		}
+
+	public:
+		/**
+		 * @brief Lease a connection of the calling thread's database
+		 * @param read true to lease a connection of a replica, if any replica is healthy.
+		 * Reads wait for a replica connection to be free rather than moving to the primary.
+		 */
+		explicit connection_lease(bool read = false) : pool(current_pool()) {
+			std::unique_lock<std::mutex> pool_lock(pool.pool_mutex);
+			pool.pool_cv.wait(pool_lock, [this, read] {
+				bool healthy{false};
+				if (read && !pool.replicas.empty() && (unsafe_lease_replica(healthy) || healthy)) {
+					return conn != nullptr;
+				}
+				conn = unsafe_free_connection(pool.connections, false);
+				return conn != nullptr || pool.connections.empty();
+			});
+			if (conn) {
+				conn->busy = true;
+			}
+		}
+
+		~connection_lease() {
+			if (conn) {
+				{
+					std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+					conn->busy = false;
+					if (owner) {
+						--owner->leased;
+					}
+				}
+				/* Waiters for the primary and for replicas share the condition variable */
+				if (pool.replica_count) {
+					pool.pool_cv.notify_all();
+				} else {
+					pool.pool_cv.notify_one();
+				}
+			}
+		}
+
+		connection_lease(const connection_lease&) = delete;
+		connection_lease& operator=(const connection_lease&) = delete;
+
+		explicit operator bool() const {
+			return conn != nullptr;
+		}
+
+		sql_connection& operator*() const {
+			return *conn;
+		}
+
+		sql_connection* get() const {
+			return conn;
+		}
+
+		/**
+		 * @brief True if the connection belongs to a replica
+		 */
+		bool replica() const {
+			return owner != nullptr;
+		}
+	};
+
+	size_t cache_size() {
+		return statements_cached;
+	}
+	
+	size_t query_count() {
+		return query_total;
+	}
+
+	size_t queue_depth(query_lane lane) {
+		if (lane >= lane_count) {
+			return 0;
+		}
+		pool_state& pool = current_pool();
+#ifdef DB_ASYNC_ENGINE
+		return pool.sql_query_queue.depth[lane] + pool.nonblocking_engine.queue.depth[lane];
+#else
+		return pool.sql_query_queue.depth[lane];
+#endif
+	}
+
+	/**
+	 * @brief Close and free every cached prepared statement on a connection
+	 * 
+	 * @param conn connection to free statements on, must be held by the caller
+	 */
+	void free_statements(sql_connection& conn) {
+		for (const auto& cc : conn.cached_queries) {
+			if (cc) {
+				--statements_cached;
+			}
+		}
+		conn.cached_queries.clear();
+	}
+
+	/**
+	 * @brief Determine if a query expects results by its first keyword
+	 *
+	 * @param format query
+	 * @return true for SELECT, SHOW, DESCRIBE and EXPLAIN
+	 */
+	bool returns_rows(const std::string& format) {
+		std::vector<std::string> q = (dpp::utility::tokenize(dpp::trim(dpp::lowercase(format)), " "));
+		return q.size() > 0 && (q[0] == "select" || q[0] == "show" || q[0] == "describe" || q[0] == "explain");
+	}
+
+	/**
+	 * @brief Find the slot of a table name. The name is matched without backquotes,
+	 * schema or case, so `app`.`Users` and users share a slot.
+	 *
+	 * @param table table name
+	 * @return slot index
+	 */
+	uint16_t tag_slot(std::string_view table) {
+		std::string name;
+		for (char c : table.substr(table.find_last_of('.') == std::string_view::npos ? 0 : table.find_last_of('.') + 1)) {
+			if (c != '`') {
+				name += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			}
+		}
+		return static_cast<uint16_t>(std::hash<std::string>()(name) % tag_slots);
+	}
+
+	/**
+	 * @brief Split a statement into lowercased words and punctuation. String literals
+	 * are skipped, and a schema qualified or backquoted name stays one word.
+	 *
+	 * @param sql statement
+	 * @return words
+	 */
+	std::vector<std::string> sql_words(std::string_view sql) {
+		std::vector<std::string> words;
+		auto word_char = [](char c) {
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || c == '`' || c == '.';
+		};
+		for (size_t i = 0; i < sql.size();) {
+			char c = sql[i];
+			if (c == '\'' || c == '"') {
+				for (++i; i < sql.size() && sql[i] != c; ++i) {
+					if (sql[i] == '\\') {
+						++i;
+					}
+				}
+				++i;
+				words.emplace_back(1, c);
+			} else if (word_char(c)) {
+				std::string word;
+				while (i < sql.size() && word_char(sql[i])) {
+					if (sql[i] == '`') {
+						for (++i; i < sql.size() && sql[i] != '`'; ++i) {
+							word += sql[i];
+						}
+						++i;
+					} else {
+						word += static_cast<char>(std::tolower(static_cast<unsigned char>(sql[i++])));
+					}
+				}
+				words.emplace_back(std::move(word));
+			} else {
+				if (!std::isspace(static_cast<unsigned char>(c))) {
+					words.emplace_back(1, c);
+				}
+				++i;
+			}
+		}
+		return words;
+	}
+
+	/**
+	 * @brief Derive the result cache tags of a statement from the tables it names after
+	 * FROM, JOIN, INTO, UPDATE, TABLE and TRUNCATE. A comma separated list of tables,
+	 * with or without aliases, is followed. It is a heuristic, not a parser: a stray
+	 * extra tag only causes needless invalidation, and statements which hide their
+	 * tables, such as CALL, need tags declared by the caller.
+	 *
+	 * @param format statement
+	 * @return tag slots, without duplicates
+	 */
+	std::vector<uint16_t> statement_tags(const std::string& format) {
+		std::vector<std::string> words = sql_words(format);
+		std::vector<uint16_t> tags;
+		auto is_name = [&words](size_t j) {
+			return j < words.size() && (std::isalpha(static_cast<unsigned char>(words[j][0])) || words[j][0] == '_' || words[j][0] == '$');
+		};
+		auto add = [&tags](const std::string& table) {
+			uint16_t slot = tag_slot(table);
+			if (std::find(tags.begin(), tags.end(), slot) == tags.end()) {
+				tags.emplace_back(slot);
+			}
+		};
+		static const std::set<std::string> modifiers{"if", "not", "exists", "ignore", "low_priority", "high_priority", "delayed", "quick", "table"};
+		for (size_t i = 0; i < words.size(); ++i) {
+			const std::string& w = words[i];
+			/* ON DUPLICATE KEY UPDATE and SELECT ... FOR UPDATE are followed by columns, if anything */
+			bool names_table = w == "from" || w == "join" || w == "into" || w == "table" || w == "truncate"
+				|| (w == "update" && (i == 0 || (words[i - 1] != "key" && words[i - 1] != "for")));
+			if (!names_table) {
+				continue;
+			}
+			size_t j = i + 1;
+			while (is_name(j) && modifiers.count(words[j])) {
+				++j;
+			}
+			while (is_name(j)) {
+				add(words[j]);
+				/* A list of tables, each with an optional alias, continues after a comma */
+				size_t next = j + 1;
+				if (next < words.size() && words[next] == "as") {
+					++next;
+				}
+				if (next < words.size() && words[next] != "," && is_name(next)) {
+					++next;
+				}
+				if (w != "from" || next >= words.size() || words[next] != ",") {
+					break;
+				}
+				j = next + 1;
+			}
+		}
+		return tags;
+	}
+
+	/**
+	 * @brief Result cache tags of an interned statement
+	 *
+	 * @param key statement
+	 * @return tag slots, valid for the lifetime of the process
+	 */
+	const std::vector<uint16_t>& statement_tags_of(const query_key& key) {
+		static const std::vector<uint16_t> none;
+		if (!key) {
+			return none;
+		}
+		std::shared_lock<std::shared_mutex> intern_lock(intern_mutex);
+		return interned_tags[key.id()];
+	}
+
+	query_key::query_key(size_t i, const std::string* t, bool r) : index(i), text(t), read(r) {
+	}
+
+	query_key intern(const std::string& format) {
+		{
+			std::shared_lock<std::shared_mutex> intern_lock(intern_mutex);
+			auto i = interned.find(format);
+			if (i != interned.end()) {
+				return query_key(i->second, &interned_text[i->second], interned_reads[i->second]);
+			}
+		}
+		std::unique_lock<std::shared_mutex> intern_lock(intern_mutex);
+		auto i = interned.find(format);
+		if (i != interned.end()) {
+			return query_key(i->second, &interned_text[i->second], interned_reads[i->second]);
+		}
+		const std::string& text = interned_text.emplace_back(format);
+		interned_reads.emplace_back(returns_rows(format));
+		interned_tags.emplace_back(statement_tags(format));
+		interned.emplace(text, interned_text.size() - 1);
+		return query_key(interned_text.size() - 1, &text, interned_reads.back());
+	}
+
+	/**
+	 * @brief Invalidate cached results of the tables a statement wrote to. Within a
+	 * transaction, they are invalidated again when it commits, as reads from other
+	 * connections keep seeing the old rows until then.
+	 *
+	 * @param pool database written to
+	 * @param tags tag slots of the tables written to
+	 */
+	void wrote_tables(pool_state& pool, const std::vector<uint16_t>& tags) {
+		invalidate_tags(pool, tags);
+		if (pinned_connection) {
+			transaction_tags.insert(transaction_tags.end(), tags.begin(), tags.end());
+		}
+	}
+
+	/**
+	 * @brief Invalidate cached results of the tables an interned statement wrote to
+	 *
+	 * @param pool database written to
+	 * @param key statement
+	 */
+	void wrote_tables(pool_state& pool, const query_key& key) {
+		wrote_tables(pool, statement_tags_of(key));
+	}
+
+	/**
+	 * @brief Client flags every connection is opened with
+	 */
+	constexpr unsigned long connect_flags = CLIENT_MULTI_RESULTS | CLIENT_MULTI_STATEMENTS | CLIENT_REMEMBER_OPTIONS | CLIENT_IGNORE_SIGPIPE;
+
+	/**
+	 * @brief Build the statement which sets the session's statement time limit
+	 *
+	 * @param milliseconds limit, 0 for none
+	 * @return SET statement
+	 */
+	std::string statement_limit_sql(uint64_t milliseconds) {
+		return fmt::format("SET @@SESSION." STATEMENT_TIME_VARIABLE "={}", milliseconds * STATEMENT_TIME_SCALE);
+	}
+
+	/**
+	 * @brief Set the options a connection is opened with, on a handle which has been
+	 * initialised but not yet connected
+	 *
+	 * @param conn connection being opened, must be held by the caller
+	 * @param info credentials to connect with
+	 */
+	void unsafe_set_connect_options(sql_connection& conn, const connection_info& info) {
+		/* mysql_options() copies the string */
+		std::string init_command = statement_limit_sql(info.statement_timeout);
+		mysql_options(&conn.handle, MYSQL_INIT_COMMAND, init_command.c_str());
+		if (info.read_timeout > 0) {
+			mysql_options(&conn.handle, MYSQL_OPT_READ_TIMEOUT, &info.read_timeout);
+		}
+		conn.statement_limit = info.statement_timeout;
+	}
+
+	/**
+	 * @brief This is an internal connect function which has no locking, there is no public interface for this
+	 * 
+	 * @param conn connection to connect, must be held by the caller
+	 * @param info credentials to connect with
+	 * @param nonblocking true to enable the MariaDB non-blocking API on the connection
+	 */
+	bool unsafe_connect(sql_connection& conn, const connection_info& info, [[maybe_unused]] bool nonblocking = false) {
+		conn.info = &info;
+		if (mysql_init(&conn.handle) != nullptr) {
+			unsafe_set_connect_options(conn, info);
+#ifdef DB_ASYNC_ENGINE
+			if (nonblocking) {
+				mysql_options(&conn.handle, MYSQL_OPT_NONBLOCK, 0);
+			}
+#endif
+			bool result = mysql_real_connect(&conn.handle, info.host.c_str(), info.user.c_str(), info.pass.c_str(), info.db.c_str(), info.port, info.socket.empty() ? nullptr : info.socket.c_str(), connect_flags);
+			signal(SIGPIPE, SIG_IGN);
+			if (!result) {
+				std::lock_guard<std::mutex> status_lock(status_mutex);
+				last_error = mysql_error(&conn.handle);
+			}
+			return result;
+		} else {
+			std::lock_guard<std::mutex> status_lock(status_mutex);
+			last_error = "mysql_init() failed";
+			return false;
+		}
+	}
+
+	/**
+	 * @brief Check if a MySQL client error means the connection to the server is gone
+	 *
+	 * @param code value of mysql_errno() or mysql_stmt_errno()
+	 * @return true if the connection must be re-established
+	 */
+	bool connection_lost(unsigned int code) {
+		return code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST
+#ifdef CR_SERVER_LOST_EXTENDED
+			|| code == CR_SERVER_LOST_EXTENDED
+#endif
+		;
+	}
+
+	/**
+	 * @brief Record a failed reconnect: close the handle, and back off exponentially,
+	 * up to 30 seconds, before the next attempt
+	 *
+	 * @param conn connection which failed to reconnect, must be held by the caller
+	 * @param now time of the attempt
+	 */
+	void reconnect_failed(sql_connection& conn, std::chrono::steady_clock::time_point now) {
+		/* connect() may be called before init() */
+		if (creator) {
+			creator->log(dpp::ll_critical, fmt::format("Database connection error connecting to {} on {}: {}", conn.info->db, conn.info->host, mysql_error(&conn.handle)));
+		}
+		mysql_close(&conn.handle);
+		conn.state = cs_disconnected;
+		conn.backoff = std::clamp<std::chrono::seconds>(conn.backoff * 2, 1s, 30s);
+		conn.retry_after = now + conn.backoff;
+	}
+
+	/**
+	 * @brief Record a successful reconnect
+	 *
+	 * @param conn connection which reconnected, must be held by the caller
+	 */
+	void reconnected(sql_connection& conn) {
+		conn.state = cs_connected;
+		conn.backoff = 0s;
+		conn.last_used = std::chrono::steady_clock::now();
+		creator->log(dpp::ll_info, "SQL: Reconnected to database " + conn.info->db + " on " + conn.info->host);
+	}
+
+	/**
+	 * @brief Close a lost connection and connect it again. Its prepared statements
+	 * are freed, and are prepared again from their interned SQL text when next used.
+	 * A failed reconnect closes the handle and backs off exponentially, up to 30
+	 * seconds, so that a dead server isn't hammered by every queued query.
+	 * 
+	 * @param conn connection to reconnect, must be held by the caller
+	 * @return true if the connection is usable again
+	 */
+	bool unsafe_reconnect(sql_connection& conn) {
+		auto now = std::chrono::steady_clock::now();
+		if (conn.state == cs_disconnected && now < conn.retry_after) {
+			std::lock_guard<std::mutex> status_lock(status_mutex);
+			last_error = "Database connection lost, waiting to reconnect";
+			return false;
+		}
+		creator->log(dpp::ll_warning, "SQL: Connection has died, reconnecting...");
+		free_statements(conn);
+		if (conn.state != cs_disconnected) {
+			mysql_close(&conn.handle);
+		}
+		if (!unsafe_connect(conn, *conn.info)) {
+			reconnect_failed(conn, now);
+			return false;
+		}
+		reconnected(conn);
+		return true;
+	}
+
+	/**
+	 * @brief Make sure a connection is usable, reconnecting it if it was lost
+	 * 
+	 * @param conn connection to check, must be held by the caller
+	 * @return true if the connection is usable
+	 */
+	bool unsafe_ensure_connected(sql_connection& conn) {
+		return conn.state == cs_connected || unsafe_reconnect(conn);
+	}
+
+	/**
+	 * @brief Open new connections all at once, each on its own thread. A connection which
+	 * fails is retried after the reconnect backoff, 1 second and then doubling each time.
+	 *
+	 * @param conns connections to open, must be held by the caller
+	 * @param info credentials to connect with
+	 * @param retries number of times to retry each connection after its first attempt
+	 * @return number of connections which could not be opened. Those are closed, and
+	 * left in the disconnected state with a backoff before their next reconnect.
+	 */
+	size_t unsafe_connect_all(const std::vector<sql_connection*>& conns, const connection_info& info, size_t retries) {
+		/* mysql_init() initialises the client library on first use, which isn't thread safe */
+		mysql_library_init(0, nullptr, nullptr);
+		std::atomic<size_t> failed{0};
+		auto open = [&info, &failed, retries](sql_connection* conn) {
+			for (size_t attempt = 0; !unsafe_connect(*conn, info); ++attempt) {
+				reconnect_failed(*conn, std::chrono::steady_clock::now());
+				if (attempt == retries) {
+					++failed;
+					return;
+				}
+				std::this_thread::sleep_until(conn->retry_after);
+			}
+			conn->state = cs_connected;
+			conn->backoff = 0s;
+		};
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < conns.size(); ++i) {
+			threads.emplace_back(open, conns[i]);
+		}
+		if (!conns.empty()) {
+			open(conns[0]);
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		return failed;
+	}
+
+	/**
+	 * @brief Ping connections which have been idle for at least the given time,
+	 * so that the server doesn't drop them for inactivity. Connections which fail
+	 * the ping, or were already lost, are reconnected here instead of on their next query.
+	 * Busy connections are skipped, they are evidently not idle. Replica
+	 * connections are pinged too, which is how a replica that was down rejoins.
+	 * 
+	 * @param pool database to ping the connections of
+	 * @param idle minimum idle time before a connection is pinged
+	 */
+	void keepalive(pool_state& pool, std::chrono::seconds idle) {
+		std::vector<sql_connection*> idle_connections;
+		{
+			std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+			auto now = std::chrono::steady_clock::now();
+			auto check = [&](const std::vector<std::unique_ptr<sql_connection>>& pool) {
+				for (auto& c : pool) {
+					if (!c->busy && (c->state != cs_connected || now - c->last_used >= idle)) {
+						c->busy = true;
+						idle_connections.emplace_back(c.get());
+					}
+				}
+			};
+			check(pool.connections);
+			for (auto& replica : pool.replicas) {
+				check(replica->connections);
+			}
+		}
+		for (sql_connection* conn : idle_connections) {
+			if (conn->state == cs_connected) {
+				if (mysql_ping(&conn->handle) == 0) {
+					conn->last_used = std::chrono::steady_clock::now();
+				} else {
+					conn->state = cs_lost;
+				}
+			}
+			unsafe_ensure_connected(*conn);
+		}
+		{
+			std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+			for (sql_connection* conn : idle_connections) {
+				conn->busy = false;
+			}
+		}
+		pool.pool_cv.notify_all();
+	}
+
+	/**
+	 * @brief Disconnect every connection in a pool and empty it.
+	 * Waits for all leased connections to be returned first.
+	 * 
+	 * @param pool database the connections belong to
+	 * @param pool_lock lock on its pool_mutex held by the caller
+	 * @param group connections to close
+	 */
+	void unsafe_close(pool_state& pool, std::unique_lock<std::mutex>& pool_lock, std::vector<std::unique_ptr<sql_connection>>& group) {
+		pool.pool_cv.wait(pool_lock, [&group] {
+			for (auto& c : group) {
+				if (c->busy) {
+					return false;
+				}
+			}
+			return true;
+		});
+		for (auto& c : group) {
+			free_statements(*c);
+			if (c->state != cs_disconnected) {
+				mysql_close(&c->handle);
+			}
+		}
+		group.clear();
+	}
+
+	/**
+	 * @brief Disconnect every connection of the primary's pool and empty it
+	 * 
+	 * @param pool database to close
+	 * @param pool_lock lock on its pool_mutex held by the caller
+	 */
+	void unsafe_close(pool_state& pool, std::unique_lock<std::mutex>& pool_lock) {
+		unsafe_close(pool, pool_lock, pool.connections);
+	}
+
+	/**
+	 * @brief Disconnect every replica and forget them, so reads go to the primary
+	 * 
+	 * @param pool database to close the replicas of
+	 * @param pool_lock lock on its pool_mutex held by the caller
+	 */
+	void unsafe_close_replicas(pool_state& pool, std::unique_lock<std::mutex>& pool_lock) {
+		pool.replica_count = 0;
+		for (auto& replica : pool.replicas) {
+			unsafe_close(pool, pool_lock, replica->connections);
+		}
+		pool.replicas.clear();
+	}
+
+	/**
+	 * @brief Connect to the read replicas in the `replicas` array of the database
+	 * configuration block. A replica which can't be reached now is still added,
+	 * with its connections waiting out a reconnect backoff, and reads skip it until
+	 * it comes back. Omitted credentials are those of the primary.
+	 *
+	 * @param pool database the replicas belong to
+	 * @param dbconf database configuration block
+	 * @return total number of replica connections
+	 */
+	size_t connect_replicas(pool_state& pool, const json& dbconf) {
+		/* Opened without pool_mutex, as with connect(), since a replica which is down can take seconds to time out */
+		std::vector<std::unique_ptr<replica_pool>> replicas;
+		size_t total{0};
+		static const json no_replicas = json::array();
+		for (const json& r : dbconf.contains("replicas") ? dbconf["replicas"] : no_replicas) {
+			auto replica = std::make_unique<replica_pool>();
+			replica->credentials = connection_info{
+				.host = r["host"].get<std::string>(),
+				.user = r.contains("username") ? r["username"].get<std::string>() : pool.credentials.user,
+				.pass = r.contains("password") ? r["password"].get<std::string>() : pool.credentials.pass,
+				.db = r.contains("database") ? r["database"].get<std::string>() : pool.credentials.db,
+				.port = r.contains("port") ? r["port"].get<int>() : pool.credentials.port,
+				.socket = r.contains("socket") ? r["socket"].get<std::string>() : "",
+				.statement_timeout = pool.credentials.statement_timeout,
+				.read_timeout = pool.credentials.read_timeout,
+			};
+			size_t size = std::max<size_t>(r.contains("pool_size") ? r["pool_size"].get<size_t>() : 1, 1);
+			std::vector<sql_connection*> opening;
+			for (size_t i = 0; i < size; ++i) {
+				opening.emplace_back(replica->connections.emplace_back(std::make_unique<sql_connection>()).get());
+			}
+			/* A replica which is down isn't retried here, reads skip it until its connections reconnect */
+			unsafe_connect_all(opening, replica->credentials, 0);
+			total += size;
+			replicas.emplace_back(std::move(replica));
+		}
+		std::unique_lock<std::mutex> pool_lock(pool.pool_mutex);
+		unsafe_close_replicas(pool, pool_lock);
+		if (dbconf.contains("replica_policy")) {
+			pool.replica_selection = dbconf["replica_policy"].get<std::string>() == "least_loaded" ? rp_least_loaded : rp_round_robin;
+		}
+		pool.replicas = std::move(replicas);
+		pool.replica_count = pool.replicas.size();
+		return total;
+	}
+
+	bool connect(const std::string &host, const std::string &user, const std::string &pass, const std::string &db, int port, const std::string &socket, size_t pool_size) {
+		pool_state& pool = current_pool();
+		connection_info info;
+		{
+			std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+			/* Timeouts are kept from init(), connect() doesn't take them */
+			info = connection_info{ .host = host, .user = user, .pass = pass, .db = db, .port = port, .socket = socket, .statement_timeout = pool.credentials.statement_timeout, .read_timeout = pool.credentials.read_timeout };
+		}
+		/*
+		 * Opened without pool_mutex, as retries and their backoff can take seconds, and
+		 * would stall every lease, keepalive and prepare() of the pool. The connections
+		 * already open keep serving queries meanwhile.
+		 */
+		std::vector<std::unique_ptr<sql_connection>> opened;
+		std::vector<sql_connection*> opening;
+		for (size_t i = 0; i < std::max<size_t>(pool_size, 1); ++i) {
+			opening.emplace_back(opened.emplace_back(std::make_unique<sql_connection>()).get());
+		}
+		if (unsafe_connect_all(opening, info, pool.connect_retries) != 0) {
+			/* The old connections and their credentials stay as they were */
+			for (auto& c : opened) {
+				if (c->state != cs_disconnected) {
+					mysql_close(&c->handle);
+				}
+			}
+			return false;
+		}
+		std::unique_lock<std::mutex> pool_lock(pool.pool_mutex);
+		unsafe_close(pool, pool_lock);
+		pool.credentials = info;
+		for (auto& c : opened) {
+			c->info = &pool.credentials;
+		}
+		pool.connections = std::move(opened);
+		pool_lock.unlock();
+		pool.pool_cv.notify_all();
+		return true;
+	}
+
+	/**
+	 * @brief Add a query to its lane of the queue served by the worker threads,
+	 * or by the non-blocking engine if it is enabled and the job is a plain query.
+	 * Reads which may go to a replica always queue for the worker threads, which
+	 * lease replica connections; the engine's connections are to the primary.
+	 * If the lane is at its configured limit, the job is rejected, and its callback
+	 * is called immediately with an error.
+	 *
+	 * @param job query to run. A job with an empty key runs no query, but still
+	 * advances the queue and calls its callback.
+	 */
+	void enqueue(cached_query_results&& job) {
+		pool_state& pool = current_pool();
+#ifdef DB_ASYNC_ENGINE
+		bool nonblocking = pool.nonblocking_engine.enabled && job.key && !job.transaction && !job.work && !(pool.replica_count && job.key.reads() && !job.options.primary) && !streams_parameters(job.parameters);
+		std::shared_lock<std::shared_mutex> submitting;
+		if (nonblocking) {
+			/* The engine may have stopped since, in which case its queue has already been drained */
+			submitting = std::shared_lock<std::shared_mutex>(pool.nonblocking_engine.submit_mutex);
+			nonblocking = pool.nonblocking_engine.enabled;
+		}
+		lane_scheduler& queue = nonblocking ? pool.nonblocking_engine.queue : pool.sql_query_queue;
+#else
+		lane_scheduler& queue = pool.sql_query_queue;
+#endif
+		size_t lane = std::min<size_t>(job.options.lane, lane_count - 1);
+		size_t limit = queue.limit[lane];
+		if (limit && queue.depth[lane] >= limit) {
+			resultset rejected;
+			rejected.error = fmt::format("Queue lane {} is full ({} queries waiting)", lane_names[lane], limit);
+			creator->log(dpp::ll_warning, "SQL: " + rejected.error + (job.key ? ": " + job.key.sql() : ""));
+#ifdef DB_ASYNC_ENGINE
+			/* The callback may queue another query */
+			if (submitting) {
+				submitting.unlock();
+			}
+#endif
+			if (job.callback) {
+				job.callback(std::move(rejected));
+			}
+			return;
+		}
+
+		thread_local job_node_cache cache;
+		if (cache.nodes.empty()) {
+			job_nodes.refill(cache.nodes);
+		}
+		job_node* n = cache.nodes.back();
+		cache.nodes.pop_back();
+		n->job = std::move(job);
+		n->job.queued = std::chrono::steady_clock::now();
+		++queue.depth[lane];
+		queue.lanes[lane].push(n);
+#ifdef DB_ASYNC_ENGINE
+		if (nonblocking) {
+			pool.nonblocking_engine.notify();
+			return;
+		}
+#endif
+		queue.signal.fetch_add(1);
+		if (queue.sleeping.load() > 0) {
+			queue.signal.notify_one();
+		}
+	}
+
+	size_t latency_histogram::bucket_of(uint64_t microseconds) {
+		if (microseconds < 4) {
+			return microseconds;
+		}
+		size_t exponent = std::bit_width(microseconds) - 1;
+		size_t sub_bucket = (microseconds >> (exponent - 2)) & 3;
+		return std::min<size_t>(4 + (exponent - 2) * 4 + sub_bucket, latency_buckets - 1);
+	}
+
+	uint64_t latency_histogram::upper_bound(size_t bucket) {
+		if (bucket < 4) {
+			return bucket;
+		}
+		size_t exponent = (bucket - 4) / 4 + 2;
+		uint64_t lower = uint64_t(4 + (bucket - 4) % 4) << (exponent - 2);
+		return lower + (uint64_t(1) << (exponent - 2)) - 1;
+	}
+
+	uint64_t latency_histogram::percentile(double p) const {
+		if (count == 0) {
+			return 0;
+		}
+		uint64_t rank = std::max<uint64_t>(std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * count), 1);
+		uint64_t seen{0};
+		for (size_t bucket = 0; bucket < latency_buckets; ++bucket) {
+			seen += buckets[bucket];
+			if (seen >= rank) {
+				return upper_bound(bucket);
+			}
+		}
+		return upper_bound(latency_buckets - 1);
+	}
+
+	/**
+	 * @brief Metric counters of one statement, recorded by one thread. Only the owning
+	 * thread writes them, so plain relaxed stores suffice; they are atomic so that a
+	 * snapshot can read them at the same time.
+	 */
+	struct metric_counters {
+		std::atomic<uint64_t> executions{0};
+		std::atomic<uint64_t> rows{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> errors{0};
+		std::atomic<uint64_t> execution_sum{0};
+		std::atomic<uint64_t> queue_wait_sum{0};
+		std::array<std::atomic<uint64_t>, latency_buckets> execution{};
+		std::array<std::atomic<uint64_t>, latency_buckets> queue_wait{};
+	};
+
+	/**
+	 * @brief Add to a counter which only the calling thread writes
+	 *
+	 * @param counter counter to add to
+	 * @param n amount to add
+	 */
+	void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief The metric counters of one thread, by statement index. Counters are allocated
+	 * in chunks, which are published atomically, so that a snapshot can walk them whilst
+	 * the owning thread adds more. Statements beyond the last chunk are not recorded.
+	 */
+	struct thread_metrics {
+		static constexpr size_t chunk_size = 64;
+		static constexpr size_t max_chunks = 1024;
+		std::array<std::atomic<metric_counters*>, max_chunks> chunks{};
+
+		thread_metrics() = default;
+		thread_metrics(const thread_metrics&) = delete;
+		thread_metrics& operator=(const thread_metrics&) = delete;
+
+		~thread_metrics() {
+			for (auto& chunk : chunks) {
+				delete[] chunk.load();
+			}
+		}
+
+		/**
+		 * @brief Get the counters of a statement, allocating them if needed. Owning thread only.
+		 * @param index statement index
+		 * @return counters, or nullptr if the index is out of range
+		 */
+		metric_counters* get(size_t index) {
+			if (index / chunk_size >= max_chunks) {
+				return nullptr;
+			}
+			std::atomic<metric_counters*>& chunk = chunks[index / chunk_size];
+			metric_counters* counters = chunk.load(std::memory_order_relaxed);
+			if (!counters) {
+				counters = new metric_counters[chunk_size];
+				chunk.store(counters, std::memory_order_release);
+			}
+			return &counters[index % chunk_size];
+		}
+
+		/**
+		 * @brief Find the counters of a statement, from any thread
+		 * @param index statement index
+		 * @return counters, or nullptr if the thread has recorded none for the statement's chunk
+		 */
+		const metric_counters* find(size_t index) const {
+			if (index / chunk_size >= max_chunks) {
+				return nullptr;
+			}
+			metric_counters* counters = chunks[index / chunk_size].load(std::memory_order_acquire);
+			return counters ? &counters[index % chunk_size] : nullptr;
+		}
+	};
+
+	/**
+	 * @brief Every thread's metrics. A thread which exits folds its counters into
+	 * retired, so threads started per transaction don't accumulate here.
+	 */
+	struct metrics_registry {
+		std::mutex mutex;
+		std::vector<thread_metrics*> threads;
+		std::vector<statement_metrics> retired;
+	} recorded_metrics;
+
+	/**
+	 * @brief Add a histogram's worth of counters into a histogram
+	 *
+	 * @param into histogram to add to
+	 * @param buckets counters of each bucket
+	 * @param sum sum of the samples
+	 */
+	void add_histogram(latency_histogram& into, const std::array<std::atomic<uint64_t>, latency_buckets>& buckets, uint64_t sum) {
+		for (size_t bucket = 0; bucket < latency_buckets; ++bucket) {
+			uint64_t n = buckets[bucket].load(std::memory_order_relaxed);
+			into.buckets[bucket] += n;
+			into.count += n;
+		}
+		into.sum += sum;
+	}
+
+	/**
+	 * @brief Add one thread's counters of a statement into its metrics
+	 *
+	 * @param into metrics to add to
+	 * @param counters counters to add
+	 */
+	void add_counters(statement_metrics& into, const metric_counters& counters) {
+		into.executions += counters.executions.load(std::memory_order_relaxed);
+		into.rows += counters.rows.load(std::memory_order_relaxed);
+		into.bytes += counters.bytes.load(std::memory_order_relaxed);
+		into.errors += counters.errors.load(std::memory_order_relaxed);
+		add_histogram(into.execution, counters.execution, counters.execution_sum.load(std::memory_order_relaxed));
+		add_histogram(into.queue_wait, counters.queue_wait, counters.queue_wait_sum.load(std::memory_order_relaxed));
+	}
+
+	/**
+	 * @brief Add one statement's metrics into another's
+	 *
+	 * @param into metrics to add to
+	 * @param from metrics to add
+	 */
+	void add_metrics(statement_metrics& into, const statement_metrics& from) {
+		into.executions += from.executions;
+		into.rows += from.rows;
+		into.bytes += from.bytes;
+		into.errors += from.errors;
+		for (auto [histogram, other] : { std::pair{&into.execution, &from.execution}, std::pair{&into.queue_wait, &from.queue_wait} }) {
+			for (size_t bucket = 0; bucket < latency_buckets; ++bucket) {
+				histogram->buckets[bucket] += other->buckets[bucket];
+			}
+			histogram->count += other->count;
+			histogram->sum += other->sum;
+		}
+	}
+
+	/**
+	 * @brief Owner of the calling thread's metrics, which registers them on first use,
+	 * and retires them when the thread exits
+	 */
+	struct thread_metrics_handle {
+		thread_metrics* counters;
+
+		thread_metrics_handle() : counters(new thread_metrics()) {
+			std::lock_guard<std::mutex> metrics_lock(recorded_metrics.mutex);
+			recorded_metrics.threads.emplace_back(counters);
+		}
+
+		~thread_metrics_handle() {
+			std::lock_guard<std::mutex> metrics_lock(recorded_metrics.mutex);
+			for (size_t chunk = 0; chunk < thread_metrics::max_chunks; ++chunk) {
+				if (!counters->chunks[chunk].load()) {
+					continue;
+				}
+				size_t first = chunk * thread_metrics::chunk_size;
+				if (recorded_metrics.retired.size() < first + thread_metrics::chunk_size) {
+					recorded_metrics.retired.resize(first + thread_metrics::chunk_size);
+				}
+				for (size_t index = first; index < first + thread_metrics::chunk_size; ++index) {
+					add_counters(recorded_metrics.retired[index], *counters->find(index));
+				}
+			}
+			std::erase(recorded_metrics.threads, counters);
+			delete counters;
+		}
+	};
+
+	/**
+	 * @brief Get the calling thread's counters of a statement
+	 *
+	 * @param key statement
+	 * @return counters, or nullptr if the statement can't be recorded
+	 */
+	metric_counters* thread_counters(const query_key& key) {
+		thread_local thread_metrics_handle handle;
+		return key ? handle.counters->get(key.id()) : nullptr;
+	}
+
+	/**
+	 * @brief Microseconds since a point in time
+	 *
+	 * @param start point in time
+	 * @return microseconds elapsed
+	 */
+	uint64_t microseconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/**
+	 * @brief Record how long a job waited in its queue
+	 *
+	 * @param job job taken from a queue
+	 */
+	void record_queue_wait(const cached_query_results& job) {
+		if (metric_counters* counters = thread_counters(job.key)) {
+			uint64_t waited = microseconds_since(job.queued);
+			bump(counters->queue_wait_sum, waited);
+			bump(counters->queue_wait[latency_histogram::bucket_of(waited)]);
+		}
+	}
+
+	std::vector<statement_metrics> metrics_snapshot() {
+		std::vector<statement_metrics> all;
+		{
+			std::shared_lock<std::shared_mutex> intern_lock(intern_mutex);
+			all.resize(interned_text.size());
+			for (size_t index = 0; index < all.size(); ++index) {
+				all[index].sql = interned_text[index];
+			}
+		}
+		{
+			std::lock_guard<std::mutex> metrics_lock(recorded_metrics.mutex);
+			for (size_t index = 0; index < all.size(); ++index) {
+				if (index < recorded_metrics.retired.size()) {
+					add_metrics(all[index], recorded_metrics.retired[index]);
+				}
+				for (const thread_metrics* t : recorded_metrics.threads) {
+					if (const metric_counters* counters = t->find(index)) {
+						add_counters(all[index], *counters);
+					}
+				}
+			}
+		}
+		std::erase_if(all, [](const statement_metrics& m) {
+			return m.executions == 0 && m.queue_wait.count == 0;
+		});
+		return all;
+	}
+
+	/**
+	 * @brief Take the job out of a node popped from a queue, and recycle the node
+	 *
+	 * @param n node
+	 * @return the job
+	 */
+	cached_query_results take_job(job_node* n) {
+		thread_local job_node_cache released;
+		cached_query_results job = std::move(n->job);
+		n->job = {};
+		record_queue_wait(job);
+		released.nodes.emplace_back(n);
+		if (released.nodes.size() >= job_node_batch) {
+			job_nodes.give_back(released.nodes);
+		}
+		return job;
+	}
+
+	/**
+	 * @brief Take the next job from a database's queue, sleeping only whilst every lane is empty
+	 *
+	 * @param pool database
+	 * @return the job, or nothing once the database is stopping and its queue is empty
+	 */
+	std::optional<cached_query_results> dequeue(pool_state& pool) {
+		lane_scheduler& queue = pool.sql_query_queue;
+		while (true) {
+			uint32_t seen = queue.signal.load();
+			job_node* n{nullptr};
+			{
+				std::lock_guard<std::mutex> consumer_lock(queue.consumer_mutex);
+				n = queue.unsafe_next();
+			}
+			if (n) {
+				return take_job(n);
+			}
+			if (pool.stopping) {
+				return std::nullopt;
+			}
+			++queue.sleeping;
+			queue.signal.wait(seen);
+			--queue.sleeping;
+		}
+	}
+
+	void query_callback(const query_key& key, paramlist parameters, sql_query_callback cb, const query_options& options) {
+		enqueue(cached_query_results{.key = key, .parameters = std::move(parameters), .callback = std::move(cb), .options = options, .transaction = {}, .work = {}, .queued = {}});
+	}
+
+	void query_callback(const std::string &format, paramlist parameters, sql_query_callback cb, const query_options& options) {
+		query_callback(intern(format), std::move(parameters), std::move(cb), options);
+	}
+
+#ifdef DPP_CORO
+	dpp::async<resultset> co_query(const query_key& key, paramlist parameters, const query_options& options) {
+		/* dpp::async calls this immediately, so the parameters can be moved straight into the job */
+		return dpp::async<resultset>{ [&key, &parameters, &options] <typename C> (C &&cc) { return query_callback(key, std::move(parameters), std::forward<C>(cc), options); }};
+	}
+
+	dpp::async<resultset> co_query(const std::string &format, paramlist parameters, const query_options& options) {
+		return co_query(intern(format), std::move(parameters), options);
+	}
+#endif
+
+	/**
+	 * @brief Check if a query's deadline has passed
+	 *
+	 * @param options options of the query
+	 * @return true if it has a deadline, and the deadline is now or earlier
+	 */
+	bool deadline_passed(const query_options& options) {
+		return options.deadline != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() >= options.deadline;
+	}
+
+	/**
+	 * @brief Error of a query which reached its deadline before it could run
+	 */
+	const std::string deadline_error = "Query deadline passed before it ran";
+
+	/**
+	 * @brief Run a worker thread's jobs until its database stops
+	 *
+	 * @param pool database the worker serves
+	 * @param worker number of the worker, for its thread name
+	 */
+	void run_worker(pool_state& pool, size_t worker) {
+		dpp::utility::set_thread_name("sql/coro/" + std::to_string(worker));
+		while (std::optional<cached_query_results> job = dequeue(pool)) {
+			cached_query_results& qr = *job;
+			resultset results{};
+			{
+				/* Queries the job makes run on this database, its callback runs outside of it */
+				pool_scope scope(pool);
+				if (deadline_passed(qr.options)) {
+					/* Whoever wanted the result has given up on it, don't spend a connection on it */
+					results.error = deadline_error;
+					creator->log(dpp::ll_warning, "SQL: Dropped queued job: " + results.error);
+				} else if (qr.transaction) {
+					/**
+					 * A transaction holds one connection for its entire duration. pinned_connection
+					 * is thread_local, so every db::query() the closure makes on this thread runs on
+					 * that connection, whilst the rest of the pool keeps serving other queries.
+					 */
+					connection_lease lease;
+					if (lease && unsafe_ensure_connected(*lease)) {
+						pinned_connection = lease.get();
+						qr.transaction();
+						pinned_connection = nullptr;
+					} else {
+						results.error = "Not connected to database";
+						creator->log(dpp::ll_error, "SQL: Transaction could not start: " + results.error);
+					}
+				} else if (qr.work) {
+					results = qr.work();
+				} else if (qr.key) {
+					results = query(qr.key, qr.parameters, qr.options);
+				}
+			}
+			if (qr.callback) {
+				qr.callback(std::move(results));
+			}
+		}
+		--pool.workers_running;
+		pool.workers_running.notify_all();
+	}
+
+	/**
+	 * @brief Write a database's buffered deltas, and wait for the writes. Defined with
+	 * db::accumulate(), as it runs batches.
+	 *
+	 * @param pool database
+	 */
+	void flush_accumulators(pool_state& pool);
+
+	/**
+	 * @brief Queue a flush of a database's buffered deltas for its worker threads,
+	 * unless there are none or one is already queued
+	 *
+	 * @param pool database
+	 */
+	void queue_accumulator_flush(pool_state& pool) {
+		if (pool.accumulated_keys == 0 || pool.accumulate_flush_queued.exchange(true)) {
+			return;
+		}
+		pool_scope scope(pool);
+		query_options options;
+		options.lane = lane_background;
+		/* The callback also runs if the lane rejects the flush, so the next add can queue another */
+		enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = [&pool](resultset&&) {
+			pool.accumulate_flush_queued = false;
+		}, .options = options, .transaction = {}, .work = [&pool]() {
+			pool.accumulate_flush_queued = false;
+			flush_accumulators(pool);
+			return resultset{};
+		}, .queued = {}});
+	}
+
+	/**
+	 * @brief Connect a database from its configuration block, and start its workers and timers
+	 *
+	 * @param pool database to initialise
+	 * @param bot creating D++ cluster
+	 * @param dbconf configuration block, in the format of the `database` block
+	 * @return true if the primary's pool connected
+	 */
+	bool init_pool(pool_state& pool, dpp::cluster& bot, const json& dbconf) {
+		creator = &bot;
+		pool_scope scope(pool);
+		size_t pool_size = std::max<size_t>(dbconf.contains("pool_size") ? dbconf["pool_size"].get<size_t>() : 1, 1);
+		size_t async_connections = dbconf.contains("async_connections") ? dbconf["async_connections"].get<size_t>() : 0;
+		std::chrono::seconds keepalive_interval{dbconf.contains("keepalive") ? dbconf["keepalive"].get<uint64_t>() : 0};
+		std::chrono::seconds accumulate_interval{dbconf.contains("accumulate_interval") ? dbconf["accumulate_interval"].get<uint64_t>() : 1};
+		if (dbconf.contains("lanes")) {
+			const json& lanes = dbconf["lanes"];
+			auto configure = [&lanes](lane_scheduler& queue) {
+				std::lock_guard<std::mutex> consumer_lock(queue.consumer_mutex);
+				if (lanes.contains("policy")) {
+					queue.policy = lanes["policy"].get<std::string>() == "weighted" ? lp_weighted : lp_strict;
+				}
+				if (lanes.contains("starvation_limit")) {
+					queue.starvation_limit = std::max<size_t>(lanes["starvation_limit"].get<size_t>(), 1);
+				}
+				for (size_t lane = 0; lane < lane_count; ++lane) {
+					if (lanes.contains("weights") && lanes["weights"].contains(lane_names[lane])) {
+						queue.weights[lane] = std::max<int64_t>(lanes["weights"][lane_names[lane]].get<int64_t>(), 1);
+					}
+					if (lanes.contains("limits") && lanes["limits"].contains(lane_names[lane])) {
+						queue.limit[lane] = lanes["limits"][lane_names[lane]].get<size_t>();
+					}
+				}
+			};
+			configure(pool.sql_query_queue);
+#ifdef DB_ASYNC_ENGINE
+			configure(pool.nonblocking_engine.queue);
+#endif
+		}
+		pool.credentials.statement_timeout = dbconf.contains("statement_timeout") ? dbconf["statement_timeout"].get<uint64_t>() : 3000;
+		pool.credentials.read_timeout = dbconf.contains("read_timeout") ? dbconf["read_timeout"].get<unsigned int>() : 0;
+		pool.connect_retries = dbconf.contains("connect_retries") ? dbconf["connect_retries"].get<size_t>() : 3;
+		if (dbconf.contains("cache_entries")) {
+			pool.result_cache_max_entries = dbconf["cache_entries"].get<size_t>();
+		}
+		if (dbconf.contains("cache_memory")) {
+			pool.result_cache_max_bytes = dbconf["cache_memory"].get<size_t>();
+		}
+		if (dbconf.contains("result_arenas")) {
+			spare_arenas = dbconf["result_arenas"].get<size_t>();
+		}
+		if (dbconf.contains("accumulate_keys")) {
+			pool.accumulate_max_keys = std::max<size_t>(dbconf["accumulate_keys"].get<size_t>(), 1);
+		}
+		if (!db::connect(dbconf["host"], dbconf["username"], dbconf["password"], dbconf["database"], dbconf["port"], dbconf.contains("socket") ? dbconf["socket"] : "", pool_size)) {
+			creator->log(dpp::ll_critical, fmt::format("Database connection error connecting to {}: {}", dbconf["database"], last_error));
+			return false;
+		}
+		size_t replica_connections = connect_replicas(pool, dbconf);
+		std::vector<std::string> warm = dbconf.contains("prepare") ? dbconf["prepare"].get<std::vector<std::string>>() : std::vector<std::string>{};
+		if (dbconf.contains("prepare_file")) {
+			std::ifstream file(dbconf["prepare_file"].get<std::string>());
+			if (!file) {
+				creator->log(dpp::ll_warning, "SQL: Can't read prepare_file " + dbconf["prepare_file"].get<std::string>());
+			}
+			for (std::string line; std::getline(file, line);) {
+				if (!line.empty() && line.back() == '\r') {
+					line.pop_back();
+				}
+				if (line.find_first_not_of(" \t") != std::string::npos && !line.starts_with("--") && !line.starts_with("#")) {
+					warm.emplace_back(line);
+				}
+			}
+		}
+		/* Statements are prepared before the workers start, so the first queries find them ready */
+		if (!warm.empty() && !prepare(warm)) {
+			creator->log(dpp::ll_warning, "SQL: Some statements could not be prepared ahead of time, they will be prepared when first used");
+		}
+		/* One worker per pooled connection, each worker takes the next queued query */
+		pool.stopping = false;
+		for (size_t worker = pool.workers_started; worker < pool_size + replica_connections; ++worker, ++pool.workers_started) {
+			++pool.workers_running;
+			std::thread(run_worker, std::ref(pool), worker).detach();
+		}
+#ifdef DB_ASYNC_ENGINE
+		pool.nonblocking_engine.stop();
+		pool.nonblocking_engine.pool = &pool;
+		if (async_connections > 0 && !pool.nonblocking_engine.start(async_connections, pool.credentials)) {
+			creator->log(dpp::ll_error, fmt::format("SQL: Non-blocking engine could not start, queries will run on the worker threads: {}", last_error));
+		}
+#else
+		if (async_connections > 0) {
+			creator->log(dpp::ll_warning, "SQL: async_connections needs MariaDB Connector/C and D++ 10.1 or later, queries will run on the worker threads");
+		}
+#endif
+		if (pool.keepalive_timer) {
+			bot.stop_timer(*pool.keepalive_timer);
+			pool.keepalive_timer.reset();
+		}
+		if (keepalive_interval.count() > 0) {
+			pool.keepalive_timer = bot.start_timer([&pool, keepalive_interval](dpp::timer) {
+				keepalive(pool, keepalive_interval);
+			}, keepalive_interval.count());
+		}
+		if (!pool.result_cache_timer) {
+			pool.result_cache_timer = bot.start_timer([&pool](dpp::timer) {
+				expire_result_cache(pool);
+			}, 10);
+		}
+		if (pool.accumulate_timer) {
+			bot.stop_timer(*pool.accumulate_timer);
+			pool.accumulate_timer.reset();
+		}
+		if (accumulate_interval.count() > 0) {
+			pool.accumulate_timer = bot.start_timer([&pool](dpp::timer) {
+				queue_accumulator_flush(pool);
+			}, accumulate_interval.count());
+		}
+		creator->log(dpp::ll_info, fmt::format("Connected to database: {} ({} connections, {} replicas, {} statements prepared)", dbconf["database"], pool_size, pool.replica_count.load(), warm.size()));
+		return true;
+	}
+
+	void init (dpp::cluster& bot) {
+		if (!init_pool(default_pool, bot, config::get("database"))) {
+			exit(2);
+		}
+	}
+
+	/**
+	 * @brief Certain types of query are not supported in the binary protocol
+	 * used for prepared statements. As such they must be executed 'raw', and
+	 * unprepared. This is not exposed to the interface as we don't want users
+	 * directly calling raw_query() and summoning Little Bobby Tables. Only
+	 * queries which return no result set are supported.
+	 * 
+	 * @return true query executed
+	 */
+	bool raw_query(const std::string& query) {
+		auto run = [&query](sql_connection& conn) {
+			/* A transaction's connection is never silently reconnected, its transaction died with it */
+			if (conn.state != cs_connected) {
+				return false;
+			}
+			if (mysql_real_query(&conn.handle, query.c_str(), query.length()) == 0) {
+				conn.last_used = std::chrono::steady_clock::now();
+				return true;
+			}
+			if (connection_lost(mysql_errno(&conn.handle))) {
+				conn.state = cs_lost;
+			}
+			return false;
+		};
+		if (pinned_connection) {
+			return run(*pinned_connection);
+		}
+		connection_lease lease;
+		return lease && unsafe_ensure_connected(*lease) && run(*lease);
+	}
+
+	bool start_transaction() {
+		transaction_tags.clear();
+		return raw_query("START TRANSACTION");
+	}
+
+	bool commit() {
+		bool committed = raw_query("COMMIT");
+		/* Results cached from other connections whilst the transaction ran may hold its old rows */
+		invalidate_tags(current_pool(), transaction_tags);
+		transaction_tags.clear();
+		return committed;
+	}
+
+	bool rollback() {
+		transaction_tags.clear();
+		return raw_query("ROLLBACK");
+	}
+
+	void transaction(std::function<bool()> closure, sql_query_callback callback) {
+		/**
+		 * The transaction is queued like any other query, and runs on its own connection
+		 * when a worker reaches it. Any number of transactions may be queued at once.
+		 */
+		enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = callback, .options = {}, .transaction = [closure]() {
+			try {
+				start_transaction();
+				bool should_commit{false};
+				if (closure) {
+					should_commit = closure();
+				}
+				if (should_commit) {
+					commit();
+				} else {
+					rollback();
+				}
+			}
+			catch (...) {
+				rollback();
+			}
+		}, .work = {}, .queued = {}});
+	}
+
+#ifdef DPP_CORO
+	dpp::async<resultset> co_transaction(std::function<bool()> closure) {
+		return dpp::async<resultset>{ [closure] <typename C> (C &&cc) { return transaction(closure, std::forward<C>(cc)); }};
+	}
+
+	struct txn_state {
+		/**
+		 * @brief Queries awaited through the txn, served by the transaction's worker
+		 */
+		std::queue<cached_query_results> jobs;
+		std::mutex mutex;
+		std::condition_variable cv;
+		/**
+		 * @brief Set once the closure has completed
+		 */
+		bool finished{false};
+		/**
+		 * @brief True if the closure returned true
+		 */
+		bool should_commit{false};
+
+		void post(cached_query_results&& job) {
+			{
+				std::lock_guard<std::mutex> state_lock(mutex);
+				jobs.emplace(std::move(job));
+			}
+			cv.notify_one();
+		}
+
+		void finish(bool commit) {
+			{
+				std::lock_guard<std::mutex> state_lock(mutex);
+				finished = true;
+				should_commit = commit;
+			}
+			cv.notify_one();
+		}
+	};
+
+	txn::txn(std::shared_ptr<txn_state> s) : state(std::move(s)) {
+	}
+
+	dpp::async<resultset> txn::co_query(const query_key& key, const paramlist &parameters, const query_options& options) {
+		return dpp::async<resultset>{ [s = state, key, parameters, options] <typename C> (C &&cc) {
+			s->post(cached_query_results{.key = key, .parameters = parameters, .callback = std::forward<C>(cc), .options = options, .transaction = {}, .work = {}, .queued = {}});
+		}};
+	}
+
+	dpp::async<resultset> txn::co_query(const std::string &format, const paramlist &parameters, const query_options& options) {
+		return co_query(intern(format), parameters, options);
+	}
+
+	/**
+	 * @brief Run a transaction's closure, and tell its worker once it completes.
+	 * This is a detached dpp::job, kept alive by the closure's own awaits.
+	 *
+	 * @param closure transactional coroutine
+	 * @param state transaction state
+	 */
+	dpp::job run_transaction(std::function<dpp::task<bool>(txn&)> closure, std::shared_ptr<txn_state> state) {
+		bool should_commit{false};
+		try {
+			txn t(state);
+			if (closure) {
+				should_commit = co_await closure(t);
+			}
+		}
+		catch (...) {
+			should_commit = false;
+		}
+		state->finish(should_commit);
+	}
+
+	dpp::async<resultset> co_transaction(std::function<dpp::task<bool>(txn&)> closure) {
+		return dpp::async<resultset>{ [closure] <typename C> (C &&cc) {
+			/* Served by a worker like any other transaction, so that stop_pool() waits for it */
+			enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = sql_query_callback(std::forward<C>(cc)), .options = {}, .transaction = {}, .work = [closure]() {
+				resultset rs;
+				connection_lease lease;
+				if (!lease || !unsafe_ensure_connected(*lease)) {
+					rs.error = "Not connected to database";
+				} else {
+					pinned_connection = lease.get();
+					if (!start_transaction()) {
+						rs.error = mysql_error(&pinned_connection->handle);
+					} else {
+						auto state = std::make_shared<txn_state>();
+						run_transaction(closure, state);
+
+						/* Serve the transaction's queries on this worker until its closure completes */
+						while (true) {
+							cached_query_results job;
+							{
+								std::unique_lock<std::mutex> state_lock(state->mutex);
+								state->cv.wait(state_lock, [&state] {
+									return !state->jobs.empty() || state->finished;
+								});
+								if (state->jobs.empty()) {
+									break;
+								}
+								job = std::move(state->jobs.front());
+								state->jobs.pop();
+							}
+							resultset results = query(job.key, job.parameters, job.options);
+							if (job.callback) {
+								job.callback(std::move(results));
+							}
+						}
+
+						if (state->should_commit) {
+							if (!commit()) {
+								rs.error = mysql_error(&pinned_connection->handle);
+								rollback();
+							}
+						} else {
+							rollback();
+						}
+					}
+					pinned_connection = nullptr;
+				}
+				if (!rs.error.empty()) {
+					creator->log(dpp::ll_error, "SQL: Transaction failed: " + rs.error);
+				}
+				return rs;
+			}, .queued = {}});
+		}};
+	}
+#endif
+
+	/**
+	 * @brief Disconnect a database's non-blocking engine, replicas and pool, once its
+	 * buffered deltas are written
+	 *
+	 * @param pool database to close
+	 */
+	void close_pool(pool_state& pool) {
+		flush_accumulators(pool);
+#ifdef DB_ASYNC_ENGINE
+		pool.nonblocking_engine.stop();
+#endif
+		std::unique_lock<std::mutex> pool_lock(pool.pool_mutex);
+		unsafe_close_replicas(pool, pool_lock);
+		unsafe_close(pool, pool_lock);
+	}
+
+	/**
+	 * @brief Close a database and stop its timers and worker threads, once they
+	 * have run every queued job. Must not be called from one of its workers.
+	 *
+	 * @param pool database to stop
+	 */
+	void stop_pool(pool_state& pool) {
+		if (creator) {
+			if (pool.keepalive_timer) {
+				creator->stop_timer(*pool.keepalive_timer);
+				pool.keepalive_timer.reset();
+			}
+			if (pool.result_cache_timer) {
+				creator->stop_timer(*pool.result_cache_timer);
+				pool.result_cache_timer.reset();
+			}
+			if (pool.accumulate_timer) {
+				creator->stop_timer(*pool.accumulate_timer);
+				pool.accumulate_timer.reset();
+			}
+		}
+		pool.stopping = true;
+		pool.sql_query_queue.signal.fetch_add(1);
+		pool.sql_query_queue.signal.notify_all();
+		for (size_t running = pool.workers_running; running > 0; running = pool.workers_running) {
+			pool.workers_running.wait(running);
+		}
+		pool.workers_started = 0;
+		close_pool(pool);
+	}
+
+	bool close() {
+		close_pool(current_pool());
+		mysql_library_end();
+		return true;
+	}
+
+	const std::string& error() {
+		std::lock_guard<std::mutex> status_lock(status_mutex);
+		return last_error;
+	}
+
+	/**
+	 * @brief Log an error and store it as the last error.
+	 * A lost connection is not handled here, unsafe_query() reconnects the
+	 * connection which lost it and retries the query where that is safe.
+	 *
+	 * @param format query which caused the error, or empty
+	 * @param error error message
+	 */
+	void log_error(const std::string& format, const std::string& error) {
+		std::string message = format.empty() ? error : fmt::format("{} (query: {})", error, format);
+		{
+			std::lock_guard<std::mutex> status_lock(status_mutex);
+			last_error = message;
+		}
+		creator->log(dpp::ll_error, message);
+	}
+
+	size_t affected_rows() {
+		std::lock_guard<std::mutex> status_lock(status_mutex);
+		return rows_affected;
+	}
+
+	/**
+	 * @brief Find the shard of a database's result cache holding a key
+	 *
+	 * @param pool database
+	 * @param k key
+	 * @return shard
+	 */
+	result_cache_shard& result_cache_shard_of(pool_state& pool, const result_cache_key& k) {
+		return pool.result_cache[result_cache_hash()(&k) % result_cache_shards];
+	}
+
+	/**
+	 * @brief Tags a cached query's results are stored under: those given by the caller,
+	 * or else those derived from the statement
+	 *
+	 * @param key statement
+	 * @param tags table names given by the caller, may be empty
+	 * @return tag slots
+	 */
+	std::vector<uint16_t> result_cache_tags(const query_key& key, const std::vector<std::string>& tags) {
+		if (tags.empty()) {
+			return statement_tags_of(key);
+		}
+		std::vector<uint16_t> slots;
+		for (const std::string& tag : tags) {
+			slots.emplace_back(tag_slot(tag));
+		}
+		return slots;
+	}
+
+	/**
+	 * @brief Look up an unexpired result set whose tables haven't been written to since,
+	 * marking it most recently used. The shard's mutex must be held.
+	 *
+	 * @param pool database the cache belongs to
+	 * @param shard shard holding the key
+	 * @param k key
+	 * @return result set, or nullptr on a miss
+	 */
+	std::shared_ptr<const resultset> unsafe_result_cache_find(const pool_state& pool, result_cache_shard& shard, const result_cache_key& k) {
+		auto f = shard.index.find(&k);
+		if (f == shard.index.end()) {
+			return nullptr;
+		}
+		if (std::chrono::steady_clock::now() >= f->second->expiry || tag_generation(pool, f->second->tags) != f->second->generation) {
+			shard.erase(f->second);
+			return nullptr;
+		}
+		shard.lru.splice(shard.lru.begin(), shard.lru, f->second);
+		return f->second->results;
+	}
+
+	/**
+	 * @brief Store a result set, evicting the least recently used entries until
+	 * the shard is within its limits. Failed queries are not stored.
+	 * The shard's mutex must be held.
+	 *
+	 * @param pool database the cache belongs to
+	 * @param shard shard holding the key
+	 * @param k key
+	 * @param results result set to store
+	 * @param lifetime how long to keep the result set, in seconds
+	 * @param tags tag slots of the tables the results were read from
+	 * @param generation tag_generation() of the tags from before the query was started
+	 */
+	void unsafe_result_cache_store(const pool_state& pool, result_cache_shard& shard, const result_cache_key& k, const std::shared_ptr<const resultset>& results, double lifetime, std::vector<uint16_t> tags, uint64_t generation) {
+		if (!results->error.empty() || tag_generation(pool, tags) != generation) {
+			/* Don't cache a failure for the lifetime of the query, nor results a write has already made stale */
+			return;
+		}
+		size_t bytes = sizeof(result_cache_entry) + results->rows.memory_usage() + results->error.capacity();
+		size_t max_entries = std::max<size_t>(pool.result_cache_max_entries / result_cache_shards, 1);
+		size_t max_bytes = pool.result_cache_max_bytes / result_cache_shards;
+		if (bytes > max_bytes) {
+			return;
+		}
+		auto expiry = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(lifetime));
+
+		auto f = shard.index.find(&k);
+		if (f != shard.index.end()) {
+			shard.erase(f->second);
+		}
+		shard.lru.push_front(result_cache_entry{ .key = k, .results = results, .expiry = expiry, .tags = std::move(tags), .generation = generation, .bytes = bytes });
+		shard.index.emplace(&shard.lru.front().key, shard.lru.begin());
+		shard.bytes += bytes;
+
+		while (shard.lru.size() > max_entries || shard.bytes > max_bytes) {
+			shard.erase(std::prev(shard.lru.end()));
+		}
+	}
+
+	std::shared_ptr<const resultset> query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags) {
+		pool_state& pool = current_pool();
+		result_cache_key k{ .key = intern(format), .parameters = owned_parameters(parameters) };
+		result_cache_shard& shard = result_cache_shard_of(pool, k);
+		{
+			std::lock_guard<std::mutex> cache_lock(shard.mutex);
+			if (auto results = unsafe_result_cache_find(pool, shard, k)) {
+				return results;
+			}
+		}
+
+		/* Run the query without holding the shard, concurrent misses may both query the database */
+		std::vector<uint16_t> slots = result_cache_tags(k.key, tags);
+		uint64_t generation = tag_generation(pool, slots);
+		auto results = std::make_shared<const resultset>(query(k.key, parameters));
+		std::lock_guard<std::mutex> cache_lock(shard.mutex);
+		unsafe_result_cache_store(pool, shard, k, results, lifetime, std::move(slots), generation);
+		return results;
+	}
+
+	void query_cached_callback(const std::string &format, const paramlist &parameters, const sql_shared_query_callback& cb, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		pool_state& pool = current_pool();
+		auto pending = std::make_unique<pending_result>();
+		pending->key = result_cache_key{ .key = intern(format), .parameters = owned_parameters(parameters) };
+		result_cache_shard& shard = result_cache_shard_of(pool, pending->key);
+		std::shared_ptr<const resultset> hit;
+		const result_cache_key* k{nullptr};
+		{
+			std::lock_guard<std::mutex> cache_lock(shard.mutex);
+			hit = unsafe_result_cache_find(pool, shard, pending->key);
+			if (!hit) {
+				auto p = shard.pending.find(&pending->key);
+				if (p != shard.pending.end()) {
+					/* The same query is already in flight, wait for its result */
+					p->second->waiters.emplace_back(cb);
+					return;
+				}
+				pending->waiters.emplace_back(cb);
+				k = &pending->key;
+				shard.pending.emplace(k, std::move(pending));
+			}
+		}
+		if (k) {
+			/* First miss, queue the query. The shard isn't held, as a full lane calls back immediately */
+			std::vector<uint16_t> slots = result_cache_tags(k->key, tags);
+			uint64_t generation = tag_generation(pool, slots);
+			enqueue(cached_query_results{.key = k->key, .parameters = parameters, .callback = [k, &pool, &shard, lifetime, slots = std::move(slots), generation](resultset&& rs) {
+				auto results = std::make_shared<const resultset>(std::move(rs));
+				std::unique_ptr<pending_result> done;
+				{
+					std::lock_guard<std::mutex> cache_lock(shard.mutex);
+					unsafe_result_cache_store(pool, shard, *k, results, lifetime, slots, generation);
+					auto p = shard.pending.find(k);
+					done = std::move(p->second);
+					shard.pending.erase(p);
+				}
+				for (const auto& waiter : done->waiters) {
+					if (waiter) {
+						waiter(results);
+					}
+				}
+			}, .options = options, .transaction = {}, .work = {}, .queued = {}});
+			return;
+		}
+		/* Cache hit, answered on the calling thread without a trip through the queue */
+		if (cb) {
+			cb(hit);
+		}
+	}
+
+	void query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		/* The callback owns its resultset, so it gets a copy of the shared one */
+		query_cached_callback(format, parameters, [cb](const std::shared_ptr<const resultset>& results) {
+			if (cb) {
+				cb(resultset(*results));
+			}
+		}, lifetime, tags, options);
+	}
+
+#ifdef DPP_CORO
+	dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		return dpp::async<resultset>{ [format, parameters, lifetime, tags, options] <typename C> (C &&cc) { return query_callback(format, parameters, std::forward<C>(cc), lifetime, tags, options); }};
+	}
+
+	dpp::async<std::shared_ptr<const resultset>> co_query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		return dpp::async<std::shared_ptr<const resultset>>{ [&format, &parameters, lifetime, &tags, &options] <typename C> (C &&cc) { return query_cached_callback(format, parameters, std::forward<C>(cc), lifetime, tags, options); }};
+	}
+#endif
+
+	resultset query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags) {
+		return *query_cached(format, parameters, lifetime, tags);
+	}
+
+	void invalidate(const std::string& table) {
+		pool_state& pool = current_pool();
+		invalidate_tags(pool, { tag_slot(table) });
+	}
+
+	/**
+	 * @brief Bind a paramlist to a cached statement in native types,
+	 * pointing directly at the storage within each variant alternative
+	 *
+	 * @param cc statement to bind to
+	 * @param parameters parameters, one per placeholder of the statement
+	 */
+	void bind_parameters(cached_query& cc, const paramlist& parameters) {
+		memset(cc.bindings.data(), 0, sizeof(MYSQL_BIND) * cc.bindings.size());
+		int v = 0;
+		for (const auto& param : parameters) {
+			std::visit([&cc, &v](const auto &p) {
+				using T = std::decay_t<decltype(p)>;
+				MYSQL_BIND& binding = cc.bindings[v];
+				if constexpr (std::is_same_v<T, std::string>) {
+					cc.lengths[v] = p.length();
+					binding.buffer_type = MYSQL_TYPE_VAR_STRING;
+					binding.buffer = const_cast<char*>(p.data());
+					binding.buffer_length = p.length();
+					binding.length = &cc.lengths[v];
+				} else if constexpr (std::is_same_v<T, buffer_parameter>) {
+					binding.buffer_type = p.binary ? MYSQL_TYPE_BLOB : MYSQL_TYPE_VAR_STRING;
+					/* A streamed value is sent by unsafe_send_long_data(), before execution */
+					if (!p.streamed()) {
+						cc.lengths[v] = p.length;
+						binding.buffer = const_cast<char*>(p.data);
+						binding.buffer_length = p.length;
+						binding.length = &cc.lengths[v];
+					}
+				} else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+					binding.buffer_type = MYSQL_TYPE_NULL;
+				} else {
+					binding.buffer_type = native_field_type<T>();
+					binding.buffer = const_cast<T*>(&p);
+					binding.is_unsigned = std::is_unsigned_v<T>;
+				}
+				v++;
+			}, param);
+		}
+	}
+
+	/**
+	 * @brief Bind parameters held by reference to a cached statement
+	 *
+	 * @param cc statement to bind to
+	 * @param parameters parameters, one per placeholder of the statement
+	 */
+	void bind_parameters(cached_query& cc, std::span<const bound_parameter> parameters) {
+		static constexpr enum_field_types buffer_types[] = {
+			MYSQL_TYPE_NULL, MYSQL_TYPE_VAR_STRING, MYSQL_TYPE_FLOAT, MYSQL_TYPE_DOUBLE,
+			MYSQL_TYPE_TINY, MYSQL_TYPE_SHORT, MYSQL_TYPE_LONG, MYSQL_TYPE_LONGLONG,
+		};
+		memset(cc.bindings.data(), 0, sizeof(MYSQL_BIND) * cc.bindings.size());
+		for (size_t v = 0; v < parameters.size(); ++v) {
+			const bound_parameter& p = parameters[v];
+			MYSQL_BIND& binding = cc.bindings[v];
+			binding.buffer_type = buffer_types[p.kind];
+			binding.buffer = const_cast<void*>(p.data);
+			binding.is_unsigned = p.is_unsigned;
+			if (p.kind == pk_string) {
+				cc.lengths[v] = p.length;
+				binding.buffer_length = p.length;
+				binding.length = &cc.lengths[v];
+			}
+		}
+	}
+
+	/**
+	 * @brief How a single attempt at running a query ended
+	 */
+	struct query_attempt {
+		/**
+		 * @brief mysql_errno() or mysql_stmt_errno() of the failure, or 0
+		 */
+		unsigned int error_code{0};
+		/**
+		 * @brief True once the statement was sent for execution
+		 */
+		bool executed{false};
+		/**
+		 * @brief True if running the statement twice is harmless, e.g. SELECT
+		 */
+		bool idempotent{false};
+		/**
+		 * @brief Rows fetched, including rows passed to a stream
+		 */
+		uint64_t rows{0};
+		/**
+		 * @brief Bytes of column values fetched
+		 */
+		uint64_t bytes{0};
+	};
+
+	/**
+	 * @brief Destination of a streamed query's rows
+	 */
+	struct row_stream {
+		const sql_chunk_callback& on_chunk;
+		const stream_options& options;
+		/**
+		 * @brief Set once a chunk has been passed to on_chunk
+		 */
+		bool& emitted;
+	};
+
+	/**
+	 * @brief Record the error of a failed statement call, in the resultset and the log
+	 *
+	 * @param st statement which failed
+	 * @param key query being run
+	 * @param rv receives the error message
+	 * @param attempt receives the error code
+	 */
+	void statement_failed(MYSQL_STMT* st, const query_key& key, resultset& rv, query_attempt& attempt) {
+		attempt.error_code = mysql_stmt_errno(st);
+		rv.error = mysql_stmt_error(st);
+		log_error(key.sql(), rv.error);
+	}
+
+	/**
+	 * @brief Clear the error status and number of affected rows as a query starts
+	 */
+	void begin_query() {
+		{
+			std::lock_guard<std::mutex> status_lock(status_mutex);
+			/**
+			 * Clear error status
+			 */
+			last_error.clear();
+			/**
+			 * Clear number of affected rows
+			 */
+			rows_affected = 0;
+		}
+		++query_total;
+	}
+
+	/**
+	 * @brief Store the number of rows affected by a statement which expects no results
+	 *
+	 * @param st statement which was executed
+	 * @param rv receives the number of affected rows
+	 */
+	void record_affected_rows(MYSQL_STMT* st, resultset& rv) {
+		rv.affected_rows = mysql_stmt_affected_rows(st);
+		std::lock_guard<std::mutex> status_lock(status_mutex);
+		rows_affected = rv.affected_rows;
+	}
+
+	/**
+	 * @brief Record the metrics of a finished query
+	 *
+	 * @param key query
+	 * @param start when the query was given a connection
+	 * @param attempt last attempt at running the query
+	 * @param rv result of the query
+	 */
+	void record_execution(const query_key& key, std::chrono::steady_clock::time_point start, const query_attempt& attempt, const resultset& rv) {
+		if (metric_counters* counters = thread_counters(key)) {
+			uint64_t elapsed = microseconds_since(start);
+			bump(counters->executions);
+			bump(counters->rows, attempt.rows);
+			bump(counters->bytes, attempt.bytes);
+			bump(counters->errors, rv.error.empty() ? 0 : 1);
+			bump(counters->execution_sum, elapsed);
+			bump(counters->execution[latency_histogram::bucket_of(elapsed)]);
+		}
+	}
+
+	/**
+	 * @brief Build the shared column list of a result set from its metadata
+	 *
+	 * @param fields column metadata
+	 * @param field_count number of columns
+	 * @return column names and types
+	 */
+	std::shared_ptr<const column_list> make_columns(const MYSQL_FIELD* fields, unsigned long field_count) {
+		std::vector<std::string> names;
+		std::vector<column_type> types;
+		names.reserve(field_count);
+		types.reserve(field_count);
+		for (unsigned long i = 0; i < field_count; ++i) {
+			names.emplace_back(fields[i].name ? fields[i].name : "");
+			types.emplace_back(column_type_of(fields[i]));
+		}
+		return std::make_shared<const column_list>(std::move(names), std::move(types));
+	}
+
+	/**
+	 * @brief Find a query's cached prepared statement on a connection
+	 *
+	 * @param conn connection, must be held by the caller
+	 * @param key query
+	 * @return statement, or nullptr if the query has not been prepared on this connection yet
+	 */
+	cached_query* unsafe_cached_statement(sql_connection& conn, const query_key& key) {
+		if (conn.cached_queries.size() <= key.id()) {
+			conn.cached_queries.resize(key.id() + 1);
+		}
+		return conn.cached_queries[key.id()].get();
+	}
+
+	/**
+	 * @brief Initialise a statement handle for a query which is not cached on a connection.
+	 * It must then be prepared, and passed to unsafe_cache_statement().
+	 *
+	 * @param conn connection, must be held by the caller
+	 * @param key query
+	 * @param rv receives the error message on failure
+	 * @param attempt receives the error code on failure
+	 * @return new statement, or nullptr on failure
+	 */
+	std::unique_ptr<cached_query> unsafe_new_statement(sql_connection& conn, const query_key& key, resultset& rv, query_attempt& attempt) {
+		auto prepared = std::make_unique<cached_query>();
+		prepared->st.reset(mysql_stmt_init(&conn.handle));
+		if (!prepared->st) {
+			attempt.error_code = mysql_errno(&conn.handle);
+			rv.error = mysql_error(&conn.handle);
+			log_error(key.sql(), rv.error);
+			return nullptr;
+		}
+		return prepared;
+	}
+
+	/**
+	 * @brief Add a newly prepared statement to a connection's statement cache
+	 *
+	 * @param conn connection, must be held by the caller
+	 * @param key query the statement was prepared from
+	 * @param prepared prepared statement
+	 * @param parameter_count number of parameters the query was given
+	 * @param rv receives the error message on failure
+	 * @return cached statement, or nullptr if the number of parameters is wrong
+	 */
+	cached_query* unsafe_cache_statement(sql_connection& conn, const query_key& key, std::unique_ptr<cached_query> prepared, size_t parameter_count, resultset& rv) {
+		const std::string& format = key.sql();
+
+		/* Check the parameter count provided matches that which MySQL expects */
+		size_t expected_param_count = mysql_stmt_param_count(prepared->st.get());
+		if (parameter_count != expected_param_count) {
+			rv.error = "Incorrect number of parameters: " + format + " (" + std::to_string(parameter_count) + " vs " + std::to_string(expected_param_count) + ")";
+			log_error(format, rv.error);
+			return nullptr;
+		}
+
+		/* Allocate memory for awful C stuff 🐉 */
+		prepared->bindings.resize(expected_param_count);
+		prepared->lengths.resize(expected_param_count);
+
+		prepared->expects_results = key.reads();
+
+		/* Store to cache */
+		std::unique_ptr<cached_query>& entry = conn.cached_queries[key.id()];
+		entry = std::move(prepared);
+		++statements_cached;
+		creator->log(dpp::ll_debug, "SQL: New cached prepared statement: " + format);
+		return entry.get();
+	}
+
+	/**
+	 * @brief Prepare statements on a connection ahead of their first use. Statements
+	 * it already has are skipped, and one which fails is logged and left to be
+	 * prepared again when it is used.
+	 *
+	 * @param conn connection, must be held by the caller
+	 * @param statements statements to prepare
+	 * @return number of statements which failed to prepare
+	 */
+	size_t unsafe_prepare_statements(sql_connection& conn, const std::vector<query_key>& statements) {
+		size_t failed{0};
+		for (size_t i = 0; i < statements.size(); ++i) {
+			const query_key& key = statements[i];
+			if (conn.state != cs_connected) {
+				return failed + statements.size() - i;
+			}
+			if (unsafe_cached_statement(conn, key)) {
+				continue;
+			}
+			resultset rv;
+			query_attempt attempt;
+			std::unique_ptr<cached_query> prepared = unsafe_new_statement(conn, key, rv, attempt);
+			if (!prepared || mysql_stmt_prepare(prepared->st.get(), key.sql().c_str(), key.sql().length())) {
+				if (prepared) {
+					statement_failed(prepared->st.get(), key, rv, attempt);
+				}
+				if (connection_lost(attempt.error_code)) {
+					conn.state = cs_lost;
+				}
+				++failed;
+				continue;
+			}
+			size_t parameter_count = mysql_stmt_param_count(prepared->st.get());
+			unsafe_cache_statement(conn, key, std::move(prepared), parameter_count, rv);
+		}
+		return failed;
+	}
+
+	bool prepare(const std::vector<std::string>& statements) {
+		pool_state& pool = current_pool();
+		std::vector<query_key> keys, reads;
+		for (const std::string& format : statements) {
+			query_key key = intern(format);
+			keys.emplace_back(key);
+			if (key.reads()) {
+				reads.emplace_back(key);
+			}
+		}
+		/* Connections in use are skipped, like keepalive() does, and prepare these when they are next used */
+		std::vector<std::pair<sql_connection*, const std::vector<query_key>*>> idle_connections;
+		{
+			std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+			auto take = [&idle_connections](std::vector<std::unique_ptr<sql_connection>>& group, const std::vector<query_key>& list) {
+				for (auto& c : group) {
+					if (!c->busy && c->state == cs_connected) {
+						c->busy = true;
+						idle_connections.emplace_back(c.get(), &list);
+					}
+				}
+			};
+			take(pool.connections, keys);
+			for (auto& replica : pool.replicas) {
+				/* Replicas only ever run reads */
+				take(replica->connections, reads);
+			}
+		}
+		std::atomic<size_t> failed{0};
+		std::vector<std::thread> threads;
+		for (auto [conn, list] : idle_connections) {
+			threads.emplace_back([conn, list, &failed]() {
+				failed += unsafe_prepare_statements(*conn, *list);
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		{
+			std::lock_guard<std::mutex> pool_lock(pool.pool_mutex);
+			for (auto [conn, list] : idle_connections) {
+				conn->busy = false;
+			}
+		}
+		pool.pool_cv.notify_all();
+		return failed == 0;
+	}
+
+	/**
+	 * @brief Bind a query's parameters to its cached statement
+	 *
+	 * @tparam P paramlist, or a span of bound_parameter
+	 * @param cc statement
+	 * @param key query
+	 * @param parameters parameters, one per placeholder
+	 * @param rv receives the error message on failure
+	 * @param attempt receives the error code on failure
+	 * @return true if the parameters were bound
+	 */
+	template <typename P> bool unsafe_bind_parameters(cached_query& cc, const query_key& key, const P &parameters, resultset& rv, query_attempt& attempt) {
+		MYSQL_STMT* st = cc.st.get();
+		if (parameters.size() != mysql_stmt_param_count(st)) {
+			/* A cached statement must still be given the number of parameters it was prepared with */
+			rv.error = "Incorrect number of parameters: " + key.sql() + " (" + std::to_string(parameters.size()) + " vs " + std::to_string(mysql_stmt_param_count(st)) + ")";
+			log_error(key.sql(), rv.error);
+			return false;
+		}
+
+		if (parameters.size()) {
+
+			/* Parameters are expected for this query, bind them to the prepared statement */
+			bind_parameters(cc, parameters);
+
+			/* Bind parameters to statement */
+			if (mysql_stmt_bind_param(st, cc.bindings.data())) {
+				statement_failed(st, key, rv, attempt);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Send a query's streamed parameters to the server in chunks. The server
+	 * forgets them on each execution, so this is called after binding, before every one.
+	 *
+	 * @param cc statement, with its parameters bound
+	 * @param key query
+	 * @param parameters parameters, one per placeholder
+	 * @param rv receives the error message on failure
+	 * @param attempt receives the error code on failure
+	 * @return true if every streamed parameter was sent
+	 */
+	bool unsafe_send_long_data(cached_query& cc, const query_key& key, const paramlist& parameters, resultset& rv, query_attempt& attempt) {
+		MYSQL_STMT* st = cc.st.get();
+		for (size_t v = 0; v < parameters.size(); ++v) {
+			const buffer_parameter* p = std::get_if<buffer_parameter>(&parameters[v]);
+			if (!p || !p->streamed()) {
+				continue;
+			}
+			for (size_t offset = 0; ; ) {
+				std::string_view piece = p->source ? p->source(offset) : std::string_view(p->data, p->length).substr(offset, p->chunk);
+				if (piece.empty()) {
+					break;
+				}
+				if (mysql_stmt_send_long_data(st, static_cast<unsigned int>(v), piece.data(), piece.length())) {
+					statement_failed(st, key, rv, attempt);
+					return false;
+				}
+				offset += piece.length();
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Parameters bound by reference are never streamed
+	 */
+	bool unsafe_send_long_data(cached_query&, const query_key&, std::span<const bound_parameter>, resultset&, query_attempt&) {
+		return true;
+	}
+
+	/**
+	 * @brief Bind the output buffers of a statement which expects results, before it is executed
+	 *
+	 * @param cc statement
+	 * @param key query
+	 * @param options Per-query options
+	 * @param stream if set, rows are to be streamed, possibly from a server side cursor
+	 * @param rv receives the error message on failure
+	 * @param attempt receives the error code on failure
+	 * @return result metadata, to be freed by the caller after fetching, or nullptr on failure
+	 */
+	MYSQL_RES* unsafe_bind_results(cached_query& cc, const query_key& key, const query_options& options, const row_stream* stream, resultset& rv, query_attempt& attempt) {
+		MYSQL_STMT* st = cc.st.get();
+		MYSQL_RES *a_res = mysql_stmt_result_metadata(st);
+		if (!a_res) {
+			statement_failed(st, key, rv, attempt);
+			return nullptr;
+		}
+		unsigned long field_count = mysql_stmt_field_count(st);
+		MYSQL_FIELD *fields = mysql_fetch_fields(a_res);
+
+		/* Column names and types are shared by every resultset of this statement */
+		bool columns_changed = !cc.columns || cc.columns->names.size() != field_count;
+		for (unsigned long i = 0; !columns_changed && i < field_count; ++i) {
+			columns_changed = cc.columns->names[i] != (fields[i].name ? fields[i].name : "") || cc.columns->types[i] != column_type_of(fields[i]);
+		}
+		if (columns_changed) {
+			cc.columns = make_columns(fields, field_count);
+		}
+		bool typed = options.fetch == fetch_typed;
+
+		/* Reuse the statement's output buffers unless its columns or the fetch mode changed */
+		result_buffers& out = cc.output;
+		if (out.columns != cc.columns || out.fetch != options.fetch) {
+			out.columns = cc.columns;
+			out.fetch = options.fetch;
+			out.bindings.assign(field_count, MYSQL_BIND{});
+			out.buffers.assign(field_count, {});
+			out.lengths.assign(field_count, 0);
+			out.is_null = std::make_unique<bool[]>(field_count);
+			out.truncated = std::make_unique<bool[]>(field_count);
+			for (unsigned long i = 0; i < field_count; ++i) {
+				column_type type = cc.columns->types[i];
+				if (typed && type >= ct_int) {
+					/* Numeric columns are fetched straight into a native 8 byte buffer */
+					out.buffers[i].resize(sizeof(uint64_t));
+					out.bindings[i].buffer_type = type == ct_real ? MYSQL_TYPE_DOUBLE : MYSQL_TYPE_LONGLONG;
+					out.bindings[i].is_unsigned = type == ct_uint;
+				} else {
+					out.buffers[i].resize(std::clamp<size_t>(fields[i].length, 1, initial_result_buffer));
+					out.bindings[i].buffer_type = MYSQL_TYPE_VAR_STRING;
+				}
+				out.bindings[i].buffer = out.buffers[i].data();
+				out.bindings[i].buffer_length = out.buffers[i].size();
+				out.bindings[i].is_null = &out.is_null[i];
+				out.bindings[i].length = &out.lengths[i];
+				out.bindings[i].error = &out.truncated[i];
+			}
+		}
+
+		if (mysql_stmt_bind_result(st, out.bindings.data())) {
+			statement_failed(st, key, rv, attempt);
+			mysql_free_result(a_res);
+			return nullptr;
+		}
+
+		bool cursor = stream && stream->options.server_cursor;
+		if (cursor != cc.cursor) {
+			/* Rows are fetched from a server side cursor, a chunk at a time */
+			unsigned long cursor_type = cursor ? CURSOR_TYPE_READ_ONLY : CURSOR_TYPE_NO_CURSOR;
+			unsigned long prefetch_rows = cursor ? std::max<size_t>(stream->options.chunk_rows, 1) : 1;
+			mysql_stmt_attr_set(st, STMT_ATTR_CURSOR_TYPE, &cursor_type);
+			mysql_stmt_attr_set(st, STMT_ATTR_PREFETCH_ROWS, &prefetch_rows);
+			cc.cursor = cursor;
+		}
+		return a_res;
+	}
+
+	/**
+	 * @brief Fetch the rows of an executed statement into a resultset, or pass them to a stream
+	 *
+	 * @param cc statement, executed with its results bound by unsafe_bind_results()
+	 * @param key query
+	 * @param options Per-query options
+	 * @param stream if set, rows are passed to its callback in chunks rather than returned
+	 * @param rv receives the rows, or the error message on failure
+	 * @param attempt receives the error code on failure
+	 */
+	void unsafe_fetch_rows(cached_query& cc, const query_key& key, const query_options& options, const row_stream* stream, resultset& rv, query_attempt& attempt) {
+		MYSQL_STMT* st = cc.st.get();
+		result_buffers& out = cc.output;
+		size_t field_count = cc.columns->names.size();
+		bool typed = options.fetch == fetch_typed;
+		if (stream) {
+			/* A stream reuses one rowset for every chunk, an arena would only grow */
+			rv.rows = rowset(cc.columns, typed);
+		} else {
+			/* Expect a result the size of the last one, if that fits in an arena's retained block */
+			size_t expected = cc.last_bytes + cc.last_rows * field_count * (sizeof(size_t) + 1);
+			rv.rows = rowset(cc.columns, typed, acquire_arena(expected));
+			if (expected <= retained_arena_block) {
+				rv.rows.reserve(cc.last_rows, cc.last_bytes);
+			}
+		}
+		uint64_t first_byte = attempt.bytes;
+		bool stopped{false};
+
+		/* Build resultset */
+		while (true) {
+			int result = mysql_stmt_fetch(st); 
+			if (result == MYSQL_NO_DATA) {
+				/* End of resultset */
+				break; 
+			} else if (result == MYSQL_DATA_TRUNCATED) {
+				/* A value was larger than its buffer. Grow the buffer to the real length,
+				 * fetch the value again, and keep the larger buffer for later rows.
+				 */
+				bool failed{false}, rebind{false};
+				for (unsigned long i = 0; i < field_count && !failed; ++i) {
+					if (out.truncated[i] && out.lengths[i] > out.buffers[i].size()) {
+						out.buffers[i].resize(out.lengths[i]);
+						out.bindings[i].buffer = out.buffers[i].data();
+						out.bindings[i].buffer_length = out.buffers[i].size();
+						failed = mysql_stmt_fetch_column(st, &out.bindings[i], i, 0) != 0;
+						rebind = true;
+					}
+				}
+				if (failed || (rebind && mysql_stmt_bind_result(st, out.bindings.data()))) {
+					statement_failed(st, key, rv, attempt);
+					break;
+				}
+			} else if (result != 0) {
+				/* Error retrieving resultset, e.g. disconnected */
+				statement_failed(st, key, rv, attempt);
+				break; 
+			}
+
+			/* Build row */
+			for (unsigned long i = 0; i < field_count; ++i) {
+				size_t length = typed && cc.columns->types[i] >= ct_int ? sizeof(uint64_t) : out.lengths[i];
+				rv.rows.append(out.is_null[i] ? std::string_view() : std::string_view(out.buffers[i].data(), length), out.is_null[i]);
+				attempt.bytes += out.is_null[i] ? 0 : out.lengths[i];
+			}
+			++attempt.rows;
+
+			if (stream && rv.rows.size() >= std::max<size_t>(stream->options.chunk_rows, 1)) {
+				/* Rows already passed on can't be fetched again by a retry */
+				attempt.idempotent = false;
+				stream->emitted = true;
+				stopped = !stream->on_chunk(rv.rows);
+				rv.rows.clear();
+				if (stopped) {
+					/* Discard the rest of the result set */
+					mysql_stmt_free_result(st);
+					break;
+				}
+			}
+		}
+
+		if (stream) {
+			if (!stopped && rv.error.empty() && !rv.rows.empty()) {
+				stream->emitted = true;
+				stream->on_chunk(rv.rows);
+			}
+			rv.rows = rowset(cc.columns, typed);
+		} else if (rv.error.empty()) {
+			cc.last_rows = rv.rows.size();
+			cc.last_bytes = attempt.bytes - first_byte;
+		}
+
+		/* Don't keep buffers which grew to hold an unusually large value */
+		for (unsigned long i = 0; i < field_count; ++i) {
+			if (out.buffers[i].size() > retained_result_buffer) {
+				out.buffers[i].resize(initial_result_buffer);
+				out.buffers[i].shrink_to_fit();
+				out.bindings[i].buffer = out.buffers[i].data();
+				out.bindings[i].buffer_length = out.buffers[i].size();
+			}
+		}
+	}
+
+	/**
+	 * @brief Make one attempt at running a query on a specific connection,
+	 * which must be held by the caller
+	 *
+	 * @tparam P paramlist, or a span of bound_parameter
+	 * @param conn connection to run the query on
+	 * @param key Interned format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
+	 * @param attempt receives how the attempt ended
+	 * @param stream if set, rows are passed to its callback in chunks rather than returned
+	 * @return result set
+	 */
+	template <typename P> resultset unsafe_query_once(sql_connection& conn, const query_key& key, const P &parameters, const query_options& options, query_attempt& attempt, const row_stream* stream) {
+		resultset rv;
+		const std::string& format = key.sql();
+
+		begin_query();
+
+		/**
+		 * Check for a cached query in the query cache, if one is found, we can use it,
+		 * and we don't need to call mysql_stmt_init() and mysql_stmt_prepare().
+		 */
+		cached_query* cc = unsafe_cached_statement(conn, key);
+		if (!cc) {
+
+			/* Query doesn't exist yet, initialise a prepared statement */
+			std::unique_ptr<cached_query> prepared = unsafe_new_statement(conn, key, rv, attempt);
+			if (!prepared) {
+				return rv;
+			}
+			if (mysql_stmt_prepare(prepared->st.get(), format.c_str(), format.length())) {
+				statement_failed(prepared->st.get(), key, rv, attempt);
+				return rv;
+			}
+			cc = unsafe_cache_statement(conn, key, std::move(prepared), parameters.size(), rv);
+			if (!cc) {
+				return rv;
+			}
+		}
+
+		/* Use the cached statement in place, it is only ever touched by the thread holding this connection */
+		MYSQL_STMT* st = cc->st.get();
+		attempt.idempotent = cc->expects_results;
+
+		if (!unsafe_bind_parameters(*cc, key, parameters, rv, attempt) || !unsafe_send_long_data(*cc, key, parameters, rv, attempt)) {
+			return rv;
+		}
+
+		if (!cc->expects_results) {
+			/**
+			 * Query which does not expect results, e.g. UPDATE, INSERT
+			 */
+			attempt.executed = true;
+			if (mysql_stmt_execute(st)) {
+				statement_failed(st, key, rv, attempt);
+			} else {
+				record_affected_rows(st, rv);
+			}
+			/* Even a failed write may have been applied, if the connection was lost after sending it */
+			wrote_tables(current_pool(), key);
+			return rv;
+		}
+
+		/**
+		 * Query which expects results, e.g. SELECT
+		 */
+		MYSQL_RES* a_res = unsafe_bind_results(*cc, key, options, stream, rv, attempt);
+		if (!a_res) {
+			return rv;
+		}
+		attempt.executed = true;
+		if (mysql_stmt_execute(st) == 0) {
+			unsafe_fetch_rows(*cc, key, options, stream, rv, attempt);
+		} else {
+			statement_failed(st, key, rv, attempt);
+		}
+		mysql_free_result(a_res);
+		return rv;
+	}
+
+	/**
+	 * @brief Cancels queries which run past their own timeout or deadline, by sending
+	 * KILL QUERY for them over a connection of its own. The session time limit can't
+	 * do this alone: it knows nothing of deadlines, and MySQL only applies it to SELECT.
+	 * Its thread starts when the first query is watched.
+	 */
+	class query_watchdog {
+		struct watch {
+			std::chrono::steady_clock::time_point deadline;
+			unsigned long thread_id;
+			const connection_info* info;
+			/**
+			 * @brief True whilst KILL QUERY is being sent, the watch can't be removed until it is done
+			 */
+			bool killing{false};
+		};
+
+		/**
+		 * @brief Connection KILL QUERY is sent over, one per server and user
+		 */
+		struct killer {
+			connection_info info;
+			sql_connection conn;
+			bool connected{false};
+		};
+
+		/**
+		 * @brief Protects watches and stopping
+		 */
+		std::mutex mutex;
+
+		/**
+		 * @brief Signalled when a watch is added, or a KILL QUERY has been sent
+		 */
+		std::condition_variable cv;
+
+		std::list<watch> watches;
+
+		/**
+		 * @brief Kill connections, only touched by the watchdog thread
+		 */
+		std::list<killer> killers;
+
+		std::thread thread;
+
+		bool stopping{false};
+
+		/**
+		 * @brief Send KILL QUERY, connecting or reconnecting the kill connection if needed
+		 *
+		 * @param thread_id server thread running the query
+		 * @param info credentials of the connection running the query
+		 */
+		void kill(unsigned long thread_id, const connection_info& info) {
+			auto k = std::find_if(killers.begin(), killers.end(), [&info](const killer& k) {
+				return k.info.host == info.host && k.info.port == info.port && k.info.socket == info.socket && k.info.user == info.user;
+			});
+			if (k == killers.end()) {
+				k = killers.emplace(killers.end());
+				k->info = info;
+			}
+			std::string sql = fmt::format("KILL QUERY {}", thread_id);
+			for (int tries = 0; tries < 2; ++tries) {
+				if (!k->connected) {
+					k->connected = unsafe_connect(k->conn, k->info);
+					if (!k->connected) {
+						creator->log(dpp::ll_error, fmt::format("SQL: Can't connect to {} to cancel a query: {}", info.host, mysql_error(&k->conn.handle)));
+						mysql_close(&k->conn.handle);
+						return;
+					}
+				}
+				if (mysql_real_query(&k->conn.handle, sql.c_str(), sql.length()) == 0) {
+					return;
+				}
+				if (!connection_lost(mysql_errno(&k->conn.handle))) {
+					/* e.g. the query finished, and its connection was closed, just as it was killed */
+					creator->log(dpp::ll_debug, fmt::format("SQL: {} failed: {}", sql, mysql_error(&k->conn.handle)));
+					return;
+				}
+				mysql_close(&k->conn.handle);
+				k->connected = false;
+			}
+		}
+
+		void run() {
+			dpp::utility::set_thread_name("sql/watchdog");
+			std::unique_lock<std::mutex> watch_lock(mutex);
+			while (!stopping) {
+				auto now = std::chrono::steady_clock::now();
+				auto next = std::chrono::steady_clock::time_point::max();
+				auto expired = watches.end();
+				for (auto w = watches.begin(); w != watches.end(); ++w) {
+					if (w->deadline <= now) {
+						expired = w;
+						break;
+					}
+					next = std::min(next, w->deadline);
+				}
+				if (expired == watches.end()) {
+					cv.wait_until(watch_lock, next);
+					continue;
+				}
+				/* remove() waits whilst killing is set, so the watch and its credentials stay put */
+				expired->killing = true;
+				unsigned long thread_id = expired->thread_id;
+				const connection_info& info = *expired->info;
+				watch_lock.unlock();
+				creator->log(dpp::ll_warning, fmt::format("SQL: Query on {} ran past its deadline, cancelling it", info.host));
+				kill(thread_id, info);
+				watch_lock.lock();
+				expired->killing = false;
+				expired->deadline = std::chrono::steady_clock::time_point::max();
+				cv.notify_all();
+			}
+		}
+
+	public:
+		using handle = std::list<watch>::iterator;
+
+		~query_watchdog() {
+			{
+				std::lock_guard<std::mutex> watch_lock(mutex);
+				stopping = true;
+			}
+			cv.notify_all();
+			if (thread.joinable()) {
+				thread.join();
+			}
+			for (killer& k : killers) {
+				if (k.connected) {
+					mysql_close(&k.conn.handle);
+				}
+			}
+		}
+
+		/**
+		 * @brief Start watching a query which is about to run
+		 *
+		 * @param deadline time at which to cancel it
+		 * @param conn connection it runs on, must be held by the caller until remove()
+		 * @return handle to pass to remove() once the query returns
+		 */
+		handle add(std::chrono::steady_clock::time_point deadline, sql_connection& conn) {
+			std::lock_guard<std::mutex> watch_lock(mutex);
+			if (!thread.joinable()) {
+				thread = std::thread(&query_watchdog::run, this);
+			}
+			handle h = watches.insert(watches.end(), watch{ .deadline = deadline, .thread_id = mysql_thread_id(&conn.handle), .info = conn.info });
+			cv.notify_all();
+			return h;
+		}
+
+		/**
+		 * @brief Stop watching a query. If it is being killed right now, this waits until
+		 * KILL QUERY has been sent, so that it can't hit the connection's next query.
+		 *
+		 * @param h handle returned by add()
+		 */
+		void remove(handle h) {
+			std::unique_lock<std::mutex> watch_lock(mutex);
+			cv.wait(watch_lock, [h] { return !h->killing; });
+			watches.erase(h);
+		}
+	};
+
+	query_watchdog watchdog;
+
+	/**
+	 * @brief Watches a query whilst it runs, if it has a timeout or deadline of its own
+	 */
+	class deadline_watch {
+		std::optional<query_watchdog::handle> watched;
+	public:
+		/**
+		 * @param conn connection the query runs on, must be held by the caller
+		 * @param options options of the query
+		 * @param start time the query was started, its timeout counts from then
+		 */
+		deadline_watch(sql_connection& conn, const query_options& options, std::chrono::steady_clock::time_point start) {
+			auto deadline = options.deadline;
+			if (options.timeout.count() > 0 && (deadline == std::chrono::steady_clock::time_point{} || start + options.timeout < deadline)) {
+				deadline = start + options.timeout;
+			}
+			if (deadline != std::chrono::steady_clock::time_point{}) {
+				watched = watchdog.add(deadline, conn);
+			}
+		}
+
+		~deadline_watch() {
+			if (watched) {
+				watchdog.remove(*watched);
+			}
+		}
+
+		/**
+		 * @brief True if the query is watched, so that destroying this may wait for a KILL QUERY in flight
+		 */
+		explicit operator bool() const {
+			return watched.has_value();
+		}
+
+		deadline_watch(const deadline_watch&) = delete;
+		deadline_watch& operator=(const deadline_watch&) = delete;
+	};
+
+	/**
+	 * @brief Statement time limit a query runs with: its own timeout, or the connection's default
+	 *
+	 * @param conn connection the query runs on
+	 * @param options options of the query
+	 * @return limit in milliseconds, 0 for none
+	 */
+	uint64_t statement_limit_of(const sql_connection& conn, const query_options& options) {
+		return options.timeout.count() > 0 ? static_cast<uint64_t>(options.timeout.count()) : conn.info->statement_timeout;
+	}
+
+	/**
+	 * @brief Give the session the statement time limit a query runs with, unless it has it
+	 * already. Changing it costs a round trip, so queries using the configured limit never pay it.
+	 * The limit is a session variable rather than a hint in the SQL text, as a hint would
+	 * make every distinct timeout a distinct prepared statement.
+	 *
+	 * @param conn connection the query runs on, must be held by the caller
+	 * @param key query, for error reporting
+	 * @param options options of the query
+	 * @param rv set to the error if the limit can't be set
+	 * @param attempt set to the error code if the limit can't be set
+	 * @return true if the session has the limit
+	 */
+	bool unsafe_limit_statement_time(sql_connection& conn, const query_key& key, const query_options& options, resultset& rv, query_attempt& attempt) {
+		uint64_t limit = statement_limit_of(conn, options);
+		if (limit == conn.statement_limit) {
+			return true;
+		}
+		std::string sql = statement_limit_sql(limit);
+		if (mysql_real_query(&conn.handle, sql.c_str(), sql.length()) != 0) {
+			attempt.error_code = mysql_errno(&conn.handle);
+			rv.error = mysql_error(&conn.handle);
+			log_error(key.sql(), rv.error);
+			return false;
+		}
+		conn.statement_limit = limit;
+		return true;
+	}
+
+	/**
+	 * @brief Run a query on a specific connection, which must be held by the caller.
+	 *
+	 * The connection isn't pinged first. If the server turns out to have gone away,
+	 * the connection is reconnected and the query is retried once, but only when that
+	 * can't apply it twice: it never reached execution, or it is a read. Queries in a
+	 * transaction are never retried, as the transaction was lost with the connection.
+	 *
+	 * @tparam P paramlist, or a span of bound_parameter
+	 * @param conn connection to run the query on
+	 * @param key Interned format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
+	 * @param stream if set, rows are passed to its callback in chunks rather than returned
+	 * @return result set
+	 */
+	template <typename P> resultset unsafe_query(sql_connection& conn, const query_key& key, const P &parameters, const query_options& options, const row_stream* stream = nullptr) {
+		bool in_transaction = pinned_connection == &conn;
+		auto start = std::chrono::steady_clock::now();
+		for (int tries = 0; ; ++tries) {
+			if (deadline_passed(options)) {
+				resultset rv;
+				rv.error = deadline_error;
+				log_error(key.sql(), rv.error);
+				record_execution(key, start, query_attempt{}, rv);
+				return rv;
+			}
+			if (conn.state != cs_connected && (in_transaction || !unsafe_reconnect(conn))) {
+				resultset rv;
+				rv.error = in_transaction ? "Database connection lost during transaction" : "Database connection lost, reconnect failed";
+				log_error(key.sql(), rv.error);
+				record_execution(key, start, query_attempt{}, rv);
+				return rv;
+			}
+			query_attempt attempt;
+			resultset rv;
+			if (unsafe_limit_statement_time(conn, key, options, rv, attempt)) {
+				deadline_watch watch(conn, options, start);
+				rv = unsafe_query_once(conn, key, parameters, options, attempt, stream);
+			}
+			if (!connection_lost(attempt.error_code)) {
+				conn.last_used = std::chrono::steady_clock::now();
+				record_execution(key, start, attempt, rv);
+				return rv;
+			}
+			conn.state = cs_lost;
+			if (tries > 0 || in_transaction || (attempt.executed && !attempt.idempotent)) {
+				record_execution(key, start, attempt, rv);
+				return rv;
+			}
+			creator->log(dpp::ll_warning, "SQL: Retrying query after lost connection: " + key.sql());
+		}
+	}
+
+#ifdef DB_ASYNC_ENGINE
+	/**
+	 * @brief Open the engine's connections, and register its wake-up pipe with the D++ socket engine
+	 *
+	 * @param count number of connections
+	 * @param info credentials to connect with
+	 * @return true if every connection was opened. If any fails, none are kept open.
+	 */
+	bool async_engine::start(size_t count, const connection_info& info) {
+		{
+			std::lock_guard<std::mutex> engine_lock(mutex);
+			for (size_t i = 0; i < count; ++i) {
+				auto ac = std::make_unique<async_connection>();
+				ac->engine = this;
+				if (!unsafe_connect(ac->conn, info, true)) {
+					mysql_close(&ac->conn.handle);
+					break;
+				}
+				connections.emplace_back(std::move(ac));
+			}
+			if (connections.size() == count && pipe(wakeup.data()) == 0) {
+				fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+				fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+				creator->socketengine->register_socket(dpp::socket_events(wakeup[0], dpp::WANT_READ | dpp::WANT_ERROR, [this](dpp::socket, const dpp::socket_events&) {
+					woken();
+				}, {}, {}));
+				std::unique_lock<std::shared_mutex> submit_lock(submit_mutex);
+				enabled = true;
+			}
+		}
+		if (!enabled) {
+			stop();
+			return false;
+		}
+		creator->log(dpp::ll_info, fmt::format("SQL: Non-blocking engine started with {} connections", count));
+		/* Queries may have been left queued by an earlier stop() */
+		notify();
+		return true;
+	}
+
+	/**
+	 * @brief Stop routing queries to the engine, wait for its running queries, and close
+	 * its connections. Queries still queued for the engine move to the worker threads,
+	 * as do queries submitted whilst it stops.
+	 */
+	void async_engine::stop() {
+		{
+			/* Once this is released, enqueue() sees the engine disabled, so the drain below sees every query queued for it */
+			std::unique_lock<std::shared_mutex> submit_lock(submit_mutex);
+			enabled = false;
+		}
+		std::vector<cached_query_results> orphaned;
+		{
+			std::unique_lock<std::mutex> engine_lock(mutex);
+			idle.wait(engine_lock, [this] {
+				return std::none_of(connections.begin(), connections.end(), [](const auto& ac) { return ac->busy; });
+			});
+			{
+				std::lock_guard<std::mutex> consumer_lock(queue.consumer_mutex);
+				while (job_node* n = queue.unsafe_next()) {
+					orphaned.emplace_back(take_job(n));
+				}
+			}
+			for (auto& ac : connections) {
+				unsafe_forget_socket(*ac);
+				free_statements(ac->conn);
+				if (ac->conn.state != cs_disconnected) {
+					mysql_close(&ac->conn.handle);
+				}
+			}
+			connections.clear();
+			if (wakeup[0] != -1) {
+				creator->socketengine->remove_socket(wakeup[0]);
+				::close(wakeup[0]);
+				::close(wakeup[1]);
+				wakeup = {-1, -1};
+			}
+		}
+		finish();
+		for (auto& job : orphaned) {
+			enqueue(std::move(job));
+		}
+	}
+
+	/**
+	 * @brief Start queued queries on every free connection, mutex must be held
+	 */
+	void async_engine::unsafe_pump() {
+		bool started{true};
+		while (started) {
+			started = false;
+			for (auto& ac : connections) {
+				if (ac->busy) {
+					continue;
+				}
+				job_node* n{nullptr};
+				{
+					std::lock_guard<std::mutex> consumer_lock(queue.consumer_mutex);
+					n = queue.unsafe_next();
+				}
+				if (!n) {
+					return;
+				}
+				ac->busy = true;
+				started = true;
+				run(*ac, take_job(n));
+			}
+		}
+	}
+
+	/**
+	 * @brief Wait for the events a suspended call needs, mutex must be held.
+	 * The connection's socket is registered with the D++ socket engine the first
+	 * time it waits, and again whenever a reconnect replaces it.
+	 *
+	 * @param ac connection
+	 * @param status MYSQL_WAIT_* events to wait for
+	 */
+	void async_engine::unsafe_wait(async_connection& ac, int status) {
+		int fd = mysql_get_socket(&ac.conn.handle);
+		uint8_t flags = dpp::WANT_ERROR | (status & MYSQL_WAIT_READ ? dpp::WANT_READ : 0) | (status & MYSQL_WAIT_WRITE ? dpp::WANT_WRITE : 0);
+		if (fd != ac.fd) {
+			unsafe_forget_socket(ac);
+		}
+		if (fd != -1 && (fd != ac.fd || flags != ac.flags)) {
+			dpp::socket_events events(fd, flags,
+				[this, &ac](dpp::socket, const dpp::socket_events&) {
+					ready(ac, MYSQL_WAIT_READ);
+				},
+				[this, &ac](dpp::socket, const dpp::socket_events&) {
+					ready(ac, MYSQL_WAIT_WRITE);
+				},
+				[this, &ac](dpp::socket, const dpp::socket_events&, int) {
+					socket_error(ac);
+				}
+			);
+			if (ac.fd == -1) {
+				creator->socketengine->register_socket(events);
+			} else {
+				creator->socketengine->update_socket(events);
+			}
+			ac.fd = fd;
+			ac.flags = flags;
+		}
+		if (status & MYSQL_WAIT_TIMEOUT) {
+			/* D++ timers tick in whole seconds */
+			uint64_t seconds = std::max<uint64_t>(mysql_get_timeout_value(&ac.conn.handle), 1);
+			ac.timeout = creator->start_timer([this, &ac](dpp::timer t) {
+				timed_out(ac, t);
+			}, seconds);
+		}
+	}
+
+	/**
+	 * @brief Continue a connection's suspended call with the events which are ready,
+	 * resuming its query once the call finishes. mutex must be held.
+	 *
+	 * @param ac connection
+	 * @param events MYSQL_WAIT_* events which are ready
+	 */
+	void async_engine::unsafe_continue(async_connection& ac, int events) {
+		if (ac.timeout) {
+			creator->stop_timer(*ac.timeout);
+			ac.timeout.reset();
+		}
+		int status = ac.cont(events);
+		if (status) {
+			unsafe_wait(ac, status);
+			return;
+		}
+		std::coroutine_handle<> query = std::exchange(ac.waiting, {});
+		ac.cont = {};
+		query.resume();
+	}
+
+	/**
+	 * @brief Remove a connection's socket from the D++ socket engine, mutex must be held
+	 *
+	 * @param ac connection
+	 */
+	void async_engine::unsafe_forget_socket(async_connection& ac) {
+		if (ac.fd != -1) {
+			creator->socketengine->remove_socket(ac.fd);
+			ac.fd = -1;
+			ac.flags = 0;
+		}
+	}
+
+	/**
+	 * @brief Socket engine callback, when a connection's socket is ready
+	 *
+	 * @param ac connection
+	 * @param events MYSQL_WAIT_* events which are ready
+	 */
+	void async_engine::ready(async_connection& ac, int events) {
+		{
+			std::lock_guard<std::mutex> engine_lock(mutex);
+			if (ac.waiting) {
+				unsafe_continue(ac, events);
+			} else if (!ac.busy) {
+				/* An idle connection only becomes readable when the server closes it */
+				unsafe_forget_socket(ac);
+				ac.conn.state = cs_lost;
+			}
+			unsafe_pump();
+		}
+		finish();
+	}
+
+	/**
+	 * @brief Socket engine callback, when a connection's socket has failed
+	 *
+	 * @param ac connection
+	 */
+	void async_engine::socket_error(async_connection& ac) {
+		ready(ac, MYSQL_WAIT_EXCEPT);
+	}
+
+	/**
+	 * @brief D++ timer callback, when a call waiting with a timeout has run out of time
+	 *
+	 * @param ac connection
+	 * @param t timer which fired
+	 */
+	void async_engine::timed_out(async_connection& ac, dpp::timer t) {
+		{
+			std::lock_guard<std::mutex> engine_lock(mutex);
+			/* Another call may be waiting on the connection by now, with a timer of its own */
+			if (!ac.waiting || ac.timeout != t) {
+				creator->stop_timer(t);
+				return;
+			}
+			unsafe_continue(ac, MYSQL_WAIT_TIMEOUT);
+			unsafe_pump();
+		}
+		finish();
+	}
+
+	/**
+	 * @brief Socket engine callback, when queries have been queued for the engine
+	 */
+	void async_engine::woken() {
+		char drained[64];
+		while (read(wakeup[0], drained, sizeof(drained)) > 0) {
+		}
+		/* Exchange rather than store, to see every query queued before the wake-up */
+		wakeup_pending.exchange(false);
+		{
+			std::lock_guard<std::mutex> engine_lock(mutex);
+			unsafe_pump();
+		}
+		finish();
+	}
+
+	/**
+	 * @brief Call the callbacks of finished queries, mutex must not be held
+	 */
+	void async_engine::finish() {
+		std::vector<std::pair<sql_query_callback, resultset>> done;
+		{
+			std::lock_guard<std::mutex> engine_lock(mutex);
+			done.swap(finished);
+		}
+		for (auto& [callback, results] : done) {
+			if (callback) {
+				callback(std::move(results));
+			}
+		}
+	}
+
+	/**
+	 * @brief Run a queued query on a connection of the engine. Mirrors unsafe_query(),
+	 * but every call which talks to the server suspends the query until the socket is
+	 * ready, rather than blocking. Results are buffered by mysql_stmt_store_result(),
+	 * so fetching the rows never waits. It runs with mutex held, other than whilst suspended.
+	 *
+	 * @param ac connection, marked busy by the caller
+	 * @param job query to run
+	 */
+	async_query_task async_engine::run(async_connection& ac, cached_query_results job) {
+		sql_connection& conn = ac.conn;
+		const query_key& key = job.key;
+		resultset rv;
+		query_attempt attempt;
+		auto start = std::chrono::steady_clock::now();
+		for (int tries = 0; ; ++tries) {
+			rv = {};
+			attempt = {};
+			if (deadline_passed(job.options)) {
+				rv.error = deadline_error;
+				log_error(key.sql(), rv.error);
+				break;
+			}
+			if (conn.state != cs_connected) {
+				auto now = std::chrono::steady_clock::now();
+				MYSQL* connected{nullptr};
+				if (conn.state != cs_disconnected || now >= conn.retry_after) {
+					creator->log(dpp::ll_warning, "SQL: Connection has died, reconnecting...");
+					unsafe_forget_socket(ac);
+					free_statements(conn);
+					if (conn.state != cs_disconnected) {
+						mysql_close(&conn.handle);
+					}
+					if (mysql_init(&conn.handle) != nullptr) {
+						const connection_info& info = *conn.info;
+						unsafe_set_connect_options(conn, info);
+						mysql_options(&conn.handle, MYSQL_OPT_NONBLOCK, 0);
+						co_await nonblocking_call{ac, [&] {
+							return mysql_real_connect_start(&connected, &conn.handle, info.host.c_str(), info.user.c_str(), info.pass.c_str(), info.db.c_str(), info.port, info.socket.empty() ? nullptr : info.socket.c_str(), connect_flags);
+						}, [&](int events) {
+							return mysql_real_connect_cont(&connected, &conn.handle, events);
+						}};
+						if (connected) {
+							reconnected(conn);
+						} else {
+							unsafe_forget_socket(ac);
+							reconnect_failed(conn, now);
+						}
+					} else {
+						conn.state = cs_disconnected;
+					}
+				}
+				if (!connected) {
+					rv.error = "Database connection lost, reconnect failed";
+					log_error(key.sql(), rv.error);
+					break;
+				}
+			}
+
+			uint64_t limit = statement_limit_of(conn, job.options);
+			if (limit != conn.statement_limit) {
+				std::string sql = statement_limit_sql(limit);
+				int failed{0};
+				co_await nonblocking_call{ac, [&] {
+					return mysql_real_query_start(&failed, &conn.handle, sql.c_str(), sql.length());
+				}, [&](int events) {
+					return mysql_real_query_cont(&failed, &conn.handle, events);
+				}};
+				if (failed) {
+					attempt.error_code = mysql_errno(&conn.handle);
+					rv.error = mysql_error(&conn.handle);
+					log_error(key.sql(), rv.error);
+				} else {
+					conn.statement_limit = limit;
+				}
+			}
+
+			begin_query();
+			std::optional<deadline_watch> watch(std::in_place, conn, job.options, start);
+			cached_query* cc = rv.error.empty() ? unsafe_cached_statement(conn, key) : nullptr;
+			if (!cc && rv.error.empty()) {
+				/* Query doesn't exist yet, initialise a prepared statement */
+				std::unique_ptr<cached_query> prepared = unsafe_new_statement(conn, key, rv, attempt);
+				if (prepared) {
+					MYSQL_STMT* st = prepared->st.get();
+					int failed{0};
+					co_await nonblocking_call{ac, [&] {
+						return mysql_stmt_prepare_start(&failed, st, key.sql().c_str(), key.sql().length());
+					}, [&](int events) {
+						return mysql_stmt_prepare_cont(&failed, st, events);
+					}};
+					if (failed) {
+						statement_failed(st, key, rv, attempt);
+					} else {
+						cc = unsafe_cache_statement(conn, key, std::move(prepared), job.parameters.size(), rv);
+					}
+				}
+			}
+
+			if (cc && unsafe_bind_parameters(*cc, key, job.parameters, rv, attempt)) {
+				MYSQL_STMT* st = cc->st.get();
+				attempt.idempotent = cc->expects_results;
+				MYSQL_RES* a_res = cc->expects_results ? unsafe_bind_results(*cc, key, job.options, nullptr, rv, attempt) : nullptr;
+				if (!cc->expects_results || a_res) {
+					int failed{0};
+					attempt.executed = true;
+					co_await nonblocking_call{ac, [&] {
+						return mysql_stmt_execute_start(&failed, st);
+					}, [&](int events) {
+						return mysql_stmt_execute_cont(&failed, st, events);
+					}};
+					if (!failed && a_res) {
+						co_await nonblocking_call{ac, [&] {
+							return mysql_stmt_store_result_start(&failed, st);
+						}, [&](int events) {
+							return mysql_stmt_store_result_cont(&failed, st, events);
+						}};
+					}
+					if (failed) {
+						statement_failed(st, key, rv, attempt);
+					} else if (a_res) {
+						unsafe_fetch_rows(*cc, key, job.options, nullptr, rv, attempt);
+					} else {
+						record_affected_rows(st, rv);
+					}
+					if (a_res) {
+						mysql_free_result(a_res);
+					} else {
+						wrote_tables(*pool, key);
+					}
+				}
+			}
+
+			if (*watch) {
+				/*
+				 * Removing the watch waits for a KILL QUERY in flight, which must not hold up
+				 * every other socket the engine serves. The connection is still busy, so
+				 * nothing else touches it whilst mutex, held by whoever resumed us, is released.
+				 */
+				mutex.unlock();
+				watch.reset();
+				mutex.lock();
+			}
+
+			if (!connection_lost(attempt.error_code)) {
+				conn.last_used = std::chrono::steady_clock::now();
+				break;
+			}
+			conn.state = cs_lost;
+			if (tries > 0 || (attempt.executed && !attempt.idempotent)) {
+				break;
+			}
+			creator->log(dpp::ll_warning, "SQL: Retrying query after lost connection: " + key.sql());
 		}
+		record_execution(key, start, attempt, rv);
+		finished.emplace_back(std::move(job.callback), std::move(rv));
+		ac.busy = false;
+		idle.notify_all();
+	}
+#endif
 
-		if (parameters.size()) {
+	resultset query(const std::string &format, const paramlist &parameters, const query_options& options) {
+		return query(intern(format), parameters, options);
+	}
 
-			/* Parameters are expected for this query, bind them to the prepared statement */
-			memset(cc.bindings, 0, sizeof(*cc.bindings));
-			cc.bufs.clear();
-			cc.bufs.reserve(parameters.size());
-			int v = 0;
-			for (const auto& param : parameters) {
-				std::visit([&cc, &v](auto &&p) {
-					using T = std::decay_t<decltype(p)>;
-					if constexpr (std::is_same_v<T, std::string>) {
-						cc.bufs.emplace_back(p);
-					} else {
-						cc.bufs.emplace_back(std::to_string(p));
-					}
-					cc.lengths[v] = cc.bufs[v].length();
-					cc.bindings[v].buffer_type = MYSQL_TYPE_VAR_STRING;
-					cc.bindings[v].buffer = const_cast<char*>(cc.bufs[v].c_str());
-					cc.bindings[v].buffer_length = cc.bufs[v].length() + 1;
-					cc.bindings[v].is_null = nullptr;
-					cc.bindings[v].length = &cc.lengths[v];
-					v++;
-				}, param);
-			}
+	/**
+	 * @brief Call a function with the transaction's connection, or with a free connection
+	 * leased from the pool for the duration of the call
+	 *
+	 * @param key query which needs the connection, for error reporting
+	 * @param f function to call with the connection, returning a resultset
+	 * @param read true if f only reads, so may run on a replica. If the replica's
+	 * connection is lost and can't be reconnected, f runs again on the primary.
+	 * @param delivered if set and true once f fails on a replica, f has already passed
+	 * part of its result on, and isn't run again on the primary
+	 * @return result of f, or an error if there is no connection
+	 */
+	template <typename F> resultset with_connection(const query_key& key, F&& f, bool read = false, const bool* delivered = nullptr) {
+		/**
+		 * Queries within a transaction must run on the transaction's connection
+		 */
+		if (pinned_connection) {
+			return f(*pinned_connection);
+		}
 
-			/* Bind parameters to statement */
-			if (mysql_stmt_bind_param(cc.st, (MYSQL_BIND*)cc.bindings)) {
-				log_error(format, mysql_stmt_error(cc.st));
-				rv.error = mysql_stmt_error(cc.st);
-				return rv;
+		if (read && current_pool().replica_count) {
+			connection_lease lease(true);
+			if (lease.replica()) {
+				resultset rv = f(*lease);
+				if (rv.error.empty() || lease.get()->state == cs_connected || (delivered && *delivered)) {
+					return rv;
+				}
+				creator->log(dpp::ll_warning, "SQL: Replica " + lease.get()->info->host + " unavailable, running query on primary: " + key.sql());
+			} else if (lease) {
+				/* No replica is healthy, and the lease fell back to the primary */
+				return f(*lease);
 			}
 		}
 
-		int result{0};
+		/**
+		 * One DB handle can't query the database from multiple threads at the same time.
+		 * To prevent corruption of results, lease a free connection from the pool.
+		 */
+		connection_lease lease;
+		if (!lease) {
+			resultset rv;
+			rv.error = "Not connected to database";
+			log_error(key.sql(), rv.error);
+			return rv;
+		}
+		return f(*lease);
+	}
 
-		if (!cc.expects_results) {
-			/**
-			 * Query which does not expect results, e.g. UPDATE, INSERT
-			 */
-			result = mysql_stmt_execute(cc.st);
-			if (result) {
-				log_error(format, mysql_stmt_error(cc.st));
-				rv.error = mysql_stmt_error(cc.st);
-			} else {
-				rv.affected_rows = rows_affected = mysql_stmt_affected_rows(cc.st);
+	/**
+	 * @brief Run a query on the transaction's connection, or on a free connection from the pool
+	 *
+	 * @tparam P paramlist, or a span of bound_parameter
+	 * @param key Interned format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
+	 * @return result set
+	 */
+	template <typename P> resultset run_query(const query_key& key, const P &parameters, const query_options& options) {
+		if (!key) {
+			resultset rv;
+			rv.error = "Empty query key";
+			log_error(key.sql(), rv.error);
+			return rv;
+		}
+		return with_connection(key, [&](sql_connection& conn) {
+			return unsafe_query(conn, key, parameters, options);
+		}, key.reads() && !options.primary);
+	}
+
+	/**
+	 * @brief Maximum rows inserted by one statement of a rewritten batch
+	 */
+	constexpr size_t max_batch_rows = 1024;
+
+	/**
+	 * @brief Maximum placeholders MySQL accepts in one prepared statement
+	 */
+	constexpr size_t max_batch_placeholders = 65535;
+
+	/**
+	 * @brief Find the row of an INSERT or REPLACE ... VALUES (...) statement, if every
+	 * placeholder of the statement is within it, so that the row can be repeated to
+	 * insert many rows at once.
+	 *
+	 * @param sql statement
+	 * @param begin receives the offset of the row's opening parenthesis
+	 * @param end receives the offset just past the row's closing parenthesis
+	 * @return true if the statement can be rewritten as a multi-row insert
+	 */
+	bool find_values_row(std::string_view sql, size_t& begin, size_t& end) {
+		auto keyword_at = [sql](size_t i, std::string_view word) {
+			auto word_char = [](char c) {
+				return isalnum(static_cast<unsigned char>(c)) || c == '_';
+			};
+			if (i + word.size() > sql.size() || (i > 0 && word_char(sql[i - 1]))) {
+				return false;
+			}
+			for (size_t c = 0; c < word.size(); ++c) {
+				if (tolower(static_cast<unsigned char>(sql[i + c])) != word[c]) {
+					return false;
+				}
+			}
+			return i + word.size() == sql.size() || !word_char(sql[i + word.size()]);
+		};
+		size_t start = sql.find_first_not_of(" \t\r\n");
+		if (start == std::string_view::npos || !(keyword_at(start, "insert") || keyword_at(start, "replace"))) {
+			return false;
+		}
+		char quote{0};
+		int depth{0};
+		bool after_values{false};
+		begin = std::string_view::npos;
+		for (size_t i = start; i < sql.size(); ++i) {
+			char c = sql[i];
+			if (quote) {
+				if (c == '\\' && quote != '`') {
+					++i;
+				} else if (c == quote) {
+					quote = 0;
+				}
+			} else if (c == '\'' || c == '"' || c == '`') {
+				quote = c;
+			} else if (!after_values && keyword_at(i, "values")) {
+				after_values = true;
+				i += 5;
+			} else if (after_values && c == '(') {
+				if (depth++ == 0 && begin == std::string_view::npos) {
+					begin = i;
+				}
+			} else if (after_values && c == ')' && depth > 0) {
+				if (--depth == 0 && begin != std::string_view::npos) {
+					end = i + 1;
+					size_t row_placeholders = placeholder_count(sql.substr(begin, end - begin));
+					return row_placeholders > 0 && row_placeholders == placeholder_count(sql);
+				}
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Run a batch on a connection held by the caller
+	 *
+	 * @param conn connection to run the batch on
+	 * @param key Interned format string
+	 * @param parameter_sets One paramlist for each execution of the statement
+	 * @param options Per-query options
+	 * @return result set with the total affected rows, or the first error
+	 */
+	resultset unsafe_query_batch(sql_connection& conn, const query_key& key, const std::vector<paramlist> &parameter_sets, const query_options& options) {
+		resultset rv;
+		const std::string& sql = key.sql();
+		size_t begin{0}, end{0};
+		if (!find_values_row(sql, begin, end)) {
+			/* Not a rewritable insert, execute the cached statement once per parameter set */
+			for (const paramlist& parameters : parameter_sets) {
+				resultset r = unsafe_query(conn, key, parameters, options);
+				if (!r.error.empty()) {
+					rv.error = r.error;
+					break;
+				}
+				rv.affected_rows += r.affected_rows;
 			}
 		} else {
 			/**
-			 * Query which expects results, e.g. SELECT
+			 * Insert the rows in chunks of a power of two rows, so that any size of batch
+			 * only ever prepares a handful of distinct statements per connection.
 			 */
-			unsigned long field_count{0};
-			MYSQL_RES *a_res = mysql_stmt_result_metadata(cc.st);
-			if (a_res) {
-				field_count = mysql_stmt_field_count(cc.st);
-				MYSQL_FIELD *fields = mysql_fetch_fields(a_res);
-				MYSQL_BIND bindings[field_count];
-				char* string_buffers[field_count];
-				unsigned long lengths[field_count];
-				bool is_null[field_count];
-				std::memset(bindings, 0, sizeof(bindings));
-				std::memset(is_null, 0, sizeof(is_null));
-				std::memset(lengths, 0, sizeof(lengths));
-				for (unsigned long i = 0; i < field_count; ++i) {
-					/* FIX: Cap max length of retrieved field at 128k, else it will try and new[]
-					 * a 4gb buffer, which is really REALLY slow!
-					 */
-					fields[i].length = std::min(fields[i].length, 131072UL);
-					string_buffers[i] = new char[fields[i].length];
-					memset(string_buffers[i], 0, fields[i].length);
-					bindings[i].buffer_type = MYSQL_TYPE_VAR_STRING;
-					bindings[i].buffer = string_buffers[i];
-					bindings[i].buffer_length = fields[i].length;
-					bindings[i].is_null = &is_null[i];
-					bindings[i].length = &lengths[i];
-				}
-
-				result = mysql_stmt_bind_result(cc.st, (MYSQL_BIND*)&bindings);
-				if (result) {
-					log_error(format, mysql_stmt_error(cc.st));
-					for (unsigned long i = 0; i < field_count; ++i) {
-						delete[] string_buffers[i];
-					}
-					mysql_free_result(a_res);
-					return rv;
+			size_t row_placeholders = placeholder_count(sql);
+			size_t max_rows = std::bit_floor(std::clamp<size_t>(max_batch_placeholders / row_placeholders, 1, max_batch_rows));
+			std::string_view row = std::string_view(sql).substr(begin, end - begin);
+			std::vector<query_key> chunk_keys(std::bit_width(max_rows));
+			paramlist flat;
+			for (size_t done = 0; done < parameter_sets.size();) {
+				size_t rows = std::min(max_rows, std::bit_floor(parameter_sets.size() - done));
+				query_key& chunk_key = chunk_keys[std::bit_width(rows) - 1];
+				if (!chunk_key) {
+					std::string chunk_sql = sql.substr(0, end);
+					for (size_t r = 1; r < rows; ++r) {
+						chunk_sql.append(",").append(row);
+					}
+					chunk_sql.append(sql.substr(end));
+					chunk_key = intern(chunk_sql);
+				}
+				flat.clear();
+				flat.reserve(rows * row_placeholders);
+				for (size_t r = done; r < done + rows; ++r) {
+					if (parameter_sets[r].size() != row_placeholders) {
+						rv.error = "Incorrect number of parameters in batch row " + std::to_string(r) + ": " + sql + " (" + std::to_string(parameter_sets[r].size()) + " vs " + std::to_string(row_placeholders) + ")";
+						log_error(sql, rv.error);
+						return rv;
+					}
+					flat.insert(flat.end(), parameter_sets[r].begin(), parameter_sets[r].end());
+				}
+				resultset r = unsafe_query(conn, chunk_key, flat, options);
+				if (!r.error.empty()) {
+					rv.error = r.error;
+					break;
+				}
+				rv.affected_rows += r.affected_rows;
+				done += rows;
+			}
+		}
+		std::lock_guard<std::mutex> status_lock(status_mutex);
+		rows_affected = rv.affected_rows;
+		return rv;
+	}
+
+	resultset query_batch(const std::string &format, const std::vector<paramlist> &parameter_sets, const query_options& options) {
+		query_key key = intern(format);
+		return with_connection(key, [&](sql_connection& conn) {
+			return unsafe_query_batch(conn, key, parameter_sets, options);
+		});
+	}
+
+	resultset query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream, const query_options& options) {
+		query_key key = intern(format);
+		bool emitted{false};
+		row_stream destination{ .on_chunk = on_chunk, .options = stream, .emitted = emitted };
+		/* Rerunning on the primary would pass the chunks already emitted again */
+		return with_connection(key, [&](sql_connection& conn) {
+			return unsafe_query(conn, key, parameters, options, &destination);
+		}, key.reads() && !options.primary, &emitted);
+	}
+
+	void query_stream_callback(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const sql_query_callback& cb, const stream_options& stream, const query_options& options) {
+		enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = cb, .options = options, .transaction = {}, .work = [format, parameters, on_chunk, stream, options]() {
+			return query_stream(format, parameters, on_chunk, stream, options);
+		}, .queued = {}});
+	}
+
+#ifdef DPP_CORO
+	dpp::async<resultset> co_query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream, const query_options& options) {
+		return dpp::async<resultset>{ [format, parameters, on_chunk, stream, options] <typename C> (C &&cc) { return query_stream_callback(format, parameters, on_chunk, std::forward<C>(cc), stream, options); }};
+	}
+#endif
+
+	void query_batch_callback(const std::string &format, std::vector<paramlist> parameter_sets, const sql_query_callback& cb, const query_options& options) {
+		auto sets = std::make_shared<const std::vector<paramlist>>(std::move(parameter_sets));
+		enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = cb, .options = options, .transaction = {}, .work = [format, sets, options]() {
+			return query_batch(format, *sets, options);
+		}, .queued = {}});
+	}
+
+#ifdef DPP_CORO
+	dpp::async<resultset> co_query_batch(const std::string &format, std::vector<paramlist> parameter_sets, const query_options& options) {
+		return dpp::async<resultset>{ [&format, &parameter_sets, &options] <typename C> (C &&cc) { return query_batch_callback(format, std::move(parameter_sets), std::forward<C>(cc), options); }};
+	}
+#endif
+
+	/**
+	 * @brief Check that a statement can take accumulated deltas: an INSERT ... VALUES (...)
+	 * ON DUPLICATE KEY UPDATE, with every placeholder in the row. Its last placeholder is
+	 * then the delta, and the buffered sums are flushed as multi-row inserts. In any other
+	 * statement, such as an UPDATE ... SET n = n + ? WHERE id = ?, the delta's placeholder
+	 * need not be the last, and binding it there would write to the wrong row.
+	 *
+	 * @param sql statement
+	 * @return true if the statement can be used with accumulate()
+	 */
+	bool accumulating_insert(std::string_view sql) {
+		size_t begin{0}, end{0};
+		if (!find_values_row(sql, begin, end)) {
+			return false;
+		}
+		/* find_values_row() also accepts REPLACE, which would overwrite the counter rather than add to it */
+		if (tolower(static_cast<unsigned char>(sql[sql.find_first_not_of(" \t\r\n")])) != 'i') {
+			return false;
+		}
+		std::vector<std::string> words;
+		std::string word;
+		for (size_t i = end; i <= sql.size(); ++i) {
+			if (i < sql.size() && (isalnum(static_cast<unsigned char>(sql[i])) || sql[i] == '_')) {
+				word += static_cast<char>(tolower(static_cast<unsigned char>(sql[i])));
+			} else if (!word.empty()) {
+				words.emplace_back(std::move(word));
+				word.clear();
+			}
+		}
+		const std::array<std::string, 4> clause{"on", "duplicate", "key", "update"};
+		return std::search(words.begin(), words.end(), clause.begin(), clause.end()) != words.end();
+	}
+
+	void accumulate(const std::string &format, const paramlist &key, accumulate_delta delta) {
+		pool_state& pool = current_pool();
+		query_key statement = intern(format);
+		/* Checked once per statement and thread, as counters are bumped far more often than new statements appear */
+		thread_local std::unordered_map<size_t, bool> accepted;
+		auto check = accepted.find(statement.id());
+		if (check == accepted.end()) {
+			check = accepted.emplace(statement.id(), accumulating_insert(statement.sql())).first;
+		}
+		if (!check->second) {
+			log_error(format, "accumulate() needs an INSERT ... VALUES (...) ON DUPLICATE KEY UPDATE, with the delta as the row's last placeholder: " + format);
+			return;
+		}
+		if (placeholder_count(statement.sql()) != key.size() + 1) {
+			log_error(format, "Incorrect number of parameters for accumulate: " + format + " (" + std::to_string(key.size()) + " key parameters and a delta)");
+			return;
+		}
+		result_cache_key k{ .key = statement, .parameters = owned_parameters(key) };
+		accumulator_shard& shard = pool.accumulators[accumulator_hash()(k) % accumulator_shards];
+		bool full{false};
+		{
+			std::lock_guard<std::mutex> shard_lock(shard.mutex);
+			auto [entry, inserted] = shard.deltas.try_emplace(std::move(k));
+			accumulated_delta& sum = entry->second;
+			if (const int64_t* whole = std::get_if<int64_t>(&delta)) {
+				sum.whole += *whole;
+			} else {
+				sum.real += std::get<double>(delta);
+				sum.is_real = true;
+			}
+			/* Counted under the shard's lock, so a flush never takes a key before it is counted */
+			full = inserted && ++pool.accumulated_keys >= pool.accumulate_max_keys;
+		}
+		if (full) {
+			queue_accumulator_flush(pool);
+		}
+	}
+
+	void flush_accumulators(pool_state& pool) {
+		if (pool.accumulated_keys == 0) {
+			return;
+		}
+		pool_scope scope(pool);
+		/* Each statement's keys become one batch, of the key's parameters and then its sum */
+		std::unordered_map<size_t, std::pair<query_key, std::vector<paramlist>>> batches;
+		for (accumulator_shard& shard : pool.accumulators) {
+			decltype(shard.deltas) deltas;
+			{
+				std::lock_guard<std::mutex> shard_lock(shard.mutex);
+				deltas.swap(shard.deltas);
+			}
+			pool.accumulated_keys -= deltas.size();
+			while (!deltas.empty()) {
+				auto node = deltas.extract(deltas.begin());
+				auto& [statement, rows] = batches[node.key().key.id()];
+				statement = node.key().key;
+				paramlist& row = rows.emplace_back(std::move(node.key().parameters));
+				const accumulated_delta& sum = node.mapped();
+				if (sum.is_real) {
+					row.emplace_back(sum.real + static_cast<double>(sum.whole));
+				} else {
+					row.emplace_back(sum.whole);
 				}
+			}
+		}
+		for (const auto& [id, batch] : batches) {
+			const auto& [statement, rows] = batch;
+			resultset rv = with_connection(statement, [&](sql_connection& conn) {
+				return unsafe_query_batch(conn, statement, rows, {});
+			});
+			if (!rv.error.empty()) {
+				creator->log(dpp::ll_error, fmt::format("SQL: Accumulated deltas for {} keys were not written: {}: {}", rows.size(), rv.error, statement.sql()));
+			}
+		}
+	}
 
-				result = mysql_stmt_execute(cc.st);
-				if (result == 0) {
+	void flush_accumulated() {
+		flush_accumulators(current_pool());
+	}
 
-					/* Build resultset */
-					while (true) {
-						result = mysql_stmt_fetch(cc.st); 
-						if (result == MYSQL_NO_DATA) {
-							/* End of resultset */
-							break; 
-						} else if (result != 0) {
-							/* Error retrieving resultset, e.g. disconnected */
-							log_error(format, mysql_stmt_error(cc.st));
-							break; 
+	/**
+	 * @brief Append a statement to a multi-statement query, with each parameter
+	 * escaped for the connection's character set and put in place of its ?
+	 *
+	 * @param conn connection the query will run on, must be held by the caller
+	 * @param statement statement to append
+	 * @param sql query text to append to
+	 * @param error receives the reason on failure
+	 * @return true if the statement was appended
+	 */
+	bool unsafe_append_statement(sql_connection& conn, const query_statement& statement, std::string& sql, std::string& error) {
+		std::string_view format = statement.format;
+		std::vector<size_t> placeholders;
+		for_each_placeholder(format, [&placeholders](size_t at) {
+			placeholders.emplace_back(at);
+		});
+		if (placeholders.size() != statement.parameters.size()) {
+			error = "Incorrect number of parameters: " + statement.format + " (" + std::to_string(statement.parameters.size()) + " vs " + std::to_string(placeholders.size()) + ")";
+			return false;
+		}
+		if (!sql.empty()) {
+			/* On a line of its own, so that a trailing -- comment can't swallow it */
+			sql += "\n;\n";
+		}
+		size_t from{0};
+		for (size_t p = 0; p < placeholders.size() && error.empty(); ++p) {
+			sql.append(format.substr(from, placeholders[p] - from));
+			from = placeholders[p] + 1;
+			std::visit([&conn, &sql, &error](const auto &v) {
+				using T = std::decay_t<decltype(v)>;
+				if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, buffer_parameter>) {
+					/* The text protocol has no long data, so a streamed value is read whole */
+					std::string whole;
+					std::string_view text;
+					if constexpr (std::is_same_v<T, std::string>) {
+						text = v;
+					} else if (v.source) {
+						for (std::string_view piece = v.source(0); !piece.empty(); piece = v.source(whole.length())) {
+							whole.append(piece);
 						}
+						text = whole;
+					} else {
+						text = std::string_view(v.data, v.length);
+					}
+					std::string escaped(text.length() * 2 + 1, '\0');
+					unsigned long length = mysql_real_escape_string(&conn.handle, escaped.data(), text.data(), text.length());
+					if (length == static_cast<unsigned long>(-1)) {
+						error = "String parameter can't be escaped on this connection";
+						return;
+					}
+					sql += '\'';
+					sql.append(escaped.data(), length);
+					sql += '\'';
+				} else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+					sql += "NULL";
+				} else if constexpr (std::is_same_v<T, bool>) {
+					sql += v ? "1" : "0";
+				} else if constexpr (std::is_floating_point_v<T>) {
+					if (!std::isfinite(v)) {
+						error = "Floating point parameter is not finite";
+						return;
+					}
+					sql += fmt::format("{}", v);
+				} else {
+					sql += std::to_string(v);
+				}
+			}, statement.parameters[p]);
+		}
+		sql.append(format.substr(from));
+		/* The statements are separated here, so trailing semicolons would make empty statements */
+		while (!sql.empty() && (sql.back() == ';' || isspace(static_cast<unsigned char>(sql.back())))) {
+			sql.pop_back();
+		}
+		return error.empty();
+	}
+
+	/**
+	 * @brief Read a result set of the text protocol into a rowset
+	 *
+	 * @param res result set from mysql_store_result()
+	 * @param options Per-query options. With fetch_typed, numeric columns are
+	 * converted from their text to native values.
+	 * @return rows
+	 */
+	rowset text_rows(MYSQL_RES* res, const query_options& options) {
+		unsigned int field_count = mysql_num_fields(res);
+		std::shared_ptr<const column_list> columns = make_columns(mysql_fetch_fields(res), field_count);
+		bool typed = options.fetch == fetch_typed;
+		rowset rows(columns, typed, acquire_arena(0));
+		rows.reserve(mysql_num_rows(res), 0);
+		while (MYSQL_ROW row = mysql_fetch_row(res)) {
+			unsigned long* lengths = mysql_fetch_lengths(res);
+			for (unsigned int i = 0; i < field_count; ++i) {
+				std::string_view text = row[i] ? std::string_view(row[i], lengths[i]) : std::string_view();
+				column_type type = columns->types[i];
+				if (!row[i] || !typed || type < ct_int) {
+					rows.append(text, !row[i]);
+					continue;
+				}
+				char native[sizeof(uint64_t)]{};
+				if (type == ct_int) {
+					int64_t value{0};
+					std::from_chars(text.data(), text.data() + text.size(), value);
+					memcpy(native, &value, sizeof(value));
+				} else if (type == ct_uint) {
+					uint64_t value{0};
+					std::from_chars(text.data(), text.data() + text.size(), value);
+					memcpy(native, &value, sizeof(value));
+				} else {
+					double value{0};
+					std::from_chars(text.data(), text.data() + text.size(), value);
+					memcpy(native, &value, sizeof(value));
+				}
+				rows.append(std::string_view(native, sizeof(native)), false);
+			}
+		}
+		return rows;
+	}
+
+	/**
+	 * @brief Run a multi-statement query on a connection held by the caller.
+	 * Lost connections are handled as by unsafe_query(): the query is retried once
+	 * if every statement is a read, and never within a transaction.
+	 *
+	 * @param conn connection to run the statements on
+	 * @param statements statements to run
+	 * @param options Per-query options
+	 * @return one result set per statement
+	 */
+	std::vector<resultset> unsafe_query_multi(sql_connection& conn, const std::vector<query_statement> &statements, const query_options& options) {
+		std::vector<resultset> results(statements.size());
+		bool in_transaction = pinned_connection == &conn;
+		bool idempotent = std::all_of(statements.begin(), statements.end(), [](const query_statement& statement) {
+			return returns_rows(statement.format);
+		});
+		auto fail_from = [&results](size_t first, const std::string& error) {
+			for (size_t i = first; i < results.size(); ++i) {
+				results[i].error = i == first ? error : "Not run, an earlier statement failed";
+			}
+		};
+		for (int tries = 0; !statements.empty(); ++tries) {
+			results.assign(statements.size(), resultset{});
+			if (conn.state != cs_connected && (in_transaction || !unsafe_reconnect(conn))) {
+				fail_from(0, in_transaction ? "Database connection lost during transaction" : "Database connection lost, reconnect failed");
+				log_error(statements[0].format, results[0].error);
+				break;
+			}
+
+			std::string sql, error;
+			for (size_t i = 0; i < statements.size(); ++i) {
+				if (!unsafe_append_statement(conn, statements[i], sql, error)) {
+					fail_from(i, error);
+					log_error(statements[i].format, error);
+					return results;
+				}
+			}
 
-						/* Build row*/
-						if (mysql_num_fields(a_res)) {
-							long s_field_count = 0;
-							db::row thisrow;
-							while (s_field_count < mysql_num_fields(a_res)) {
-								std::string a = (fields[s_field_count].name ? fields[s_field_count].name : "");
-								std::string b = is_null[s_field_count] ? "" : std::string(string_buffers[s_field_count], lengths[s_field_count]);
-								thisrow[a] = b;
-								s_field_count++;
+			begin_query();
+			query_total += statements.size() - 1;
+			unsigned int error_code{0};
+			size_t current{0};
+			if (mysql_real_query(&conn.handle, sql.c_str(), sql.length()) == 0) {
+				int status{0};
+				do {
+					MYSQL_RES* res = mysql_store_result(&conn.handle);
+					if (current < results.size()) {
+						resultset& rv = results[current];
+						if (res) {
+							rv.rows = text_rows(res, options);
+						} else if (mysql_field_count(&conn.handle) == 0) {
+							rv.affected_rows = mysql_affected_rows(&conn.handle);
+							/* Not interned, as multi-statement calls are often built ad hoc, and would grow the table for good */
+							wrote_tables(current_pool(), statement_tags(statements[current].format));
+						} else {
+							error_code = mysql_errno(&conn.handle);
+							error = mysql_error(&conn.handle);
+							/* Discard the results still to come, or the connection is out of sync for its next query */
+							while (mysql_next_result(&conn.handle) == 0) {
+								if (MYSQL_RES* rest = mysql_store_result(&conn.handle)) {
+									mysql_free_result(rest);
+								}
 							}
-							rv.emplace_back(thisrow);
+							break;
 						}
 					}
+					/* A statement holding more than one statement of its own returns extra results, which are discarded */
+					if (res) {
+						mysql_free_result(res);
+					}
+					++current;
+					status = mysql_next_result(&conn.handle);
+				} while (status == 0);
+				if (status > 0) {
+					error_code = mysql_errno(&conn.handle);
+					error = mysql_error(&conn.handle);
+				}
+			} else {
+				error_code = mysql_errno(&conn.handle);
+				error = mysql_error(&conn.handle);
+			}
+
+			if (error_code) {
+				fail_from(std::min(current, results.size() - 1), error);
+				log_error(statements[std::min(current, results.size() - 1)].format, error);
+			} else {
+				size_t total{0};
+				for (const resultset& rv : results) {
+					total += rv.affected_rows;
 				}
-				mysql_free_result(a_res);
-				for (unsigned long i = 0; i < field_count; ++i) {
-					delete[] string_buffers[i];
+				std::lock_guard<std::mutex> status_lock(status_mutex);
+				rows_affected = total;
+			}
+			if (!connection_lost(error_code)) {
+				conn.last_used = std::chrono::steady_clock::now();
+				break;
+			}
+			conn.state = cs_lost;
+			if (tries > 0 || in_transaction || !idempotent) {
+				break;
+			}
+			creator->log(dpp::ll_warning, "SQL: Retrying multi-statement query after lost connection: " + statements[0].format);
+		}
+		return results;
+	}
+
+	std::vector<resultset> query_multi(const std::vector<query_statement> &statements, const query_options& options) {
+		bool read = !options.primary && std::all_of(statements.begin(), statements.end(), [](const query_statement& statement) {
+			return returns_rows(statement.format);
+		});
+		std::vector<resultset> results;
+		resultset rv = with_connection(query_key(), [&](sql_connection& conn) {
+			results = unsafe_query_multi(conn, statements, options);
+			/* Report the first error, so a lost replica falls back to the primary */
+			for (const resultset& r : results) {
+				if (!r.error.empty()) {
+					return r;
 				}
+			}
+			return resultset{};
+		}, read);
+		if (!rv.error.empty() && results.empty()) {
+			return std::vector<resultset>(statements.size(), rv);
+		}
+		return results;
+	}
+
+	void query_multi_callback(std::vector<query_statement> statements, const sql_multi_query_callback& cb, const query_options& options) {
+		auto shared = std::make_shared<const std::vector<query_statement>>(std::move(statements));
+		auto results = std::make_shared<std::vector<resultset>>();
+		/* The job's own resultset only carries an error, if the queue rejected it */
+		enqueue(cached_query_results{.key = {}, .parameters = {}, .callback = [shared, results, cb](resultset&& rv) {
+			if (rv.error.empty()) {
+				cb(std::move(*results));
 			} else {
-				log_error(format, mysql_stmt_error(cc.st));
-				rv.error = mysql_stmt_error(cc.st);
+				cb(std::vector<resultset>(shared->size(), rv));
 			}
+		}, .options = options, .transaction = {}, .work = [shared, results, options]() {
+			*results = query_multi(*shared, options);
+			return resultset{};
+		}, .queued = {}});
+	}
+
+#ifdef DPP_CORO
+	dpp::async<std::vector<resultset>> co_query_multi(std::vector<query_statement> statements, const query_options& options) {
+		return dpp::async<std::vector<resultset>>{ [&statements, &options] <typename C> (C &&cc) { return query_multi_callback(std::move(statements), std::forward<C>(cc), options); }};
+	}
+#endif
+
+	resultset query(const query_key& key, const paramlist &parameters, const query_options& options) {
+		return run_query(key, parameters, options);
+	}
+
+	resultset execute(const query_key& key, std::span<const bound_parameter> parameters, const query_options& options) {
+		return run_query(key, parameters, options);
+	}
+
+	database::database() : pool(std::make_unique<pool_state>()) {
+	}
+
+	database::~database() {
+		stop_pool(*pool);
+	}
+
+	bool database::init(dpp::cluster& bot, const json& config) {
+		return init_pool(*pool, bot, config);
+	}
+
+	void database::close() {
+		close_pool(*pool);
+	}
+
+	resultset database::query(const std::string &format, const paramlist &parameters, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::query(format, parameters, options);
+	}
+
+	resultset database::query(const query_key& key, const paramlist &parameters, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::query(key, parameters, options);
+	}
+
+	void database::query_callback(const std::string &format, paramlist parameters, sql_query_callback cb, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_callback(format, std::move(parameters), std::move(cb), options);
+	}
+
+	void database::query_callback(const query_key& key, paramlist parameters, sql_query_callback cb, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_callback(key, std::move(parameters), std::move(cb), options);
+	}
+
+	resultset database::query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags) {
+		pool_scope scope(*pool);
+		return db::query(format, parameters, lifetime, tags);
+	}
+
+	void database::query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_callback(format, parameters, cb, lifetime, tags, options);
+	}
+
+	std::shared_ptr<const resultset> database::query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags) {
+		pool_scope scope(*pool);
+		return db::query_cached(format, parameters, lifetime, tags);
+	}
+
+	void database::query_cached_callback(const std::string &format, const paramlist &parameters, const sql_shared_query_callback& cb, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_cached_callback(format, parameters, cb, lifetime, tags, options);
+	}
+
+	void database::invalidate(const std::string& table) {
+		pool_scope scope(*pool);
+		db::invalidate(table);
+	}
+
+	resultset database::query_batch(const std::string &format, const std::vector<paramlist> &parameter_sets, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::query_batch(format, parameter_sets, options);
+	}
+
+	void database::query_batch_callback(const std::string &format, std::vector<paramlist> parameter_sets, const sql_query_callback& cb, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_batch_callback(format, std::move(parameter_sets), cb, options);
+	}
+
+	bool database::prepare(const std::vector<std::string>& statements) {
+		pool_scope scope(*pool);
+		return db::prepare(statements);
+	}
+
+	void database::accumulate(const std::string &format, const paramlist &key, accumulate_delta delta) {
+		pool_scope scope(*pool);
+		db::accumulate(format, key, delta);
+	}
+
+	void database::flush_accumulated() {
+		flush_accumulators(*pool);
+	}
+
+	std::vector<resultset> database::query_multi(const std::vector<query_statement> &statements, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::query_multi(statements, options);
+	}
+
+	void database::query_multi_callback(std::vector<query_statement> statements, const sql_multi_query_callback& cb, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_multi_callback(std::move(statements), cb, options);
+	}
+
+	resultset database::query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::query_stream(format, parameters, on_chunk, stream, options);
+	}
+
+	void database::query_stream_callback(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const sql_query_callback& cb, const stream_options& stream, const query_options& options) {
+		pool_scope scope(*pool);
+		db::query_stream_callback(format, parameters, on_chunk, cb, stream, options);
+	}
+
+	void database::transaction(std::function<bool()> closure, sql_query_callback callback) {
+		pool_scope scope(*pool);
+		db::transaction(std::move(closure), std::move(callback));
+	}
+
+	size_t database::queue_depth(query_lane lane) {
+		pool_scope scope(*pool);
+		return db::queue_depth(lane);
+	}
+
+#ifdef DPP_CORO
+	/* dpp::async starts the query in its constructor, so the query is queued on this database */
+	dpp::async<resultset> database::co_query(const std::string &format, paramlist parameters, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query(format, std::move(parameters), options);
+	}
+
+	dpp::async<resultset> database::co_query(const query_key& key, paramlist parameters, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query(key, std::move(parameters), options);
+	}
+
+	dpp::async<resultset> database::co_query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query(format, parameters, lifetime, tags, options);
+	}
+
+	dpp::async<std::shared_ptr<const resultset>> database::co_query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query_cached(format, parameters, lifetime, tags, options);
+	}
+
+	dpp::async<resultset> database::co_query_batch(const std::string &format, std::vector<paramlist> parameter_sets, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query_batch(format, std::move(parameter_sets), options);
+	}
+
+	dpp::async<std::vector<resultset>> database::co_query_multi(std::vector<query_statement> statements, const query_options& options) {
+		pool_scope scope(*pool);
+		return db::co_query_multi(std::move(statements), options);
+	}
+
+	dpp::async<resultset> database::co_transaction(std::function<bool()> closure) {
+		pool_scope scope(*pool);
+		return db::co_transaction(std::move(closure));
+	}
+
+	dpp::async<resultset> database::co_transaction(std::function<dpp::task<bool>(txn&)> closure) {
+		pool_scope scope(*pool);
+		return db::co_transaction(std::move(closure));
+	}
+#endif
+
+	bool shard_router::init(dpp::cluster& bot, const json& config) {
+		shards.clear();
+		bool connected{true};
+		for (const json& shard_config : config) {
+			auto& shard = shards.emplace_back(std::make_unique<database>());
+			connected = shard->init(bot, shard_config) && connected;
 		}
+		if (shards.empty()) {
+			bot.log(dpp::ll_error, "SQL: No databases are configured for the shard router");
+			return false;
+		}
+		return connected;
+	}
 
-		return rv;
+	void shard_router::close() {
+		for (auto& shard : shards) {
+			shard->close();
+		}
+	}
+
+	size_t shard_router::size() const {
+		return shards.size();
+	}
+
+	database& shard_router::route(dpp::snowflake key) {
+		if (shards.empty()) {
+			throw std::out_of_range("shard_router::route: no databases");
+		}
+		return *shards[(uint64_t(key) >> 22) % shards.size()];
+	}
+
+	database& shard_router::shard(size_t index) {
+		return *shards.at(index);
 	}
 };
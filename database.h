@@ -21,8 +21,25 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <memory_resource>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <optional>
+#include <span>
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+#include <array>
 #include <variant>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <utility>
+#include <chrono>
+#include <tuple>
 #include <dpp/dpp.h>
 
 /**
@@ -32,72 +49,609 @@
 namespace db {
 
 	/**
-	 * @brief Definition of a row in a result set
+	 * @brief Definition of a standalone row, mapping column names to values.
+	 * Rows of a result set are stored columnar and accessed through row_view,
+	 * which converts to this type when an owning copy is needed.
 	 */
 	using row = std::map<std::string, std::string>;
 
 	/**
-	 * @brief Definition of a result set. Supports iteration and accessing its
-	 * rows via operator[] and at(). You can also insert new rows with emplace_back
-	 * and push_back().
+	 * @brief A single field value within a result set row. This is a view of the
+	 * result set's storage, and is valid only as long as the result set which
+	 * produced it. It converts implicitly to std::string for compatibility.
 	 */
-	struct resultset {
+	struct field : public std::string_view {
+		using std::string_view::string_view;
+
+		constexpr field() = default;
+
+		constexpr field(std::string_view v) : std::string_view(v) {
+		}
 
 		/**
-		 * Row values
+		 * Copy the value into an owning string
+		 * @return string copy of field
 		 */
-		std::vector<row> rows;
+		operator std::string() const {
+			return std::string(data(), size());
+		}
+	};
 
+	/**
+	 * @brief Native type of a result column, derived from its MYSQL_FIELD
+	 */
+	enum column_type : uint8_t {
 		/**
-		 * Error message of last query or an empty string on success
+		 * Text, or any type without a native representation such as DECIMAL or DATETIME
 		 */
-		std::string error;
+		ct_text,
+		/**
+		 * Binary string or BLOB
+		 */
+		ct_blob,
+		/**
+		 * Signed integer of any width
+		 */
+		ct_int,
+		/**
+		 * Unsigned integer of any width
+		 */
+		ct_uint,
+		/**
+		 * FLOAT or DOUBLE
+		 */
+		ct_real,
+	};
+
+	/**
+	 * @brief A field value decoded according to its column type.
+	 * NULL is represented by std::nullptr_t, distinct from an empty string.
+	 */
+	using field_value = std::variant<std::nullptr_t, std::string_view, std::span<const std::byte>, int64_t, uint64_t, double>;
 
+	/**
+	 * @brief Column names and types of a result set. This is built once per
+	 * prepared statement and shared by every result set it returns.
+	 */
+	struct column_list {
 		/**
-		 * Number of affected rows, if an UPDATE, DELETE, INSERT
+		 * Column names, in the order returned by the server
 		 */
-		size_t affected_rows{};
+		std::vector<std::string> names;
 
 		/**
-		 * Returns true if the query succeeded
-		 * @return true if no error
+		 * Column types, in the same order as names
 		 */
-		[[nodiscard]] inline bool ok() const {
-			return error.empty();
+		std::vector<column_type> types;
+
+		/**
+		 * Column name to column index
+		 */
+		std::map<std::string, size_t, std::less<>> index;
+
+		/**
+		 * Build a column list from column names
+		 * @param column_names column names in order
+		 * @param column_types column types in order, if empty all columns are text
+		 */
+		explicit column_list(std::vector<std::string> column_names, std::vector<column_type> column_types = {});
+
+		/**
+		 * Find a column by name
+		 * @param name column name
+		 * @return column index, or std::string_view::npos if not found
+		 */
+		[[nodiscard]] inline size_t find(std::string_view name) const {
+			auto i = index.find(name);
+			return i == index.end() ? std::string_view::npos : i->second;
+		}
+	};
+
+	class rowset;
+
+	/**
+	 * @brief A cheap, non-owning view of one row of a rowset. Fields are
+	 * accessible by column index or by column name.
+	 */
+	class row_view {
+		friend class rowset;
+
+		const rowset* set{nullptr};
+		size_t row_index{0};
+
+	public:
+		row_view() = default;
+
+		row_view(const rowset* s, size_t index) : set(s), row_index(index) {
+		}
+
+		/**
+		 * Get a field by column index
+		 * @param column column index
+		 * @return field value
+		 */
+		[[nodiscard]] inline field operator[] (size_t column) const;
+
+		/**
+		 * Get a field by column index, for any integer type of index
+		 * @param column column index
+		 * @return field value
+		 */
+		template <typename T> requires std::is_integral_v<T>
+		[[nodiscard]] inline field operator[] (T column) const {
+			return (*this)[static_cast<size_t>(column)];
+		}
+
+		/**
+		 * Get a field by column name. Returns an empty field if there is no such column.
+		 * @param name column name
+		 * @return field value
+		 */
+		[[nodiscard]] inline field operator[] (std::string_view name) const;
+
+		/**
+		 * Get a field by column name. Returns an empty field if there is no such column.
+		 * @param name column name
+		 * @return field value
+		 */
+		[[nodiscard]] inline field operator[] (const char* name) const {
+			return (*this)[std::string_view(name)];
+		}
+
+		/**
+		 * Get a field by column index with range checking
+		 * @param column column index
+		 * @return field value
+		 * @throw std::out_of_range column does not exist
+		 */
+		[[nodiscard]] inline field at(size_t column) const;
+
+		/**
+		 * Get a field by column name with range checking
+		 * @param name column name
+		 * @return field value
+		 * @throw std::out_of_range column does not exist
+		 */
+		[[nodiscard]] inline field at(std::string_view name) const;
+
+		/**
+		 * Returns true if the row has a column by this name
+		 * @param name column name
+		 * @return true if column exists
+		 */
+		[[nodiscard]] inline bool contains(std::string_view name) const;
+
+		/**
+		 * Returns true if a field is NULL
+		 * @param column column index
+		 * @return true if NULL
+		 */
+		[[nodiscard]] inline bool is_null(size_t column) const;
+
+		/**
+		 * Returns true if a field is NULL
+		 * @param name column name
+		 * @return true if NULL
+		 * @throw std::out_of_range column does not exist
+		 */
+		[[nodiscard]] inline bool is_null(std::string_view name) const;
+
+		/**
+		 * Get a field decoded according to its column type. In text fetch mode,
+		 * numeric columns are parsed from their text.
+		 * @param column column index
+		 * @return decoded field value
+		 */
+		[[nodiscard]] inline field_value value(size_t column) const;
+
+		/**
+		 * Get a field decoded according to its column type
+		 * @param name column name
+		 * @return decoded field value
+		 * @throw std::out_of_range column does not exist
+		 */
+		[[nodiscard]] inline field_value value(std::string_view name) const {
+			return value(column_index(name));
+		}
+
+		/**
+		 * Get a field converted to a C++ type. Supported types are integers, bool,
+		 * float, double, std::string, std::string_view, std::span<const std::byte>,
+		 * and std::optional of any of these. A NULL field returns std::nullopt for
+		 * std::optional, and a value initialised T otherwise.
+		 *
+		 * With fetch_typed, numeric fields are read directly from their native value.
+		 * Otherwise they are parsed from text, yielding 0 if the text is not numeric.
+		 * A numeric field of a fetch_typed result has no text, so std::string_view and
+		 * std::span of it are empty. Use std::string to format it instead.
+		 *
+		 * @tparam T type to convert to
+		 * @param column column index
+		 * @return converted field value
+		 */
+		template <typename T> [[nodiscard]] T get(size_t column) const;
+
+		/**
+		 * Get a field converted to a C++ type, see get(size_t)
+		 * @tparam T type to convert to
+		 * @param name column name
+		 * @return converted field value
+		 * @throw std::out_of_range column does not exist
+		 */
+		template <typename T> [[nodiscard]] T get(std::string_view name) const {
+			return get<T>(column_index(name));
+		}
+
+		/**
+		 * Number of columns in the row
+		 * @return column count
+		 */
+		[[nodiscard]] inline size_t size() const;
+
+		/**
+		 * Index of this row within its rowset
+		 * @return row index
+		 */
+		[[nodiscard]] inline size_t index() const {
+			return row_index;
+		}
+
+		/**
+		 * Copy the row into a standalone column name to value map
+		 * @return row map
+		 */
+		[[nodiscard]] operator row() const;
+
+	private:
+		/**
+		 * Find a column by name
+		 * @param name column name
+		 * @return column index
+		 * @throw std::out_of_range column does not exist
+		 */
+		[[nodiscard]] inline size_t column_index(std::string_view name) const;
+
+		/**
+		 * Parse a number from text, stopping at the first character which is not part of it
+		 * @tparam T arithmetic type
+		 * @param text text to parse
+		 * @return parsed value, or 0 if the text is not numeric
+		 */
+		template <typename T> static T parse(std::string_view text) {
+			T v{};
+			if constexpr (std::is_same_v<T, bool>) {
+				long long n{};
+				std::from_chars(text.data(), text.data() + text.size(), n);
+				v = n != 0;
+			} else {
+				std::from_chars(text.data(), text.data() + text.size(), v);
+			}
+			return v;
+		}
+
+		/**
+		 * Format a number as text
+		 * @tparam T arithmetic type
+		 * @param v value
+		 * @return text
+		 */
+		template <typename T> static std::string format(T v) {
+			char buffer[32];
+			auto result = std::to_chars(buffer, buffer + sizeof(buffer), v);
+			return std::string(buffer, result.ptr);
+		}
+
+		/**
+		 * Read a native number stored in a fetch_typed rowset
+		 * @tparam T int64_t, uint64_t or double
+		 * @param raw stored bytes
+		 * @return value
+		 */
+		template <typename T> static T load(std::string_view raw) {
+			T v{};
+			std::memcpy(&v, raw.data(), std::min(raw.size(), sizeof(T)));
+			return v;
+		}
+	};
+
+	/**
+	 * @brief Detect std::optional, for row_view::get()
+	 */
+	template <typename T> inline constexpr bool is_optional_v = false;
+	template <typename T> inline constexpr bool is_optional_v<std::optional<T>> = true;
+
+	/**
+	 * @brief Columnar storage for the rows of a result set. Column names are held
+	 * once in a shared column_list, and all field values are kept in one contiguous
+	 * buffer addressed by an offsets array. Rows fetched by a query are allocated
+	 * from an arena, which is released as a whole with the last rowset using it.
+	 * The interface mirrors the std::vector of rows it replaces, yielding row_view objects.
+	 */
+	class rowset {
+		/**
+		 * Shared column names
+		 */
+		std::shared_ptr<const column_list> column_names;
+
+		/**
+		 * Arena which the storage below is allocated from, or null for the default heap.
+		 * Declared first, so that it outlives the storage.
+		 */
+		std::shared_ptr<std::pmr::memory_resource> arena;
+
+		/**
+		 * All field values of all rows, concatenated
+		 */
+		std::pmr::string values;
+
+		/**
+		 * Start of each field value within values, plus one trailing end offset.
+		 * Field (r, c) occupies [offsets[r * columns + c], offsets[r * columns + c + 1])
+		 */
+		std::pmr::vector<size_t> offsets{0};
+
+		/**
+		 * One flag per field, in the same order as offsets, true if the field is NULL
+		 */
+		std::pmr::vector<bool> nulls;
+
+		/**
+		 * Number of complete rows
+		 */
+		size_t row_count{0};
+
+		/**
+		 * True if numeric fields are stored as native values rather than text
+		 */
+		bool native{false};
+
+		/**
+		 * Memory resource the storage is allocated from
+		 * @return the arena, or the default resource
+		 */
+		[[nodiscard]] inline std::pmr::memory_resource* resource() const {
+			return arena ? arena.get() : std::pmr::get_default_resource();
+		}
+
+	public:
+		/**
+		 * @brief Iterator over rows. Holds the current row_view, so that
+		 * dereferencing can yield a reference as range-for loops expect.
+		 */
+		class iterator {
+			row_view current;
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = row_view;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const row_view*;
+			using reference = const row_view&;
+
+			iterator() = default;
+
+			iterator(const rowset* s, size_t index) : current(s, index) {
+			}
+
+			reference operator*() const {
+				return current;
+			}
+
+			pointer operator->() const {
+				return &current;
+			}
+
+			iterator& operator++() {
+				++current.row_index;
+				return *this;
+			}
+
+			iterator operator++(int) {
+				iterator old = *this;
+				++*this;
+				return old;
+			}
+
+			bool operator==(const iterator& other) const {
+				return current.index() == other.current.index();
+			}
+		};
+
+		rowset() = default;
+
+		/**
+		 * Construct an empty rowset with known columns
+		 * @param columns shared column names
+		 * @param native_values true to store numeric fields as native values, see fetch_typed
+		 * @param storage arena to allocate the rows from, which the rowset keeps alive.
+		 * If null, the rows are allocated from the default heap.
+		 */
+		explicit rowset(std::shared_ptr<const column_list> columns, bool native_values = false, std::shared_ptr<std::pmr::memory_resource> storage = {})
+			: column_names(std::move(columns)), arena(std::move(storage)), values(resource()), offsets(1, 0, resource()), nulls(resource()), native(native_values) {
+		}
+
+		/**
+		 * Copy a rowset. The copy is allocated from the default heap, so that it
+		 * doesn't keep the other rowset's arena alive.
+		 * @param other rowset to copy
+		 */
+		rowset(const rowset& other) : column_names(other.column_names), values(other.values), offsets(other.offsets), nulls(other.nulls), row_count(other.row_count), native(other.native) {
+		}
+
+		/**
+		 * Move a rowset, along with its arena. The moved from rowset keeps a reference
+		 * to the arena too, as anything it allocates afterwards comes from there.
+		 * @param other rowset to move
+		 */
+		rowset(rowset&& other) noexcept : column_names(std::move(other.column_names)), arena(other.arena), values(std::move(other.values)), offsets(std::move(other.offsets)), nulls(std::move(other.nulls)), row_count(std::exchange(other.row_count, 0)), native(other.native) {
+		}
+
+		/**
+		 * Copy a rowset, see rowset(const rowset&)
+		 * @param other rowset to copy
+		 * @return this rowset
+		 */
+		rowset& operator=(const rowset& other) {
+			if (this != &other) {
+				*this = rowset(other);
+			}
+			return *this;
+		}
+
+		/**
+		 * Move a rowset, see rowset(rowset&&)
+		 * @param other rowset to move
+		 * @return this rowset
+		 */
+		rowset& operator=(rowset&& other) noexcept {
+			if (this != &other) {
+				/* Storage can't be moved into another arena, so replace the storage and its arena together */
+				std::destroy_at(this);
+				std::construct_at(this, std::move(other));
+			}
+			return *this;
+		}
+
+		/**
+		 * Returns true if numeric fields are stored as native values, see fetch_typed
+		 * @return true if fetched with fetch_typed
+		 */
+		[[nodiscard]] inline bool typed() const {
+			return native;
+		}
+
+		/**
+		 * Type of a column as stored in this rowset. Numeric columns are ct_text
+		 * unless the rowset stores native values.
+		 * @param c column index
+		 * @return column type as stored
+		 */
+		[[nodiscard]] inline column_type stored_type(size_t c) const {
+			column_type type = column_names->types[c];
+			return native || type == ct_blob ? type : ct_text;
+		}
+
+		/**
+		 * Get the stored bytes of a field, which for native numeric values are the value itself
+		 * @param r row index
+		 * @param c column index
+		 * @return stored bytes
+		 */
+		[[nodiscard]] inline std::string_view raw(size_t r, size_t c) const {
+			size_t i = r * column_count() + c;
+			return std::string_view(values.data() + offsets[i], offsets[i + 1] - offsets[i]);
+		}
+
+		/**
+		 * Returns true if a field is NULL
+		 * @param r row index
+		 * @param c column index
+		 * @return true if NULL
+		 */
+		[[nodiscard]] inline bool is_null(size_t r, size_t c) const {
+			return nulls[r * column_count() + c];
+		}
+
+		/**
+		 * Get the shared column names
+		 * @return column names, may be null if no columns are known
+		 */
+		[[nodiscard]] inline const std::shared_ptr<const column_list>& columns() const {
+			return column_names;
+		}
+
+		/**
+		 * Number of columns in each row
+		 * @return column count
+		 */
+		[[nodiscard]] inline size_t column_count() const {
+			return column_names ? column_names->names.size() : 0;
+		}
+
+		/**
+		 * Get a field value by row and column index, without range checking.
+		 * NULL fields, and native numeric fields, have no text and are empty.
+		 * @param r row index
+		 * @param c column index
+		 * @return field value
+		 */
+		[[nodiscard]] inline field value(size_t r, size_t c) const {
+			if (native && column_names->types[c] >= ct_int) {
+				return field();
+			}
+			return field(raw(r, c));
+		}
+
+		/**
+		 * Append one field value to the row currently being built. Once a value
+		 * has been appended for every column, the row is complete.
+		 * @param v field value, or for native numeric values the bytes of the value
+		 * @param null true if the field is NULL
+		 */
+		void append(std::string_view v, bool null = false);
+
+		/**
+		 * Reserve storage ahead of appending
+		 * @param rows number of rows
+		 * @param bytes total bytes of field values
+		 */
+		void reserve(size_t rows, size_t bytes);
+
+		/**
+		 * Push back a standalone row. Columns of the row which the rowset does not
+		 * yet have are added, with empty values in all previous rows.
+		 * @param r row
+		 */
+		void push_back(const row& r);
+
+		/**
+		 * Emplace a standalone row
+		 * @param r row
+		 */
+		inline void emplace_back(const row& r) {
+			push_back(r);
 		}
 
+		/**
+		 * Remove all rows, keeping the columns
+		 */
+		void clear();
+
 		/**
 		 * Get a row by index
 		 * @param index row to retrieve
 		 * @return row
 		 */
-		[[nodiscard]] inline const row& operator[] (size_t index) const {
-			return rows[index];
+		[[nodiscard]] inline row_view operator[] (size_t index) const {
+			return row_view(this, index);
 		}
 
 		/**
 		 * Get a row by index with range checking
 		 * @param index row to retrieve
 		 * @return row
+		 * @throw std::out_of_range row does not exist
 		 */
-		[[nodiscard]] inline const row& at(size_t index) const {
-			return rows.at(index);
+		[[nodiscard]] inline row_view at(size_t index) const {
+			if (index >= row_count) {
+				throw std::out_of_range("rowset::at: row index out of range");
+			}
+			return row_view(this, index);
 		}
 
 		/**
-		 * Emplace a new row
-		 * @param r row
+		 * Get the first row
+		 * @return row
 		 */
-		inline void emplace_back(const row& r) {
-			rows.emplace_back(r);
+		[[nodiscard]] inline row_view front() const {
+			return row_view(this, 0);
 		}
 
 		/**
-		 * Push back a new row
-		 * @param r row
+		 * Get the last row
+		 * @return row
 		 */
-		inline void push_back(const row& r) {
-			rows.push_back(r);
+		[[nodiscard]] inline row_view back() const {
+			return row_view(this, row_count - 1);
 		}
 
 		/**
@@ -105,8 +659,8 @@ namespace db {
 		 * for iteration
 		 * @return beginning of container
 		 */
-		[[nodiscard]] inline auto begin() const {
-			return rows.begin();
+		[[nodiscard]] inline iterator begin() const {
+			return iterator(this, 0);
 		}
 
 		/**
@@ -114,36 +668,386 @@ namespace db {
 		 * for iteration
 		 * @return end of container
 		 */
-		[[nodiscard]] inline auto end() const {
-			return rows.end();
+		[[nodiscard]] inline iterator end() const {
+			return iterator(this, row_count);
 		}
 
 		/**
-		 * True if the recordset is empty
+		 * True if there are no rows
 		 * @return true if empty
 		 */
 		[[nodiscard]] inline bool empty() const {
-			return rows.empty();
+			return row_count == 0;
 		}
 
 		/**
-		 * Number of rows in the recordset
+		 * Number of rows
 		 * @return row count
 		 */
 		[[nodiscard]] inline size_t size() const {
-			return rows.size();
+			return row_count;
+		}
+
+		/**
+		 * Approximate memory held by the rows, excluding the shared column names
+		 * @return size in bytes
+		 */
+		[[nodiscard]] inline size_t memory_usage() const {
+			return sizeof(*this) + values.capacity() + offsets.capacity() * sizeof(size_t) + nulls.capacity() / 8;
 		}
 	};
 
-	/**
-	 * @brief A callback which happens when an asynchronous SQL query is completed
-	 */
-	using sql_query_callback = std::function<void(const resultset&)>;
+	inline field row_view::operator[] (size_t column) const {
+		return set->value(row_index, column);
+	}
 
-	/**
-	 * @brief Possible parameter types for SQL parameters
+	inline field row_view::operator[] (std::string_view name) const {
+		size_t column = set->columns() ? set->columns()->find(name) : std::string_view::npos;
+		return column == std::string_view::npos ? field() : set->value(row_index, column);
+	}
+
+	inline field row_view::at(size_t column) const {
+		if (column >= set->column_count()) {
+			throw std::out_of_range("row_view::at: column index out of range");
+		}
+		return set->value(row_index, column);
+	}
+
+	inline field row_view::at(std::string_view name) const {
+		size_t column = set->columns() ? set->columns()->find(name) : std::string_view::npos;
+		if (column == std::string_view::npos) {
+			throw std::out_of_range("row_view::at: no such column: " + std::string(name));
+		}
+		return set->value(row_index, column);
+	}
+
+	inline bool row_view::contains(std::string_view name) const {
+		return set->columns() && set->columns()->find(name) != std::string_view::npos;
+	}
+
+	inline size_t row_view::size() const {
+		return set->column_count();
+	}
+
+	inline size_t row_view::column_index(std::string_view name) const {
+		size_t column = set->columns() ? set->columns()->find(name) : std::string_view::npos;
+		if (column == std::string_view::npos) {
+			throw std::out_of_range("row_view: no such column: " + std::string(name));
+		}
+		return column;
+	}
+
+	inline bool row_view::is_null(size_t column) const {
+		return set->is_null(row_index, column);
+	}
+
+	inline bool row_view::is_null(std::string_view name) const {
+		return is_null(column_index(name));
+	}
+
+	inline field_value row_view::value(size_t column) const {
+		if (is_null(column)) {
+			return nullptr;
+		}
+		switch (set->columns()->types[column]) {
+			case ct_int:
+				return get<int64_t>(column);
+			case ct_uint:
+				return get<uint64_t>(column);
+			case ct_real:
+				return get<double>(column);
+			case ct_blob:
+				return get<std::span<const std::byte>>(column);
+			default:
+				return get<std::string_view>(column);
+		}
+	}
+
+	template <typename T> T row_view::get(size_t column) const {
+		if constexpr (is_optional_v<T>) {
+			if (is_null(column)) {
+				return std::nullopt;
+			}
+			return get<typename T::value_type>(column);
+		} else {
+			if (is_null(column)) {
+				return T{};
+			}
+			std::string_view raw = set->raw(row_index, column);
+			column_type type = set->stored_type(column);
+			if constexpr (std::is_arithmetic_v<T>) {
+				switch (type) {
+					case ct_int:
+						return static_cast<T>(load<int64_t>(raw));
+					case ct_uint:
+						return static_cast<T>(load<uint64_t>(raw));
+					case ct_real:
+						return static_cast<T>(load<double>(raw));
+					default:
+						return parse<T>(raw);
+				}
+			} else if constexpr (std::is_same_v<T, std::string>) {
+				switch (type) {
+					case ct_int:
+						return format(load<int64_t>(raw));
+					case ct_uint:
+						return format(load<uint64_t>(raw));
+					case ct_real:
+						return format(load<double>(raw));
+					default:
+						return std::string(raw);
+				}
+			} else if constexpr (std::is_same_v<T, std::string_view> || std::is_same_v<T, field>) {
+				return T(set->value(row_index, column));
+			} else if constexpr (std::is_same_v<T, std::span<const std::byte>>) {
+				std::string_view text = set->value(row_index, column);
+				return std::span<const std::byte>(reinterpret_cast<const std::byte*>(text.data()), text.size());
+			} else {
+				static_assert(std::is_same_v<T, void>, "row_view::get: unsupported type");
+			}
+		}
+	}
+
+	/**
+	 * @brief Definition of a result set. Supports iteration and accessing its
+	 * rows via operator[] and at(). You can also insert new rows with emplace_back
+	 * and push_back().
+	 */
+	struct resultset {
+
+		/**
+		 * Row values
+		 */
+		rowset rows;
+
+		/**
+		 * Error message of last query or an empty string on success
+		 */
+		std::string error;
+
+		/**
+		 * Number of affected rows, if an UPDATE, DELETE, INSERT
+		 */
+		size_t affected_rows{};
+
+		/**
+		 * Returns true if the query succeeded
+		 * @return true if no error
+		 */
+		[[nodiscard]] inline bool ok() const {
+			return error.empty();
+		}
+
+		/**
+		 * Get a row by index
+		 * @param index row to retrieve
+		 * @return row
+		 */
+		[[nodiscard]] inline row_view operator[] (size_t index) const {
+			return rows[index];
+		}
+
+		/**
+		 * Get a row by index with range checking
+		 * @param index row to retrieve
+		 * @return row
+		 */
+		[[nodiscard]] inline row_view at(size_t index) const {
+			return rows.at(index);
+		}
+
+		/**
+		 * Emplace a new row
+		 * @param r row
+		 */
+		inline void emplace_back(const row& r) {
+			rows.emplace_back(r);
+		}
+
+		/**
+		 * Push back a new row
+		 * @param r row
+		 */
+		inline void push_back(const row& r) {
+			rows.push_back(r);
+		}
+
+		/**
+		 * Get the start iterator of the container,
+		 * for iteration
+		 * @return beginning of container
+		 */
+		[[nodiscard]] inline auto begin() const {
+			return rows.begin();
+		}
+
+		/**
+		 * Get the end iterator of the container,
+		 * for iteration
+		 * @return end of container
+		 */
+		[[nodiscard]] inline auto end() const {
+			return rows.end();
+		}
+
+		/**
+		 * True if the recordset is empty
+		 * @return true if empty
+		 */
+		[[nodiscard]] inline bool empty() const {
+			return rows.empty();
+		}
+
+		/**
+		 * Number of rows in the recordset
+		 * @return row count
+		 */
+		[[nodiscard]] inline size_t size() const {
+			return rows.size();
+		}
+	};
+
+	/**
+	 * @brief A callback which happens when an asynchronous SQL query is completed.
+	 * The resultset is moved into the callback, which may keep it without copying.
+	 * Callbacks taking `const resultset&` are still accepted.
+	 */
+	using sql_query_callback = std::function<void(resultset&&)>;
+
+	/**
+	 * @brief A callback which receives a result set shared with the result cache
+	 */
+	using sql_shared_query_callback = std::function<void(const std::shared_ptr<const resultset>&)>;
+
+	/**
+	 * @brief Source of a parameter sent to the server in chunks, see db::long_data().
+	 * It is called with the offset of the next chunk, and returns the bytes from there,
+	 * or an empty view once there are none left. The view must stay valid until the
+	 * source is called again. A query retried after a lost connection starts again
+	 * from offset 0.
+	 */
+	using long_data_source = std::function<std::string_view(size_t offset)>;
+
+	/**
+	 * @brief A string or blob parameter bound from storage which isn't copied, made by
+	 * db::borrow(), db::share() or db::long_data(). Unlike a std::string, it isn't copied
+	 * into the paramlist, the queued query, or the statement bindings.
+	 */
+	struct buffer_parameter {
+		/**
+		 * Start of the value, unless it comes from a source
+		 */
+		const char* data{nullptr};
+
+		/**
+		 * Length of the value in bytes, unless it comes from a source
+		 */
+		size_t length{0};
+
+		/**
+		 * Keeps shared storage alive, null for borrowed storage
+		 */
+		std::shared_ptr<const void> owner;
+
+		/**
+		 * If set, the value is read from the source in chunks rather than from data
+		 */
+		long_data_source source;
+
+		/**
+		 * If not 0, data is sent in chunks of this many bytes with mysql_stmt_send_long_data()
+		 * rather than as part of the execute packet, e.g. to stay below max_allowed_packet
+		 */
+		size_t chunk{0};
+
+		/**
+		 * True to bind as a BLOB, rather than as a string
+		 */
+		bool binary{false};
+
+		/**
+		 * True if the value is sent in chunks before the statement is executed
+		 */
+		[[nodiscard]] inline bool streamed() const {
+			return source || chunk > 0;
+		}
+
+		/**
+		 * Values are compared by content. Values from a source are never equal.
+		 */
+		bool operator==(const buffer_parameter& other) const {
+			return !source && !other.source && binary == other.binary && std::string_view(data, length) == std::string_view(other.data, other.length);
+		}
+	};
+
+	/**
+	 * @brief Pass a string parameter by reference. The string must outlive the query,
+	 * including while it waits in the queue, e.g. by living in the awaiting coroutine.
+	 *
+	 * @param text string value
+	 * @param chunk if not 0, send the value in chunks of this many bytes
+	 * @return parameter referring to the string
+	 */
+	inline buffer_parameter borrow(std::string_view text, size_t chunk = 0) {
+		return buffer_parameter{ .data = text.data(), .length = text.size(), .owner = {}, .source = {}, .chunk = chunk, .binary = false };
+	}
+
+	/**
+	 * @brief Pass a blob parameter by reference. The bytes must outlive the query,
+	 * including while it waits in the queue.
+	 *
+	 * @param bytes blob value
+	 * @param chunk if not 0, send the value in chunks of this many bytes
+	 * @return parameter referring to the bytes
+	 */
+	inline buffer_parameter borrow(std::span<const std::byte> bytes, size_t chunk = 0) {
+		return buffer_parameter{ .data = reinterpret_cast<const char*>(bytes.data()), .length = bytes.size(), .owner = {}, .source = {}, .chunk = chunk, .binary = true };
+	}
+
+	/**
+	 * @brief Pass a string parameter by shared ownership, which keeps it alive
+	 * for as long as the query, or a cached result of it, needs it
+	 *
+	 * @param text string value
+	 * @param chunk if not 0, send the value in chunks of this many bytes
+	 * @return parameter sharing the string
 	 */
-	using parameter_type = std::variant<float, std::string, uint64_t, int64_t, bool, int32_t, uint32_t, double>;
+	inline buffer_parameter share(std::shared_ptr<const std::string> text, size_t chunk = 0) {
+		return buffer_parameter{ .data = text->data(), .length = text->size(), .owner = std::move(text), .source = {}, .chunk = chunk, .binary = false };
+	}
+
+	/**
+	 * @brief Pass a blob parameter by shared ownership, which keeps it alive
+	 * for as long as the query, or a cached result of it, needs it
+	 *
+	 * @param bytes blob value
+	 * @param chunk if not 0, send the value in chunks of this many bytes
+	 * @return parameter sharing the bytes
+	 */
+	inline buffer_parameter share(std::shared_ptr<const std::vector<std::byte>> bytes, size_t chunk = 0) {
+		return buffer_parameter{ .data = reinterpret_cast<const char*>(bytes->data()), .length = bytes->size(), .owner = std::move(bytes), .source = {}, .chunk = chunk, .binary = true };
+	}
+
+	/**
+	 * @brief Pass a parameter which is read from a source in chunks, and sent with
+	 * mysql_stmt_send_long_data(), so that it never has to be held in memory whole.
+	 * The source must stay callable until the query completes. Queries with such a
+	 * parameter run on the worker threads, never on the non-blocking engine.
+	 *
+	 * @param source called for each chunk of the value
+	 * @param binary true to bind as a BLOB, false to bind as a string
+	 * @return parameter reading from the source
+	 */
+	inline buffer_parameter long_data(long_data_source source, bool binary = true) {
+		return buffer_parameter{ .data = nullptr, .length = 0, .owner = {}, .source = std::move(source), .chunk = 0, .binary = binary };
+	}
+
+	/**
+	 * @brief Possible parameter types for SQL parameters.
+	 * Each is bound to the statement in its native MySQL type. Pass nullptr to bind NULL.
+	 * Large strings and blobs can be passed without copying them as a buffer_parameter.
+	 */
+	using parameter_type = std::variant<float, std::string, uint64_t, int64_t, bool, int32_t, uint32_t, double, std::nullptr_t, buffer_parameter>;
 
 	/**
 	 * @brief A list of database query parameters.
@@ -152,9 +1056,178 @@ namespace db {
 	using paramlist = std::vector<parameter_type>;
 
 	/**
-	 * @brief Initialise database connection
+	 * @brief How the columns of a result set are fetched
+	 */
+	enum fetch_mode : uint8_t {
+		/**
+		 * Every column is fetched as text. This is the default.
+		 */
+		fetch_text,
+		/**
+		 * Integer and floating point columns are fetched into native buffers and
+		 * stored without conversion to text. Read them with row_view::get() or
+		 * row_view::value(), as they have no text for operator[] to return.
+		 */
+		fetch_typed,
+	};
+
+	/**
+	 * @brief Queue lanes of asynchronous queries, from most to least urgent.
+	 * How workers choose between lanes is set by the "lanes" configuration.
+	 */
+	enum query_lane : uint8_t {
+		/**
+		 * Queries a user is waiting on, e.g. replying to an interaction. This is the default.
+		 */
+		lane_interactive,
+		/**
+		 * Work which should happen soon, but which nobody is waiting on, e.g. cache warming
+		 */
+		lane_background,
+		/**
+		 * Large or low value work, e.g. analytics writes and nightly syncs
+		 */
+		lane_bulk,
+		/**
+		 * Number of lanes
+		 */
+		lane_count,
+	};
+
+	/**
+	 * @brief Per-query options
+	 */
+	struct query_options {
+		/**
+		 * How result columns are fetched
+		 */
+		fetch_mode fetch{fetch_text};
+
+		/**
+		 * Queue lane of an asynchronous query. Synchronous queries don't queue.
+		 */
+		query_lane lane{lane_interactive};
+
+		/**
+		 * Run on the primary even if the query is a read and replicas are configured,
+		 * e.g. to read back a row just written without waiting for replication
+		 */
+		bool primary{false};
+
+		/**
+		 * Longest the query may run for. The server stops it once the time is up,
+		 * and it fails with an error. Zero uses the `statement_timeout` of the
+		 * configuration, which is 3000 milliseconds unless set.
+		 */
+		std::chrono::milliseconds timeout{0};
+
+		/**
+		 * Time by which the query must have finished, e.g. the deadline of the request
+		 * it serves. A queued query still waiting at its deadline fails without running,
+		 * and a running one is limited to the time left. Unset is no deadline.
+		 */
+		std::chrono::steady_clock::time_point deadline{};
+	};
+
+	class query_key;
+
+	/**
+	 * @brief Intern an SQL statement, returning a handle to it
+	 *
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @return handle which can be passed to db::query() and db::co_query() in place of the string
+	 */
+	query_key intern(const std::string& format);
+
+	/**
+	 * @brief Prepare statements ahead of their first use on every connection of the
+	 * database, in parallel, so that the first queries don't each wait for a prepare.
+	 * Replica connections only prepare the reads. Connections in use at the time
+	 * prepare the statements when they are first used, as usual.
+	 *
+	 * @param statements Format strings, exactly as they will be queried
+	 * @return true if every statement was prepared on every idle connection,
+	 * otherwise the errors are logged
+	 */
+	bool prepare(const std::vector<std::string>& statements);
+
+	/**
+	 * @brief A handle to an interned SQL statement, returned by db::intern().
+	 * Running a query through a handle skips hashing and comparing the SQL text:
+	 * each connection finds its cached prepared statement by the handle's index.
+	 * Handles are cheap to copy and remain valid for the lifetime of the process.
+	 *
+	 * For example:
+	 *
+	 * ```cpp
+	 * 	static const db::query_key get_user = db::intern("SELECT * FROM users WHERE id = ?");
+	 * 	auto rs = db::query(get_user, { user_id });
+	 * ```
+	 */
+	class query_key {
+		friend query_key intern(const std::string& format);
+
+		size_t index{0};
+		const std::string* text{nullptr};
+		bool read{false};
+
+		query_key(size_t i, const std::string* t, bool r);
+
+	public:
+		/**
+		 * Construct an empty handle, which refers to no statement
+		 */
+		query_key() = default;
+
+		/**
+		 * Index of the statement, unique within the process
+		 * @return statement index
+		 */
+		[[nodiscard]] inline size_t id() const {
+			return index;
+		}
+
+		/**
+		 * SQL text of the statement
+		 * @return statement text
+		 */
+		[[nodiscard]] inline const std::string& sql() const {
+			static const std::string empty;
+			return text ? *text : empty;
+		}
+
+		/**
+		 * True if the statement returns rows, by its first keyword
+		 * @return true for SELECT, SHOW, DESCRIBE and EXPLAIN
+		 */
+		[[nodiscard]] inline bool reads() const {
+			return read;
+		}
+
+		/**
+		 * True if the handle refers to a statement
+		 */
+		explicit inline operator bool() const {
+			return text != nullptr;
+		}
+	};
+
+	/**
+	 * @brief Initialise database connection pool
 	 * 
 	 * @param bot creating D++ cluster
+	 *
+	 * @note The number of pooled connections, and worker threads serving query_callback
+	 * and co_query, is read from the optional `pool_size` value of the `database`
+	 * configuration block. It defaults to 1. If `async_connections` is set, and the
+	 * MariaDB non-blocking API is available, that many more connections are driven
+	 * from the D++ socket engine, and queued queries run on those instead. Reads
+	 * are sent to the optional `replicas`, chosen by `replica_policy`, see README.md.
+	 * Statements are limited to `statement_timeout` milliseconds, 3000 unless set.
+	 * Connections are opened in parallel, each retried `connect_retries` times (3
+	 * unless set) with a backoff, and the program exits if the primary can't be
+	 * reached. The statements of `prepare`, and of the lines of `prepare_file`, are
+	 * prepared on every connection before init() returns.
 	 */
 	void init (dpp::cluster& bot);
 
@@ -167,17 +1240,20 @@ namespace db {
 	 * @param db Database schema name
 	 * @param port Database port number
 	 * @param socket unix socket path
-	 * @return True if the database connection succeeded
+	 * @param pool_size Number of connections to open. Queries are dispatched to whichever connection is free.
+	 * @return True if the database connection succeeded. If any connection of the pool fails, none are kept open.
+	 * The connections are opened in parallel, and each is retried with a backoff, see init().
 	 * 
 	 * @note Unix socket and port number are mutually exclusive. If you set socket to a non-empty string,
 	 * you should set port to 0 and host to `localhost`. This is a special value in the mysql client and
 	 * causes a unix socket connection to occur. If you do not want to use unix sockets, keep the value
 	 * as an empty string.
 	 */
-	bool connect(const std::string &host, const std::string &user, const std::string &pass, const std::string &db, int port = 3306, const std::string& socket = "");
+	bool connect(const std::string &host, const std::string &user, const std::string &pass, const std::string &db, int port = 3306, const std::string& socket = "", size_t pool_size = 1);
 
 	/**
-	 * @brief Disconnect from database and free query cache
+	 * @brief Disconnect from database and free query cache. Deltas buffered by
+	 * accumulate() are written first.
 	 * 
 	 * @return true on successful disconnection
 	 */
@@ -188,6 +1264,7 @@ namespace db {
 	 * 
 	 * @param format Format string, where each parameter should be indicated by a ? symbol
 	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
 	 * @return result set
 	 * 
 	 * The parameters given should be a vector of strings. You can instantiate this using "{}".
@@ -198,9 +1275,21 @@ namespace db {
 	 * 
 	 * ```cpp
 	 * 	db::query("UPDATE foo SET bar = ? WHERE id = ?", { "baz", 3 });
+	 * 	auto rs = db::query("SELECT id FROM foo", {}, { .fetch = db::fetch_typed });
+	 * 	uint64_t id = rs[0].get<uint64_t>("id");
 	 * ```
 	 */
-	resultset query(const std::string &format, const paramlist &parameters = {});
+	resultset query(const std::string &format, const paramlist &parameters = {}, const query_options& options = {});
+
+	/**
+	 * @brief Run a mysql query through an interned statement handle, see db::intern()
+	 * 
+	 * @param key Interned statement
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
+	 * @return result set
+	 */
+	resultset query(const query_key& key, const paramlist &parameters = {}, const query_options& options = {});
 
 	/**
 	 * @brief Run a mysql query asynchronously, with automatic escaping of parameters
@@ -210,6 +1299,7 @@ namespace db {
 	 * @param parameters Parameters to prepare into the query in place of the ?'s
 	 * @param cb Callback to call on completion of the query. The callback will be passed
 	 * the resultset as its parameter.
+	 * @param options Per-query options
 	 *
 	 * The parameters given should be a vector of strings. You can instantiate this using "{}".
 	 * The queries are cached as prepared statements and therefore do not need quote symbols
@@ -218,7 +1308,17 @@ namespace db {
 	 * @note If you can you should use co_query instead to avoid callback hell. co_query uses this
 	 * internally, wrapping it with dpp::async<>.
 	 */
-	void query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb);
+	void query_callback(const std::string &format, paramlist parameters, sql_query_callback cb, const query_options& options = {});
+
+	/**
+	 * @brief Run a mysql query asynchronously through an interned statement handle, see db::intern()
+	 *
+	 * @param key Interned statement
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param cb Callback to call on completion of the query
+	 * @param options Per-query options
+	 */
+	void query_callback(const query_key& key, paramlist parameters, sql_query_callback cb, const query_options& options = {});
 
 #ifdef DPP_CORO
 	/**
@@ -228,13 +1328,15 @@ namespace db {
 	 *
 	 * @param format Format string, where each parameter should be indicated by a ? symbol
 	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
 	 * @return dpp::async which you can co_await to get the result set.
 	 *
 	 * @note It is the nature of asynchronous APIs like this that they cannot be atomic. Therefore
 	 * do not combine transactions with asynchronous co_query. If you do, other queries may end up
 	 * muddled into your transaction. This wrapper ensures the correct order of statements passed to
 	 * co_query from the same origin thread, however statements from other threads, or statements via
-	 * db::query() instead are not queued. Pick one interface, or the other!
+	 * db::query() instead are not queued. Pick one interface, or the other! Ordering is only guaranteed
+	 * when the connection pool size is 1, larger pools run queued statements concurrently.
 	 *
 	 * The parameters given should be a vector of strings. You can instantiate this using "{}".
 	 * The queries are cached as prepared statements and therefore do not need quote symbols
@@ -246,104 +1348,1442 @@ namespace db {
 	 * 	auto rs = co_await db::co_query("SELECT * FROM bigtable WHERE bar = ?", { "baz" });
 	 * ```
 	 */
-	dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters = {});
+	dpp::async<resultset> co_query(const std::string &format, paramlist parameters = {}, const query_options& options = {});
+
+	/**
+	 * @brief Run a mysql query as a coroutine through an interned statement handle, see db::intern()
+	 *
+	 * @param key Interned statement
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options
+	 * @return dpp::async which you can co_await to get the result set.
+	 */
+	dpp::async<resultset> co_query(const query_key& key, paramlist parameters = {}, const query_options& options = {});
 #endif
 
 	/**
-	 * @brief Run a mysql query, with automatic escaping of parameters to prevent SQL injection.
-	 * 
+	 * @brief Called with each chunk of rows of a streamed query. The rowset is reused
+	 * for the next chunk once the callback returns, so copy out anything to be kept.
+	 * Return false to stop the query, discarding the rest of its rows.
+	 */
+	using sql_chunk_callback = std::function<bool(const rowset&)>;
+
+	/**
+	 * @brief Options of a streamed query
+	 */
+	struct stream_options {
+		/**
+		 * Number of rows passed to each call of the chunk callback. The last chunk may be smaller.
+		 */
+		size_t chunk_rows{1000};
+
+		/**
+		 * If true, the rows are read from a read only server side cursor, prefetching
+		 * chunk_rows rows at a time, rather than streamed as the server sends them.
+		 * The server materialises the result in a temporary table first.
+		 */
+		bool server_cursor{false};
+	};
+
+	/**
+	 * @brief Run a query, passing its rows to a callback in chunks rather than returning
+	 * them, so that memory use stays flat however large the result is.
+	 *
 	 * @param format Format string, where each parameter should be indicated by a ? symbol
 	 * @param parameters Parameters to prepare into the query in place of the ?'s
-	 * @param lifetime How long to cache this query's resultset in memory for
-	 * @return result set
+	 * @param on_chunk Callback to call with each chunk of rows
+	 * @param stream Chunk size and cursor options
+	 * @param options Per-query options
+	 * @return result set with no rows, holding any error
 	 *
-	 * @note If the query is already cached in memory, the cached resultset will be returned instead
-	 * of querying the database.
-	 * 
-	 * The parameters given should be a vector of strings. You can instantiate this using "{}".
-	 * The queries are cached as prepared statements and therefore do not need quote symbols
-	 * to be placed around parameters in the query. These will be automatically added if required.
+	 * @note The connection is held until the last row has been handled, so keep
+	 * the chunk callback quick. It is called on the thread running the query.
+	 *
+	 * ```cpp
+	 * 	db::query_stream("SELECT * FROM messages WHERE guild_id = ?", { guild_id }, [&out](const db::rowset& rows) {
+	 * 		for (const auto& row : rows) {
+	 * 			out << row["content"] << "\n";
+	 * 		}
+	 * 		return true;
+	 * 	});
+	 * ```
 	 */
-	resultset query(const std::string &format, const paramlist &parameters, double lifetime);
+	resultset query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream = {}, const query_options& options = {});
 
 	/**
-	 * @brief Returns number of affected rows from an UPDATE, INSERT, DELETE
-	 * 
-	 * @note This value is by any db::query() call. Take a copy!
-	 * @return size_t Number of affected rows
-	 * @deprecated This is not coroutine-safe and you should use resultset::affected_rows instead
+	 * @brief Run a streamed query asynchronously, see db::query_stream().
+	 * The chunk callback and then the completion callback are called on a worker thread.
+	 *
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param on_chunk Callback to call with each chunk of rows
+	 * @param cb Callback to call once the query has completed
+	 * @param stream Chunk size and cursor options
+	 * @param options Per-query options
 	 */
-	[[deprecated("Use resultset::affected_rows instead")]] size_t affected_rows();
+	void query_stream_callback(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const sql_query_callback& cb, const stream_options& stream = {}, const query_options& options = {});
 
+#ifdef DPP_CORO
 	/**
-	 * @brief Returns the last error string.
-	 * 
-	 * @note This value is by any db::query() call. Take a copy!
-	 * @return const std::string& Error mesage
-	 * @deprecated This is not coroutine-safe and you should use resultset::error instead
+	 * @brief Run a streamed query as a coroutine, see db::query_stream().
+	 * The chunk callback is called on a worker thread.
+	 *
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param on_chunk Callback to call with each chunk of rows
+	 * @param stream Chunk size and cursor options
+	 * @param options Per-query options
+	 * @return dpp::async which completes once the last chunk has been handled
 	 */
-	[[deprecated("Use resultset::error instead")]] const std::string& error();
+	dpp::async<resultset> co_query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream = {}, const query_options& options = {});
+#endif
 
 	/**
-	 * @brief Returns the size of the query cache
-	 * 
-	 * Prepared statement handles are stored in a std::map along with their metadata, so that
-	 * they don't have to be re-prepared if they are executed repeatedly. This is a diagnostic
-	 * and informational function which returns the size of that map.
-	 * 
-	 * @return size_t Cache size
+	 * @brief A result column bound to a member of a struct, made by db::column()
+	 *
+	 * @tparam T struct
+	 * @tparam M type of the member
 	 */
-	size_t cache_size();
+	template <typename T, typename M> struct column_binding {
+		using type = M;
+
+		/**
+		 * Column name
+		 */
+		std::string_view name;
+
+		/**
+		 * Member the column is stored in
+		 */
+		M T::* member;
+	};
 
 	/**
-	 * @brief Returns total number of queries executed since connection was established
-	 * 
-	 * @return size_t Query counter
+	 * @brief Detect types which refer to a field's storage rather than own it, for db::column()
 	 */
-	size_t query_count();
+	template <typename M> inline constexpr bool is_view_v = std::is_same_v<M, std::string_view> || std::is_same_v<M, field> || std::is_same_v<M, std::span<const std::byte>>;
+	template <typename M> inline constexpr bool is_view_v<std::optional<M>> = is_view_v<M>;
 
 	/**
-	 * @brief Start an SQL transaction.
-	 * SQL transactions are atomic in nature, ALL other queries will be forced
-	 * to wait. The transaction will be inserted into the queue to run as one atomic
-	 * operation, meaning that db::co_query cannot disrupt it or insert queries in
-	 * the middle of it, and db::query function calls that are not within the closure
-	 * will be forced to wait.
+	 * @brief Bind a result column to a member of a struct, for db::query_as(). The member
+	 * can be of any type row_view::get() supports which owns its value, or a std::optional
+	 * of one, to tell NULL apart.
 	 *
-	 * @param closure The transactional code to execute.
-	 * @param callback Callback to call when the transaction completes
+	 * @param name column name
+	 * @param member pointer to the member
+	 * @return column binding
+	 */
+	template <typename T, typename M> constexpr column_binding<T, M> column(std::string_view name, M T::* member) {
+		static_assert(!is_view_v<M>, "db::column: a member must own its value, the rows it is fetched from are reused");
+		return column_binding<T, M>{ .name = name, .member = member };
+	}
+
+	/**
+	 * @brief A struct which db::query_as() can fetch rows into. It lists its columns in a
+	 * static constexpr tuple of db::column() named columns:
 	 *
-	 * @note The closure should only ever execute queries using db::query(),
-	 * it should NOT use async queries/co_query() as these cannot be executed
-	 * atomically.
-	 * Returning false from the closure, or throwing any exception at all
-	 * will roll back the transaction, else it will be committed when the
-	 * closure ends.
-	 * @warning The coroutine will execute asynchronously in a different thread.
-	 * You should use the callback to be notified when it completes. The resultset
-	 * passed as the parameter will be empty.
+	 * ```cpp
+	 * 	struct guild_settings {
+	 * 		uint64_t guild_id;
+	 * 		std::string prefix;
+	 * 		std::optional<uint64_t> log_channel;
+	 * 		static constexpr auto columns = std::tuple{
+	 * 			db::column("guild_id", &guild_settings::guild_id),
+	 * 			db::column("prefix", &guild_settings::prefix),
+	 * 			db::column("log_channel", &guild_settings::log_channel),
+	 * 		};
+	 * 	};
+	 * ```
 	 */
-	void transaction(std::function<bool()> closure, sql_query_callback callback = {});
+	template <typename T> concept mapped_row = std::is_default_constructible_v<T> && requires {
+		std::tuple_size<std::remove_cvref_t<decltype(T::columns)>>::value;
+	};
+
+	/**
+	 * @brief Rows fetched into structs by db::query_as()
+	 *
+	 * @tparam T struct, see db::mapped_row
+	 */
+	template <mapped_row T> struct mapped_resultset {
+		/**
+		 * Row values
+		 */
+		std::vector<T> rows;
+
+		/**
+		 * Error message of the query or an empty string on success
+		 */
+		std::string error;
+
+		/**
+		 * Returns true if the query succeeded
+		 * @return true if no error
+		 */
+		[[nodiscard]] inline bool ok() const {
+			return error.empty();
+		}
+
+		/**
+		 * Get a row by index
+		 * @param index row to retrieve
+		 * @return row
+		 */
+		[[nodiscard]] inline const T& operator[] (size_t index) const {
+			return rows[index];
+		}
+
+		/**
+		 * Get the start iterator of the rows
+		 * @return beginning of rows
+		 */
+		[[nodiscard]] inline auto begin() const {
+			return rows.begin();
+		}
+
+		/**
+		 * Get the end iterator of the rows
+		 * @return end of rows
+		 */
+		[[nodiscard]] inline auto end() const {
+			return rows.end();
+		}
+
+		/**
+		 * True if there are no rows
+		 * @return true if empty
+		 */
+		[[nodiscard]] inline bool empty() const {
+			return rows.empty();
+		}
+
+		/**
+		 * Number of rows
+		 * @return row count
+		 */
+		[[nodiscard]] inline size_t size() const {
+			return rows.size();
+		}
+	};
+
+	/**
+	 * @brief A callback which receives the rows of db::query_as_callback()
+	 */
+	template <mapped_row T> using sql_mapped_query_callback = std::function<void(mapped_resultset<T>&&)>;
+
+	/**
+	 * @brief Stores the chunks of a streamed query into structs. The columns are looked up
+	 * by name once per statement, rather than once per field.
+	 *
+	 * @tparam T struct, see db::mapped_row
+	 */
+	template <mapped_row T> class row_mapper {
+		/**
+		 * Column index of each binding of T::columns
+		 */
+		std::array<size_t, std::tuple_size_v<std::remove_cvref_t<decltype(T::columns)>>> indexes{};
+
+		/**
+		 * Columns the indexes were found in
+		 */
+		const column_list* resolved{nullptr};
+
+	public:
+		/**
+		 * Set if a column of T is missing from the result
+		 */
+		std::string error;
+
+		/**
+		 * Append a chunk of rows
+		 * @param rows chunk of a streamed query
+		 * @param out receives a struct for each row
+		 * @return false if a column is missing, stopping the query
+		 */
+		bool append(const rowset& rows, std::vector<T>& out) {
+			if (rows.columns().get() != resolved) {
+				auto find = [&](std::string_view name) {
+					size_t index = rows.columns() ? rows.columns()->find(name) : std::string_view::npos;
+					if (index == std::string_view::npos && error.empty()) {
+						error = "query_as: no such column: " + std::string(name);
+					}
+					return index;
+				};
+				std::apply([&](const auto&... binding) {
+					size_t i{0};
+					((indexes[i++] = find(binding.name)), ...);
+				}, T::columns);
+				if (!error.empty()) {
+					return false;
+				}
+				resolved = rows.columns().get();
+			}
+			out.reserve(out.size() + rows.size());
+			for (const row_view& r : rows) {
+				T& item = out.emplace_back();
+				size_t i{0};
+				std::apply([&](const auto&... binding) {
+					((item.*(binding.member) = r.template get<typename std::remove_cvref_t<decltype(binding)>::type>(indexes[i++])), ...);
+				}, T::columns);
+			}
+			return true;
+		}
+	};
+
+	/**
+	 * @brief Run a streamed query into structs, for db::query_as() and database::query_as()
+	 *
+	 * @tparam T struct, see db::mapped_row
+	 * @param run function running the query, given the chunk callback, returning its resultset
+	 * @return the rows, or an error
+	 */
+	template <mapped_row T, typename F> mapped_resultset<T> run_mapped(F&& run) {
+		mapped_resultset<T> rv;
+		row_mapper<T> mapper;
+		resultset rs = run([&](const rowset& rows) {
+			return mapper.append(rows, rv.rows);
+		});
+		rv.error = rs.error.empty() ? mapper.error : rs.error;
+		if (!rv.error.empty()) {
+			rv.rows.clear();
+		}
+		return rv;
+	}
+
+	/**
+	 * @brief Run a streamed query into structs asynchronously, for db::query_as_callback()
+	 * and database::query_as_callback()
+	 *
+	 * @tparam T struct, see db::mapped_row
+	 * @param run function queueing the query, given the chunk callback and its completion callback
+	 * @param cb Callback to call with the rows
+	 */
+	template <mapped_row T, typename F> void run_mapped_callback(F&& run, const sql_mapped_query_callback<T>& cb) {
+		auto rv = std::make_shared<mapped_resultset<T>>();
+		auto mapper = std::make_shared<row_mapper<T>>();
+		run([rv, mapper](const rowset& rows) {
+			return mapper->append(rows, rv->rows);
+		}, [rv, mapper, cb](resultset&& rs) {
+			rv->error = rs.error.empty() ? mapper->error : rs.error;
+			if (!rv->error.empty()) {
+				rv->rows.clear();
+			}
+			if (cb) {
+				cb(std::move(*rv));
+			}
+		});
+	}
+
+	/**
+	 * @brief Run a mysql query, fetching its rows straight into structs. Columns are
+	 * fetched as native values, and each row is stored into a T as it is fetched, without
+	 * a resultset of the whole result being built, or a column being looked up per field.
+	 *
+	 * @tparam T struct listing its columns, see db::mapped_row
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options. The fetch mode is always fetch_typed.
+	 * @return the rows, or an error, such as a column of T missing from the result
+	 *
+	 * @note The rows are fetched in chunks of a streamed query, see query_stream().
+	 *
+	 * ```cpp
+	 * 	auto settings = db::query_as<guild_settings>("SELECT * FROM guild_settings WHERE guild_id = ?", { guild_id });
+	 * 	for (const guild_settings& s : settings) {
+	 * 		...
+	 * 	}
+	 * ```
+	 */
+	template <mapped_row T> mapped_resultset<T> query_as(const std::string &format, const paramlist &parameters = {}, query_options options = {}) {
+		options.fetch = fetch_typed;
+		return run_mapped<T>([&](const sql_chunk_callback& on_chunk) {
+			return query_stream(format, parameters, on_chunk, {}, options);
+		});
+	}
+
+	/**
+	 * @brief Run a mysql query asynchronously, fetching its rows into structs, see db::query_as()
+	 *
+	 * @tparam T struct listing its columns, see db::mapped_row
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param cb Callback to call with the rows
+	 * @param options Per-query options. The fetch mode is always fetch_typed.
+	 */
+	template <mapped_row T> void query_as_callback(const std::string &format, const paramlist &parameters, const sql_mapped_query_callback<T>& cb, query_options options = {}) {
+		options.fetch = fetch_typed;
+		run_mapped_callback<T>([&](const sql_chunk_callback& on_chunk, const sql_query_callback& done) {
+			query_stream_callback(format, parameters, on_chunk, done, {}, options);
+		}, cb);
+	}
 
 #ifdef DPP_CORO
 	/**
-	 * @brief Start an SQL transaction in a coroutine that can be awaited.
-	 * SQL transactions are atomic in nature, ALL other queries will be forced
-	 * to wait. The transaction will be inserted into the queue to run as one atomic
-	 * operation, meaning that db::co_query cannot disrupt it or insert queries in
-	 * the middle of it, and db::query function calls that are not within the closure
-	 * will be forced to wait.
+	 * @brief Run a mysql query as a coroutine, fetching its rows into structs, see db::query_as()
 	 *
-	 * @param closure The transactional code to execute.
-	 * @return Awaitable, returns an empty resultset on completion of transaction
+	 * @tparam T struct listing its columns, see db::mapped_row
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param options Per-query options. The fetch mode is always fetch_typed.
+	 * @return dpp::async which you can co_await to get the rows
+	 */
+	template <mapped_row T> dpp::async<mapped_resultset<T>> co_query_as(const std::string &format, const paramlist &parameters = {}, const query_options& options = {}) {
+		return dpp::async<mapped_resultset<T>>{ [format, parameters, options] <typename C> (C &&cc) { return query_as_callback<T>(format, parameters, std::forward<C>(cc), options); }};
+	}
+#endif
+
+	/**
+	 * @brief Run one statement for many sets of parameters, e.g. a bulk INSERT, holding
+	 * a single connection for the whole batch.
 	 *
-	 * @note The closure should only ever execute queries using db::query(),
-	 * it should NOT use async queries/co_query() as these cannot be executed
-	 * atomically.
-	 * Returning false from the closure, or throwing any exception at all
-	 * will roll back the transaction, else it will be committed when the
-	 * closure ends.
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameter_sets One paramlist for each execution of the statement
+	 * @param options Per-query options
+	 * @return result set with the total affected rows of the batch, or the first error.
+	 * A batch which fails part way through is not rolled back, run it in a transaction
+	 * if it must be all or nothing.
+	 *
+	 * @note An INSERT or REPLACE whose placeholders all lie within one VALUES (...) row
+	 * is rewritten to insert many rows per round trip, so that it is prepared and sent
+	 * once per up to 1024 rows. Any other statement is executed once per parameter set.
+	 * The statement should not return rows.
+	 *
+	 * ```cpp
+	 * 	db::query_batch("INSERT INTO log (user_id, message) VALUES (?, ?)", { { 1, "foo" }, { 2, "bar" } });
+	 * ```
 	 */
-	dpp::async<resultset> co_transaction(std::function<bool()> closure);
+	resultset query_batch(const std::string &format, const std::vector<paramlist> &parameter_sets, const query_options& options = {});
+
+	/**
+	 * @brief Run a batch asynchronously, see db::query_batch()
+	 *
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameter_sets One paramlist for each execution of the statement
+	 * @param cb Callback to call on completion of the batch
+	 * @param options Per-query options
+	 */
+	void query_batch_callback(const std::string &format, std::vector<paramlist> parameter_sets, const sql_query_callback& cb, const query_options& options = {});
+
+#ifdef DPP_CORO
+	/**
+	 * @brief Run a batch as a coroutine, see db::query_batch()
+	 *
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameter_sets One paramlist for each execution of the statement
+	 * @param options Per-query options
+	 * @return dpp::async which you can co_await to get the result set.
+	 */
+	dpp::async<resultset> co_query_batch(const std::string &format, std::vector<paramlist> parameter_sets, const query_options& options = {});
 #endif
+
+	/**
+	 * @brief An amount added by accumulate(). Whole deltas are summed exactly, and a
+	 * key's sum becomes a double once any of its deltas is.
+	 */
+	using accumulate_delta = std::variant<int64_t, double>;
+
+	/**
+	 * @brief Add to a counter without a round trip. Deltas for the same statement and
+	 * key are summed in memory, and written behind as one multi-row insert per statement,
+	 * with the key's parameters followed by the sum of its deltas.
+	 *
+	 * @param format An INSERT ... VALUES (...) ON DUPLICATE KEY UPDATE, with every
+	 * placeholder in the row, and the row's last placeholder taking the delta. Any
+	 * other statement is rejected, and an error logged.
+	 * @param key Parameters identifying the row, in place of all but the last ?
+	 * @param delta Amount to add
+	 *
+	 * @note Buffered deltas are written when the `accumulate_interval` setting's number
+	 * of seconds has passed (1 unless set), when `accumulate_keys` distinct keys (10000
+	 * unless set) are waiting, on flush_accumulated(), and on close(). Until then they
+	 * are not visible to queries, and if the process dies they are lost. A flush which
+	 * fails is logged and not retried, so a failed write is never applied twice.
+	 *
+	 * ```cpp
+	 * 	db::accumulate("INSERT INTO stats (guild_id, messages) VALUES (?, ?) ON DUPLICATE KEY UPDATE messages = messages + VALUES(messages)", { guild_id }, 1);
+	 * ```
+	 *
+	 * @warning `UPDATE stats SET messages = messages + ? WHERE guild_id = ?` is not accepted.
+	 * Its delta is not the last placeholder, so binding the key first would add the guild
+	 * ID to the row whose guild_id is the delta.
+	 */
+	void accumulate(const std::string &format, const paramlist &key, accumulate_delta delta);
+
+	/**
+	 * @brief Write every delta buffered by accumulate(), and wait for the writes
+	 */
+	void flush_accumulated();
+
+	/**
+	 * @brief One statement of a multi-statement query, see db::query_multi()
+	 */
+	struct query_statement {
+		/**
+		 * Format string, where each parameter should be indicated by a ? symbol
+		 */
+		std::string format;
+
+		/**
+		 * Parameters to insert in place of the ?'s
+		 */
+		paramlist parameters;
+	};
+
+	/**
+	 * @brief Definition of a callback function type for multi-statement queries
+	 */
+	using sql_multi_query_callback = std::function<void(std::vector<resultset>&&)>;
+
+	/**
+	 * @brief Run several statements in one round trip to the database, e.g. the
+	 * independent SELECTs which make up a page, returning one result set for each.
+	 *
+	 * @param statements Statements to run, in order
+	 * @param options Per-query options
+	 * @return one result set per statement, in the same order. If a statement fails,
+	 * the statements after it are not run, and their result sets carry an error too.
+	 *
+	 * @note Prepared statements can only hold a single statement, so the statements
+	 * are sent together as text. Each parameter is escaped by the client library for
+	 * the connection's character set, and placed where its ? was. Affected rows are
+	 * counted per statement. Statements are not run in a transaction unless the call
+	 * is made inside one.
+	 *
+	 * ```cpp
+	 * 	auto results = db::query_multi({
+	 * 		{ "SELECT * FROM users WHERE id = ?", { user_id } },
+	 * 		{ "SELECT * FROM guilds WHERE owner_id = ?", { user_id } },
+	 * 	});
+	 * ```
+	 */
+	std::vector<resultset> query_multi(const std::vector<query_statement> &statements, const query_options& options = {});
+
+	/**
+	 * @brief Run several statements in one round trip asynchronously, see db::query_multi()
+	 *
+	 * @param statements Statements to run, in order
+	 * @param cb Callback to call with one result set per statement
+	 * @param options Per-query options
+	 */
+	void query_multi_callback(std::vector<query_statement> statements, const sql_multi_query_callback& cb, const query_options& options = {});
+
+#ifdef DPP_CORO
+	/**
+	 * @brief Run several statements in one round trip as a coroutine, see db::query_multi()
+	 *
+	 * @param statements Statements to run, in order
+	 * @param options Per-query options
+	 * @return dpp::async which you can co_await to get one result set per statement.
+	 */
+	dpp::async<std::vector<resultset>> co_query_multi(std::vector<query_statement> statements, const query_options& options = {});
+#endif
+
+	/**
+	 * @brief Run a mysql query, with automatic escaping of parameters to prevent SQL injection.
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param lifetime How long to cache this query's resultset in memory for
+	 * @param tags Tables the result is read from, see query_cached()
+	 * @return result set
+	 *
+	 * @note If the query is already cached in memory, a copy of the cached resultset will be returned
+	 * instead of querying the database. Use query_cached() to share the cached resultset instead.
+	 * 
+	 * The parameters given should be a vector of strings. You can instantiate this using "{}".
+	 * The queries are cached as prepared statements and therefore do not need quote symbols
+	 * to be placed around parameters in the query. These will be automatically added if required.
+	 */
+	resultset query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {});
+
+	/**
+	 * @brief Run a mysql query, or return its cached result set without copying it.
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param lifetime How long to cache this query's resultset in memory for, in seconds
+	 * @param tags Tables the result is read from. If empty, they are found from the
+	 * table names in the statement after FROM and JOIN. Give them for statements which
+	 * hide their tables, such as a view or a stored procedure.
+	 * @return shared, immutable result set
+	 *
+	 * @note The cache is keyed on the query and its exact parameters, and is shared with
+	 * query(format, parameters, lifetime). It is bounded by the "cache_entries" and
+	 * "cache_memory" settings, evicting the least recently used results first, and
+	 * expired results are removed in the background. Failed queries are not cached.
+	 * A result is dropped before it expires once any statement writes to one of its
+	 * tags, as found from the table after UPDATE, INTO, FROM or TABLE of the write.
+	 * Writes within a transaction drop them again when it commits.
+	 */
+	std::shared_ptr<const resultset> query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {});
+
+	/**
+	 * @brief Drop every cached result tagged with a table, e.g. after it was changed
+	 * by another process or by a statement which hides its tables, such as CALL
+	 *
+	 * @param table table name, matched without backquotes, schema or case
+	 */
+	void invalidate(const std::string& table);
+
+	/**
+	 * @brief Run a mysql query asynchronously, or answer it from the result cache.
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param cb Callback to call with the resultset
+	 * @param lifetime How long to cache this query's resultset in memory for, in seconds
+	 * @param tags Tables the result is read from, see query_cached()
+	 * @param options Per-query options of the query run on a miss. A call which joins a
+	 * miss already in flight shares that query, and its options.
+	 *
+	 * @note A cache hit calls the callback immediately on the calling thread. On a miss,
+	 * concurrent calls for the same query and parameters are coalesced into one queued
+	 * query, and its result is passed to every waiting callback on the worker thread.
+	 * Each callback gets its own copy of the cached result, use query_cached_callback()
+	 * to share it instead.
+	 */
+	void query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+	/**
+	 * @brief Run a mysql query asynchronously, or answer it from the result cache, passing
+	 * the callback the cached result set without copying it. Otherwise as query_callback().
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param cb Callback to call with the shared, immutable result set
+	 * @param lifetime How long to cache this query's resultset in memory for, in seconds
+	 * @param tags Tables the result is read from, see query_cached()
+	 * @param options Per-query options of the query run on a miss. A call which joins a
+	 * miss already in flight shares that query, and its options.
+	 */
+	void query_cached_callback(const std::string &format, const paramlist &parameters, const sql_shared_query_callback& cb, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+#ifdef DPP_CORO
+	/**
+	 * @brief Run a mysql query as a coroutine, or answer it from the result cache.
+	 * See query_callback(format, parameters, cb, lifetime).
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param lifetime How long to cache this query's resultset in memory for, in seconds
+	 * @param tags Tables the result is read from, see query_cached()
+	 * @param options Per-query options of the query run on a miss. A call which joins a
+	 * miss already in flight shares that query, and its options.
+	 * @return dpp::async which you can co_await to get the result set. A cache hit
+	 * completes without suspending.
+	 */
+	dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+	/**
+	 * @brief Run a mysql query as a coroutine, or answer it from the result cache, without
+	 * copying the cached result set. See query_cached_callback().
+	 * 
+	 * @param format Format string, where each parameter should be indicated by a ? symbol
+	 * @param parameters Parameters to prepare into the query in place of the ?'s
+	 * @param lifetime How long to cache this query's resultset in memory for, in seconds
+	 * @param tags Tables the result is read from, see query_cached()
+	 * @param options Per-query options of the query run on a miss. A call which joins a
+	 * miss already in flight shares that query, and its options.
+	 * @return dpp::async which you can co_await to get the shared, immutable result set.
+	 * A cache hit completes without suspending.
+	 */
+	dpp::async<std::shared_ptr<const resultset>> co_query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+#endif
+
+	/**
+	 * @brief Returns number of affected rows from an UPDATE, INSERT, DELETE
+	 * 
+	 * @note This value is by any db::query() call. Take a copy!
+	 * @return size_t Number of affected rows
+	 * @deprecated This is not coroutine-safe and you should use resultset::affected_rows instead
+	 */
+	[[deprecated("Use resultset::affected_rows instead")]] size_t affected_rows();
+
+	/**
+	 * @brief Returns the last error string.
+	 * 
+	 * @note This value is by any db::query() call. Take a copy!
+	 * @return const std::string& Error mesage
+	 * @deprecated This is not coroutine-safe and you should use resultset::error instead
+	 */
+	[[deprecated("Use resultset::error instead")]] const std::string& error();
+
+	/**
+	 * @brief Returns the size of the query cache
+	 * 
+	 * Prepared statement handles are stored in a cache along with their metadata, so that
+	 * they don't have to be re-prepared if they are executed repeatedly. Each pooled connection
+	 * has its own cache. This is a diagnostic and informational function which returns the total
+	 * number of statements in those caches.
+	 * 
+	 * @return size_t Cache size
+	 */
+	size_t cache_size();
+
+	/**
+	 * @brief Returns total number of queries executed since connection was established
+	 * 
+	 * @return size_t Query counter
+	 */
+	size_t query_count();
+
+	/**
+	 * @brief Returns the number of asynchronous queries waiting in a queue lane
+	 * 
+	 * @param lane lane to check
+	 * @return size_t Number of queued queries
+	 */
+	size_t queue_depth(query_lane lane);
+
+	/**
+	 * @brief Number of buckets in a latency_histogram
+	 */
+	constexpr size_t latency_buckets = 120;
+
+	/**
+	 * @brief Distribution of latencies in microseconds, bucketed like an HDR histogram.
+	 * Values below 4 have a bucket each, and each power of two from 4 upwards is split
+	 * into 4 buckets, so no bucket is wider than a quarter of its lowest value. The last
+	 * bucket, from about 30 minutes, also counts anything longer.
+	 */
+	struct latency_histogram {
+		/**
+		 * Number of samples in each bucket
+		 */
+		std::array<uint64_t, latency_buckets> buckets{};
+
+		/**
+		 * Total number of samples
+		 */
+		uint64_t count{0};
+
+		/**
+		 * Sum of all samples, in microseconds
+		 */
+		uint64_t sum{0};
+
+		/**
+		 * @brief Bucket which counts a sample
+		 * @param microseconds sample
+		 * @return bucket index
+		 */
+		static size_t bucket_of(uint64_t microseconds);
+
+		/**
+		 * @brief Highest sample counted by a bucket, e.g. for the `le` label of a Prometheus histogram
+		 * @param bucket bucket index
+		 * @return upper bound in microseconds
+		 */
+		static uint64_t upper_bound(size_t bucket);
+
+		/**
+		 * @brief Estimate a percentile, as the upper bound of the bucket it falls in
+		 * @param p percentile, 0 to 100
+		 * @return microseconds, or 0 if there are no samples
+		 */
+		[[nodiscard]] uint64_t percentile(double p) const;
+	};
+
+	/**
+	 * @brief Metrics of one statement, as returned by db::metrics_snapshot()
+	 */
+	struct statement_metrics {
+		/**
+		 * SQL text of the statement, with its ? placeholders
+		 */
+		std::string sql;
+
+		/**
+		 * Number of times the statement ran
+		 */
+		uint64_t executions{0};
+
+		/**
+		 * Rows fetched, including streamed rows
+		 */
+		uint64_t rows{0};
+
+		/**
+		 * Bytes of column values fetched
+		 */
+		uint64_t bytes{0};
+
+		/**
+		 * Number of runs which returned an error
+		 */
+		uint64_t errors{0};
+
+		/**
+		 * Time spent on the connection, from the first attempt to the result,
+		 * including any reconnect and retry
+		 */
+		latency_histogram execution;
+
+		/**
+		 * Time asynchronous queries spent queued before a worker or the
+		 * non-blocking engine took them. Synchronous queries don't queue.
+		 */
+		latency_histogram queue_wait;
+	};
+
+	/**
+	 * @brief Collect the metrics of every statement run since the process started.
+	 *
+	 * Each thread records metrics into its own counters without locking, so recording
+	 * costs a few uncontended stores per query. A snapshot adds up every thread's counters.
+	 * Statements are those given to db::intern(), and prepared statements of string
+	 * queries, which are interned implicitly. Multi-statement queries are not recorded.
+	 *
+	 * @return metrics of each statement which has run or queued
+	 */
+	std::vector<statement_metrics> metrics_snapshot();
+
+	/**
+	 * @brief Start an SQL transaction.
+	 * The transaction is queued like a query, and runs on one connection which
+	 * it holds until it completes. Every db::query() call within the closure runs
+	 * on that connection, so no other query can end up inside the transaction. Other
+	 * connections of the pool carry on serving other queries meanwhile. Any number
+	 * of transactions may be queued at once, each runs when a worker reaches it.
+	 *
+	 * @param closure The transactional code to execute.
+	 * @param callback Callback to call when the transaction completes
+	 *
+	 * @note The closure should only ever execute queries using db::query(),
+	 * it should NOT use async queries/co_query() as these run on other connections,
+	 * outside the transaction. With a pool_size of 1, awaiting one from within the
+	 * closure will wait forever.
+	 * Returning false from the closure, or throwing any exception at all
+	 * will roll back the transaction, else it will be committed when the
+	 * closure ends.
+	 * @warning The coroutine will execute asynchronously in a different thread.
+	 * You should use the callback to be notified when it completes. The resultset
+	 * passed as the parameter will be empty.
+	 */
+	void transaction(std::function<bool()> closure, sql_query_callback callback = {});
+
+#ifdef DPP_CORO
+	/**
+	 * @brief Start an SQL transaction in a coroutine that can be awaited.
+	 * See db::transaction(), the transaction holds one connection until it completes.
+	 *
+	 * @param closure The transactional code to execute.
+	 * @return Awaitable, returns an empty resultset on completion of transaction
+	 *
+	 * @note The closure should only ever execute queries using db::query(),
+	 * it should NOT use async queries/co_query() as these run on other connections,
+	 * outside the transaction. With a pool_size of 1, awaiting one from within the
+	 * closure will wait forever.
+	 * Returning false from the closure, or throwing any exception at all
+	 * will roll back the transaction, else it will be committed when the
+	 * closure ends.
+	 */
+	dpp::async<resultset> co_transaction(std::function<bool()> closure);
+
+	/**
+	 * @brief Internal state of a running coroutine transaction
+	 */
+	struct txn_state;
+
+	/**
+	 * @brief Handle to a coroutine transaction, passed to the closure of
+	 * co_transaction(std::function<dpp::task<bool>(txn&)>). Queries made through
+	 * it run on the transaction's connection, and can be awaited.
+	 */
+	class txn {
+		std::shared_ptr<txn_state> state;
+	public:
+		/**
+		 * @brief Construct a handle, used internally by co_transaction()
+		 * @param s transaction state
+		 */
+		explicit txn(std::shared_ptr<txn_state> s);
+
+		/**
+		 * @brief Run a query within the transaction
+		 *
+		 * @param format Format string, where each parameter should be indicated by a ? symbol
+		 * @param parameters Parameters to prepare into the query in place of the ?'s
+		 * @param options Per-query options
+		 * @return dpp::async which you can co_await to get the result set
+		 */
+		dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters = {}, const query_options& options = {});
+
+		/**
+		 * @brief Run a query within the transaction through an interned statement handle
+		 *
+		 * @param key Interned statement
+		 * @param parameters Parameters to prepare into the query in place of the ?'s
+		 * @param options Per-query options
+		 * @return dpp::async which you can co_await to get the result set
+		 */
+		dpp::async<resultset> co_query(const query_key& key, const paramlist &parameters = {}, const query_options& options = {});
+	};
+
+	/**
+	 * @brief Start an SQL transaction whose closure is a coroutine.
+	 * The transaction is queued like any other query, and holds one connection and
+	 * the worker serving it until it completes. The closure may co_await anything,
+	 * such as D++ API calls, whilst the rest of the pool keeps serving other queries.
+	 *
+	 * @param closure The transactional coroutine. Queries awaited through the txn&
+	 * run on the transaction's connection.
+	 * @return Awaitable, returns an empty resultset on completion of the transaction,
+	 * or one holding an error if it could not be started or committed
+	 *
+	 * @note Returning false from the closure, or throwing any exception at all
+	 * will roll back the transaction, else it will be committed when the
+	 * closure ends. Don't keep the txn& beyond the closure.
+	 * Queries awaited through db::co_query() rather than the txn& need another
+	 * worker, so with as many transactions running as there are workers they wait
+	 * until one completes.
+	 */
+	dpp::async<resultset> co_transaction(std::function<dpp::task<bool>(txn&)> closure);
+#endif
+
+	/**
+	 * @brief Internal state of a database: its pool, replicas, queues, workers and result cache
+	 */
+	struct pool_state;
+
+	/**
+	 * @brief A database of its own, with its own connection pool, replicas, queues,
+	 * worker threads and result cache, for talking to more than one database server
+	 * from one process. The free functions in this namespace use a default database,
+	 * set up by db::init(). Each member function runs the free function of the same
+	 * name on this database instead.
+	 *
+	 * Inside a transaction of this database, db::query() runs on the transaction's
+	 * connection as usual. Prepared statements from db::intern() can be used with
+	 * any database.
+	 *
+	 * For example:
+	 *
+	 * ```cpp
+	 * 	db::database archive;
+	 * 	archive.init(bot, config::get("archive"));
+	 * 	auto rs = co_await archive.co_query("SELECT * FROM old_messages WHERE id = ?", { id });
+	 * ```
+	 */
+	class database {
+		std::unique_ptr<pool_state> pool;
+
+	public:
+		database();
+
+		/**
+		 * @brief Closes the database, once its workers have run every queued query
+		 * @warning Don't destroy a database from within one of its own callbacks
+		 */
+		~database();
+
+		database(const database&) = delete;
+		database& operator=(const database&) = delete;
+
+		/**
+		 * @brief Connect to the database and start its workers
+		 *
+		 * @param bot creating D++ cluster
+		 * @param config configuration block, with the same settings as the `database` block
+		 * @return true if connected, otherwise the error is logged
+		 */
+		bool init(dpp::cluster& bot, const json& config);
+
+		/**
+		 * @brief Write its buffered deltas and disconnect every connection of the database, see db::close()
+		 */
+		void close();
+
+		/**
+		 * @brief See db::query()
+		 */
+		resultset query(const std::string &format, const paramlist &parameters = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::query()
+		 */
+		resultset query(const query_key& key, const paramlist &parameters = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_callback()
+		 */
+		void query_callback(const std::string &format, paramlist parameters, sql_query_callback cb, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_callback()
+		 */
+		void query_callback(const query_key& key, paramlist parameters, sql_query_callback cb, const query_options& options = {});
+
+		/**
+		 * @brief See db::query(), with the result cache
+		 */
+		resultset query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {});
+
+		/**
+		 * @brief See db::query_callback(), with the result cache
+		 */
+		void query_callback(const std::string &format, const paramlist &parameters, const sql_query_callback& cb, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_cached()
+		 */
+		std::shared_ptr<const resultset> query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {});
+
+		/**
+		 * @brief See db::query_cached_callback()
+		 */
+		void query_cached_callback(const std::string &format, const paramlist &parameters, const sql_shared_query_callback& cb, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::invalidate()
+		 */
+		void invalidate(const std::string& table);
+
+		/**
+		 * @brief See db::prepare()
+		 */
+		bool prepare(const std::vector<std::string>& statements);
+
+		/**
+		 * @brief See db::query_batch()
+		 */
+		resultset query_batch(const std::string &format, const std::vector<paramlist> &parameter_sets, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_batch_callback()
+		 */
+		void query_batch_callback(const std::string &format, std::vector<paramlist> parameter_sets, const sql_query_callback& cb, const query_options& options = {});
+
+		/**
+		 * @brief See db::accumulate()
+		 */
+		void accumulate(const std::string &format, const paramlist &key, accumulate_delta delta);
+
+		/**
+		 * @brief See db::flush_accumulated()
+		 */
+		void flush_accumulated();
+
+		/**
+		 * @brief See db::query_multi()
+		 */
+		std::vector<resultset> query_multi(const std::vector<query_statement> &statements, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_multi_callback()
+		 */
+		void query_multi_callback(std::vector<query_statement> statements, const sql_multi_query_callback& cb, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_stream()
+		 */
+		resultset query_stream(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const stream_options& stream = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_stream_callback()
+		 */
+		void query_stream_callback(const std::string &format, const paramlist &parameters, const sql_chunk_callback& on_chunk, const sql_query_callback& cb, const stream_options& stream = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::query_as()
+		 */
+		template <mapped_row T> mapped_resultset<T> query_as(const std::string &format, const paramlist &parameters = {}, query_options options = {}) {
+			options.fetch = fetch_typed;
+			return run_mapped<T>([&](const sql_chunk_callback& on_chunk) {
+				return query_stream(format, parameters, on_chunk, {}, options);
+			});
+		}
+
+		/**
+		 * @brief See db::query_as_callback()
+		 */
+		template <mapped_row T> void query_as_callback(const std::string &format, const paramlist &parameters, const sql_mapped_query_callback<T>& cb, query_options options = {}) {
+			options.fetch = fetch_typed;
+			run_mapped_callback<T>([&](const sql_chunk_callback& on_chunk, const sql_query_callback& done) {
+				query_stream_callback(format, parameters, on_chunk, done, {}, options);
+			}, cb);
+		}
+
+		/**
+		 * @brief See db::transaction()
+		 */
+		void transaction(std::function<bool()> closure, sql_query_callback callback = {});
+
+		/**
+		 * @brief See db::queue_depth()
+		 */
+		size_t queue_depth(query_lane lane);
+
+#ifdef DPP_CORO
+		/**
+		 * @brief See db::co_query()
+		 */
+		dpp::async<resultset> co_query(const std::string &format, paramlist parameters = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_query()
+		 */
+		dpp::async<resultset> co_query(const query_key& key, paramlist parameters = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_query(), with the result cache
+		 */
+		dpp::async<resultset> co_query(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_query_cached()
+		 */
+		dpp::async<std::shared_ptr<const resultset>> co_query_cached(const std::string &format, const paramlist &parameters, double lifetime, const std::vector<std::string>& tags = {}, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_query_batch()
+		 */
+		dpp::async<resultset> co_query_batch(const std::string &format, std::vector<paramlist> parameter_sets, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_query_as()
+		 */
+		template <mapped_row T> dpp::async<mapped_resultset<T>> co_query_as(const std::string &format, const paramlist &parameters = {}, const query_options& options = {}) {
+			return dpp::async<mapped_resultset<T>>{ [this, format, parameters, options] <typename C> (C &&cc) { return query_as_callback<T>(format, parameters, std::forward<C>(cc), options); }};
+		}
+
+		/**
+		 * @brief See db::co_query_multi()
+		 */
+		dpp::async<std::vector<resultset>> co_query_multi(std::vector<query_statement> statements, const query_options& options = {});
+
+		/**
+		 * @brief See db::co_transaction()
+		 */
+		dpp::async<resultset> co_transaction(std::function<bool()> closure);
+
+		/**
+		 * @brief See db::co_transaction()
+		 */
+		dpp::async<resultset> co_transaction(std::function<dpp::task<bool>(txn&)> closure);
+#endif
+	};
+
+	/**
+	 * @brief Spreads data across several databases by a snowflake, such as a guild ID.
+	 * A snowflake always maps to the same database, using the same formula as Discord
+	 * uses to pick a gateway shard for a guild: `(id >> 22) % count`. Changing the
+	 * number of databases moves most snowflakes, so existing rows must be migrated.
+	 *
+	 * For example, with a `shards` array of `database` blocks in the configuration:
+	 *
+	 * ```cpp
+	 * 	db::shard_router guilds;
+	 * 	guilds.init(bot, config::get("shards"));
+	 * 	auto rs = co_await guilds.route(event.command.guild_id).co_query("SELECT * FROM settings WHERE guild_id = ?", { event.command.guild_id });
+	 * ```
+	 */
+	class shard_router {
+		std::vector<std::unique_ptr<database>> shards;
+
+	public:
+		/**
+		 * @brief Connect to every database
+		 *
+		 * @param bot creating D++ cluster
+		 * @param config array of configuration blocks, one per database, each with
+		 * the same settings as the `database` block
+		 * @return true if every database connected, otherwise the errors are logged
+		 */
+		bool init(dpp::cluster& bot, const json& config);
+
+		/**
+		 * @brief Disconnect every database
+		 */
+		void close();
+
+		/**
+		 * @brief Number of databases
+		 * @return count
+		 */
+		[[nodiscard]] size_t size() const;
+
+		/**
+		 * @brief Get the database holding a snowflake's rows
+		 *
+		 * @param key snowflake
+		 * @return database
+		 * @throw std::out_of_range there are no databases
+		 */
+		database& route(dpp::snowflake key);
+
+		/**
+		 * @brief Get a database by its position in the configuration, e.g. to run
+		 * a query on every database
+		 *
+		 * @param index position
+		 * @return database
+		 * @throw std::out_of_range index is out of range
+		 */
+		database& shard(size_t index);
+	};
+
+	/**
+	 * @brief Call a function with the offset of each ? placeholder in an SQL statement,
+	 * ignoring any within quoted strings, quoted identifiers and comments
+	 *
+	 * @param sql SQL statement
+	 * @param f function taking the offset of a placeholder
+	 */
+	template <typename F> constexpr void for_each_placeholder(std::string_view sql, F&& f) {
+		char quote{0};
+		for (size_t i = 0; i < sql.size(); ++i) {
+			char c = sql[i];
+			char next = i + 1 < sql.size() ? sql[i + 1] : 0;
+			if (quote) {
+				if (c == '\\' && quote != '`') {
+					++i;
+				} else if (c == quote) {
+					quote = 0;
+				}
+			} else if (c == '\'' || c == '"' || c == '`') {
+				quote = c;
+			} else if (c == '#' || (c == '-' && next == '-' && (i + 2 >= sql.size() || sql[i + 2] <= ' '))) {
+				while (i < sql.size() && sql[i] != '\n') {
+					++i;
+				}
+			} else if (c == '/' && next == '*') {
+				for (i += 2; i + 1 < sql.size() && !(sql[i] == '*' && sql[i + 1] == '/'); ++i);
+				++i;
+			} else if (c == '?') {
+				f(i);
+			}
+		}
+	}
+
+	/**
+	 * @brief Count the ? placeholders in an SQL statement, ignoring any within
+	 * quoted strings, quoted identifiers and comments
+	 *
+	 * @param sql SQL statement
+	 * @return number of placeholders
+	 */
+	constexpr size_t placeholder_count(std::string_view sql) {
+		size_t count{0};
+		for_each_placeholder(sql, [&count](size_t) {
+			++count;
+		});
+		return count;
+	}
+
+	/**
+	 * @brief SQL text which is checked at compile time to have one ? placeholder
+	 * for each of the given parameter types. Constructed implicitly from a string
+	 * literal passed to db::prepare().
+	 *
+	 * @tparam Args parameter types of the statement
+	 */
+	template <typename... Args> struct statement_text {
+		/**
+		 * Statement text
+		 */
+		std::string_view text;
+
+		template <size_t N> consteval statement_text(const char (&sql)[N]) : text(sql, N - 1) {
+			if (placeholder_count(text) != sizeof...(Args)) {
+				throw "db::prepare: the number of ? placeholders does not match the number of parameter types";
+			}
+		}
+	};
+
+	/**
+	 * @brief Native type of a bound_parameter
+	 */
+	enum parameter_kind : uint8_t {
+		pk_null,
+		pk_string,
+		pk_float,
+		pk_double,
+		pk_int8,
+		pk_int16,
+		pk_int32,
+		pk_int64,
+	};
+
+	/**
+	 * @brief A statement parameter bound by reference to the caller's storage.
+	 * Used by db::statement to execute without building a paramlist.
+	 */
+	struct bound_parameter {
+		/**
+		 * Native type of the value
+		 */
+		parameter_kind kind{pk_null};
+
+		/**
+		 * True if an integer kind is unsigned
+		 */
+		bool is_unsigned{false};
+
+		/**
+		 * Value storage, which must outlive the query
+		 */
+		const void* data{nullptr};
+
+		/**
+		 * Length in bytes of a string value
+		 */
+		size_t length{0};
+
+		/**
+		 * Bind a value by reference. Supports integers, bool, float, double,
+		 * std::string, std::string_view, const char*, std::nullptr_t and
+		 * std::optional of any of these.
+		 *
+		 * @tparam T value type
+		 * @param v value
+		 * @return bound parameter referring to v
+		 */
+		template <typename T> static bound_parameter of(const T& v) {
+			if constexpr (is_optional_v<T>) {
+				return v ? of(*v) : bound_parameter{};
+			} else if constexpr (std::is_same_v<T, std::nullptr_t>) {
+				return bound_parameter{};
+			} else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+				return bound_parameter{ .kind = pk_string, .data = v.data(), .length = v.size() };
+			} else if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+				return bound_parameter{ .kind = pk_string, .data = v, .length = std::char_traits<char>::length(v) };
+			} else if constexpr (std::is_same_v<T, float>) {
+				return bound_parameter{ .kind = pk_float, .data = &v };
+			} else if constexpr (std::is_same_v<T, double>) {
+				return bound_parameter{ .kind = pk_double, .data = &v };
+			} else if constexpr (std::is_integral_v<T>) {
+				constexpr parameter_kind kind = sizeof(T) == 1 ? pk_int8 : sizeof(T) == 2 ? pk_int16 : sizeof(T) == 4 ? pk_int32 : pk_int64;
+				static_assert(sizeof(T) <= 8, "bound_parameter: integer type too wide");
+				return bound_parameter{ .kind = kind, .is_unsigned = std::is_unsigned_v<T>, .data = &v };
+			} else {
+				static_assert(std::is_same_v<T, void>, "bound_parameter: unsupported parameter type");
+			}
+		}
+	};
+
+	/**
+	 * @brief Run a mysql query with parameters bound by reference. This is the
+	 * execution path of db::statement, and does not allocate for its parameters.
+	 *
+	 * @param key Interned statement
+	 * @param parameters Parameters in place of the ?'s
+	 * @param options Per-query options
+	 * @return result set
+	 */
+	resultset execute(const query_key& key, std::span<const bound_parameter> parameters, const query_options& options = {});
+
+	/**
+	 * @brief A prepared statement handle with typed parameters, created by db::prepare().
+	 * Executing it binds each argument directly from its storage in its native type,
+	 * with no std::variant visitation and no paramlist allocation. The statement is
+	 * prepared on each connection on first use, and cached there as usual.
+	 *
+	 * @tparam Args parameter types, one per ? placeholder
+	 */
+	template <typename... Args> class statement {
+		/**
+		 * Interned statement text
+		 */
+		query_key key;
+
+		/**
+		 * Options for every execution
+		 */
+		query_options options;
+
+		/**
+		 * Convert an argument to an owning parameter for the asynchronous queue
+		 */
+		template <typename T> static parameter_type to_parameter(const T& v) {
+			if constexpr (is_optional_v<T>) {
+				return v ? to_parameter(*v) : parameter_type{nullptr};
+			} else if constexpr (std::is_same_v<T, std::string_view> || std::is_same_v<T, const char*>) {
+				return std::string(v);
+			} else if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) < 4) {
+				return static_cast<int32_t>(v);
+			} else {
+				return v;
+			}
+		}
+
+	public:
+		statement() = default;
+
+		/**
+		 * Construct from an interned statement. The placeholder count is checked
+		 * by MySQL when the statement is prepared, rather than at compile time.
+		 * @param k interned statement
+		 * @param o options for every execution
+		 */
+		explicit statement(query_key k, query_options o = {}) : key(std::move(k)), options(o) {
+		}
+
+		/**
+		 * Interned statement
+		 * @return statement handle
+		 */
+		[[nodiscard]] inline const query_key& handle() const {
+			return key;
+		}
+
+		/**
+		 * Execute the statement synchronously
+		 * @param args parameters
+		 * @return result set
+		 */
+		resultset query(const Args&... args) const {
+			const std::array<bound_parameter, sizeof...(Args)> bound{ bound_parameter::of(args)... };
+			return execute(key, bound, options);
+		}
+
+		/**
+		 * Execute the statement synchronously
+		 * @param args parameters
+		 * @return result set
+		 */
+		resultset operator()(const Args&... args) const {
+			return query(args...);
+		}
+
+		/**
+		 * Execute the statement asynchronously. The arguments are copied for the queue.
+		 * @param cb Callback to call on completion of the query
+		 * @param args parameters
+		 */
+		void query_callback(const sql_query_callback& cb, const Args&... args) const {
+			db::query_callback(key, paramlist{ to_parameter(args)... }, cb, options);
+		}
+
+#ifdef DPP_CORO
+		/**
+		 * Execute the statement as a coroutine. The arguments are copied for the queue.
+		 * @param args parameters
+		 * @return dpp::async which you can co_await to get the result set.
+		 */
+		dpp::async<resultset> co_query(const Args&... args) const {
+			return db::co_query(key, paramlist{ to_parameter(args)... }, options);
+		}
+#endif
+	};
+
+	/**
+	 * @brief Create a typed prepared statement handle. The SQL must be a string
+	 * literal, and its ? placeholders are counted at compile time, so a mismatch
+	 * with the number of parameter types fails to compile.
+	 *
+	 * For example:
+	 *
+	 * ```cpp
+	 * 	static const auto set_name = db::prepare<std::string, uint64_t>("UPDATE users SET name = ? WHERE id = ?");
+	 * 	set_name("brain", user_id);
+	 * ```
+	 *
+	 * @tparam Args parameter types, one per ? placeholder
+	 * @param sql SQL statement
+	 * @param options Options for every execution
+	 * @return statement handle
+	 */
+	template <typename... Args> statement<Args...> prepare(statement_text<std::type_identity_t<Args>...> sql, const query_options& options = {}) {
+		return statement<Args...>(intern(std::string(sql.text)), options);
+	}
 };